@@ -9,11 +9,22 @@
 
 #include "Application.h"
 #include "Esp.h"
+#include "EspTaskManager.h"
+#include "LuaEngine.h"
+#include "SystemInterface.h"
 
 m8r::Application _application(23);
+lua::LuaScriptingLanguage _luaScriptingLanguage;
 
 void systemInitialized()
 {
+    m8r::system()->registerScriptingLanguage(&_luaScriptingLanguage);
+    
+    // Lua collection runs in the time between tasks
+    static_cast<m8r::EspTaskManager*>(m8r::system()->taskManager())->setIdleFunction([](uint32_t us) {
+        _luaScriptingLanguage.collectGarbage(us);
+    });
+    
     _application.runLoop();
 }
 
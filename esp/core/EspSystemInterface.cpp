@@ -22,10 +22,12 @@
 #include "EspTaskManager.h"
 #include "EspTCP.h"
 #include "EspUDP.h"
+#include "FlashCache.h"
 #include "MDNSResponder.h"
 #include "MString.h"
 #include "SystemInterface.h"
 #include "TCP.h"
+#include "UDPBatcher.h"
 #include <cstdlib>
 
 #ifndef USE_LITTLEFS
@@ -42,12 +44,33 @@ static const char* WIFIAP_PWD = "m8rscript";
 static const char* UserDataFilename = ".userdata";
 
 static os_timer_t startupTimer;
+static os_timer_t flashSyncTimer;
+static bool flashSyncArmed = false;
 static os_timer_t micros_overflow_timer;
 static uint32_t micros_at_last_overflow_tick = 0;
 static uint32_t micros_overflow_count = 0;
 static void (*_initializedCB)();
 static bool _calledInitializeCB = false;
 
+// Armed when a flash sector goes dirty. Runs until everything is written
+// back, so it doesn't depend on tasks running
+static void flashSyncArm()
+{
+    if (!flashSyncArmed) {
+        flashSyncArmed = true;
+        os_timer_arm(&flashSyncTimer, FLASH_CACHE_SYNC_MS, false);
+    }
+}
+
+static void flashSyncTick(void* arg)
+{
+    flashSyncArmed = false;
+    m8r::FlashCache::syncDue();
+    if (m8r::FlashCache::dirty()) {
+        flashSyncArm();
+    }
+}
+
 void micros_overflow_tick(void* arg) {
     uint32_t m = system_get_time();
     if(m < micros_at_last_overflow_tick) {
@@ -102,6 +125,26 @@ void initmdns();
 
 static m8r::Mad<m8r::TCP> _logTCP;
 
+// Log connections that can't keep up get lines dropped rather than
+// queueing without limit. They are told how many once they catch up
+struct LogConnection
+{
+    bool throttled = false;
+    uint32_t linesDropped = 0;
+};
+
+// Indexed by connection id, grown as connections come in, so the log
+// takes as many as the EspTCP is set to
+static m8r::Vector<LogConnection> _logConnections;
+
+static LogConnection& logConnection(int16_t connectionId)
+{
+    while (_logConnections.size() <= size_t(connectionId)) {
+        _logConnections.push_back(LogConnection());
+    }
+    return _logConnections[connectionId];
+}
+
 void setDeviceName(const char*);
 
 class EspSystemInterface : public m8r::SystemInterface
@@ -129,9 +172,22 @@ public:
     }
 
 private:
+#ifndef USE_LITTLEFS
+    // Everything SPIFFS wrote is on flash once it's unmounted
+    class FileSystem : public m8r::SpiffsFS
+    {
+    public:
+        virtual void unmount() override
+        {
+            m8r::SpiffsFS::unmount();
+            m8r::FlashCache::sync();
+        }
+    };
+#endif
+
     m8r::EspGPIOInterface _gpio;
 #ifndef USE_LITTLEFS
-    m8r::SpiffsFS _fileSystem;
+    FileSystem _fileSystem;
 #else
     m8r::LittleFS _fileSystem;
 #endif
@@ -143,7 +199,11 @@ void EspSystemInterface::vprintf(m8r::ROMString fmt, va_list args) const
     m8r::String s = m8r::String::vformat(fmt, args);
     
     if (_logTCP.valid()) {
-        for (uint16_t connection = 0; connection < m8r::TCP::MaxConnections; ++connection) {
+        for (uint16_t connection = 0; connection < _logConnections.size(); ++connection) {
+            if (_logConnections[connection].throttled) {
+                _logConnections[connection].linesDropped++;
+                continue;
+            }
             _logTCP->send(connection, s.c_str());
         }
     }
@@ -167,6 +227,7 @@ public:
     virtual void TCPevent(m8r::TCP* tcp, m8r::TCPDelegate::Event event, int16_t connectionId, const char* data, int16_t length) override
     {
         if (event == m8r::TCPDelegate::Event::Connected) {
+            logConnection(connectionId) = LogConnection();
             tcp->send(connectionId, "Start m8rscript Log\n\n");
         }
     }    
@@ -311,6 +372,18 @@ void gotStationIP()
         _calledInitializeCB = true;
     }
     _logTCP = m8r::system()->createTCP(&_myLogTCPDelegate, 23);
+    
+    m8r::EspTCP* logTCP = static_cast<m8r::EspTCP*>(_logTCP.get());
+    logTCP->setBackpressureFunction([](m8r::EspTCP* tcp, int16_t connectionId, bool throttle) {
+        LogConnection& connection = logConnection(connectionId);
+        connection.throttled = throttle;
+        if (!throttle && connection.linesDropped) {
+            char buf[40];
+            snprintf(buf, sizeof(buf), "[%u log lines dropped]\n", unsigned(connection.linesDropped));
+            tcp->send(connectionId, buf);
+            connection.linesDropped = 0;
+        }
+    });
 }
 
 static const uint8_t NumWifiTries = 10;
@@ -376,6 +449,17 @@ void initializeSystem(void (*initializedCB)())
     _initializedCB = initializedCB;
     system_update_cpu_freq(160);
     uart_div_modify(0, UART_CLK_FREQ /115200);
+    
+    // TCP writes are coalesced during a task and pushed out after it, UDP
+    // batches go once they have waited long enough
+    static_cast<m8r::EspTaskManager*>(m8r::system()->taskManager())->setIterationFunction([]() {
+        m8r::EspTCP::flushAll();
+        m8r::UDPBatcher::flushDue();
+    });
+    
+    os_timer_disarm(&flashSyncTimer);
+    os_timer_setfn(&flashSyncTimer, (os_timer_func_t*) &flashSyncTick, nullptr);
+    m8r::FlashCache::setDirtyFunction(flashSyncArm);
 
 #ifndef NDEBUG
     gdbstub_init();
@@ -392,24 +476,17 @@ void initializeSystem(void (*initializedCB)())
 
 static s32_t spiffsRead(u32_t addr, u32_t size, u8_t *dst)
 {
-    return (flashmem_read(dst, addr, size) == size) ? SPIFFS_OK : SPIFFS_ERR_NOT_READABLE;
+    return m8r::FlashCache::read(addr, dst, size) ? SPIFFS_OK : SPIFFS_ERR_NOT_READABLE;
 }
 
 static s32_t spiffsWrite(u32_t addr, u32_t size, u8_t *src)
 {
-    return (flashmem_write(src, addr, size) == size) ? SPIFFS_OK : SPIFFS_ERR_NOT_WRITABLE;
+    return m8r::FlashCache::write(addr, src, size) ? SPIFFS_OK : SPIFFS_ERR_NOT_WRITABLE;
 }
 
 static s32_t spiffsErase(u32_t addr, u32_t size)
 {
-    u32_t firstSector = flashmem_get_sector_of_address(addr);
-    u32_t lastSector = firstSector;
-    while(firstSector <= lastSector) {
-        if(!flashmem_erase_sector(firstSector++)) {
-            return SPIFFS_ERR_INTERNAL;
-        }
-    }
-    return SPIFFS_OK;
+    return m8r::FlashCache::erase(addr, size) ? SPIFFS_OK : SPIFFS_ERR_INTERNAL;
 }
 
 #ifndef USE_LITTLEFS
@@ -424,35 +501,66 @@ void m8r::SpiffsFS::setConfig(spiffs_config& config)
 
 #else
 
+// LittleFS blocks are flash sectors, the unit of erase, and cover the file
+// system partition. The sizes below can be set at build time. Commits are
+// padded to LITTLEFS_PROG_SIZE, so a smaller one wears the flash less.
+// FlashCache is under all of it, so small reads and programs are cheap
+#ifndef LITTLEFS_READ_SIZE
+#define LITTLEFS_READ_SIZE 16
+#endif
+
+#ifndef LITTLEFS_PROG_SIZE
+#define LITTLEFS_PROG_SIZE 16
+#endif
+
+// Bytes in each of the read, prog and per file caches. 256 is a flash page
+#ifndef LITTLEFS_CACHE_SIZE
+#define LITTLEFS_CACHE_SIZE 256
+#endif
+
+// Bytes of free block bitmap. 0 for enough to cover every block, so free
+// blocks are found in one scan
+#ifndef LITTLEFS_LOOKAHEAD_SIZE
+#define LITTLEFS_LOOKAHEAD_SIZE 0
+#endif
+
+// Erases of a metadata block before it is moved, for wear leveling
+#ifndef LITTLEFS_BLOCK_CYCLES
+#define LITTLEFS_BLOCK_CYCLES 500
+#endif
+
+static constexpr lfs_size_t LittleFSBlockSize = SPI_FLASH_SEC_SIZE;
+
+static_assert(LITTLEFS_CACHE_SIZE % LITTLEFS_READ_SIZE == 0 && LITTLEFS_CACHE_SIZE % LITTLEFS_PROG_SIZE == 0,
+              "LITTLEFS_CACHE_SIZE must be a multiple of the read and prog sizes");
+static_assert(LittleFSBlockSize % LITTLEFS_CACHE_SIZE == 0, "LITTLEFS_CACHE_SIZE must divide the sector size");
+static_assert(LITTLEFS_LOOKAHEAD_SIZE % 8 == 0, "LITTLEFS_LOOKAHEAD_SIZE must be a multiple of 8");
+
 static int lfs_flash_read(const struct lfs_config *c,
     lfs_block_t block, lfs_off_t off, void *dst, lfs_size_t size) {
-    uint32_t addr = (block * 256) + off;
+    uint32_t addr = flashmem_get_fs_start() + block * c->block_size + off;
     return spiffsRead(addr, size, static_cast<uint8_t*>(dst)) == SPIFFS_OK ? 0 : -1;
 }
 
 static int lfs_flash_prog(const struct lfs_config *c,
     lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
-    uint32_t addr = (block * 256) + off;
+    uint32_t addr = flashmem_get_fs_start() + block * c->block_size + off;
     const uint8_t *src = reinterpret_cast<const uint8_t *>(buffer);
     return spiffsWrite(addr, size, const_cast<uint8_t*>(src)) == SPIFFS_OK ? 0 : -1;
 }
 
 static int lfs_flash_erase(const struct lfs_config *c, lfs_block_t block) {
-    uint32_t addr = (block * 256);
-    uint32_t size = 256;
-    return spiffsErase(addr, size) == SPIFFS_OK ? 0 : -1;
+    uint32_t addr = flashmem_get_fs_start() + block * c->block_size;
+    return spiffsErase(addr, c->block_size) == SPIFFS_OK ? 0 : -1;
 }
 
 static int lfs_flash_sync(const struct lfs_config *c) {
-    /* NOOP */
-    (void) c;
-    return 0;
+    return m8r::FlashCache::sync() ? 0 : -1;
 }
 
 void m8r::LittleFS::setConfig(lfs_config& config)
 {
-    lfs_size_t blockSize = 256;
-    lfs_size_t size = 3 * 1024 * 1024;
+    lfs_size_t blockCount = (flashmem_get_fs_end() - flashmem_get_fs_start()) / LittleFSBlockSize;
     
     memset(&config, 0, sizeof(config));
     //config.context = (void*) this;
@@ -460,13 +568,13 @@ void m8r::LittleFS::setConfig(lfs_config& config)
     config.prog = lfs_flash_prog;
     config.erase = lfs_flash_erase;
     config.sync = lfs_flash_sync;
-    config.read_size = 64;
-    config.prog_size = 64;
-    config.block_size =  blockSize;
-    config.block_count = blockSize ? size / blockSize: 0;
-    config.block_cycles = 16; // TODO - need better explanation
-    config.cache_size = 64;
-    config.lookahead_size = 64;
+    config.read_size = LITTLEFS_READ_SIZE;
+    config.prog_size = LITTLEFS_PROG_SIZE;
+    config.block_size = LittleFSBlockSize;
+    config.block_count = blockCount;
+    config.block_cycles = LITTLEFS_BLOCK_CYCLES;
+    config.cache_size = LITTLEFS_CACHE_SIZE;
+    config.lookahead_size = LITTLEFS_LOOKAHEAD_SIZE ? LITTLEFS_LOOKAHEAD_SIZE : (blockCount + 63) / 64 * 8;
     config.read_buffer = nullptr;
     config.prog_buffer = nullptr;
     config.lookahead_buffer = nullptr;
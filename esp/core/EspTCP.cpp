@@ -11,11 +11,20 @@
 
 #include "SystemInterface.h"
 
+#include <lwip/tcp_impl.h>
+
 using namespace m8r;
 
+EspTCP* EspTCP::_first = nullptr;
+EspTCP::OverflowBlock* EspTCP::_freeOverflowBlocks = nullptr;
+uint16_t EspTCP::_freeOverflowBlockCount = 0;
+
 void EspTCP::init(TCPDelegate* delegate, uint16_t port, IPAddr ip)
 {
     TCP::init(delegate, port, ip);
+    _next = _first;
+    _first = this;
+    
     _listenpcb = tcp_new();
     tcp_arg(_listenpcb, this);
     
@@ -32,19 +41,91 @@ void EspTCP::init(TCPDelegate* delegate, uint16_t port, IPAddr ip)
 
 EspTCP::~EspTCP()
 {
-    for (auto& it : _clients) {
-        if (it.inUse()) {
-            it.disconnect();
-            _delegate->TCPevent(this, TCPDelegate::Event::SentData, &it - &(_clients[0]));
+    for (auto it : _clients) {
+        if (it) {
+            int16_t connectionId = it->id();
+            closeClient(it);
+            _delegate->TCPevent(this, TCPDelegate::Event::SentData, connectionId);
         }
     }
     tcp_close(_listenpcb);
+    
+    while (_freeClients) {
+        Mad<Client> client(_freeClients);
+        _freeClients = _freeClients->_nextFree;
+        client.destroy(MemoryType::Network);
+    }
+    
+    for (EspTCP** it = &_first; *it; it = &(*it)->_next) {
+        if (*it == this) {
+            *it = _next;
+            break;
+        }
+    }
+}
+
+void EspTCP::flush()
+{
+    for (auto it : _clients) {
+        if (it) {
+            it->flush();
+        }
+    }
+}
+
+void EspTCP::flushAll()
+{
+    for (EspTCP* tcp = _first; tcp; tcp = tcp->_next) {
+        tcp->flush();
+    }
+}
+
+EspTCP::Client* EspTCP::openClient(tcp_pcb* pcb, int16_t connectionId)
+{
+    if (connectionId < 0) {
+        for (connectionId = 0; connectionId < int16_t(_clients.size()); ++connectionId) {
+            if (!_clients[connectionId]) {
+                break;
+            }
+        }
+    }
+    if (connectionId >= _maxConnections) {
+        return nullptr;
+    }
+    
+    Client* client = _freeClients;
+    if (client) {
+        _freeClients = client->_nextFree;
+    } else {
+        client = Mad<Client>::create(MemoryType::Network).get();
+        if (!client) {
+            return nullptr;
+        }
+    }
+    
+    while (int16_t(_clients.size()) <= connectionId) {
+        _clients.push_back(nullptr);
+    }
+    _clients[connectionId] = client;
+    client->open(pcb, this, connectionId);
+    return client;
+}
+
+void EspTCP::closeClient(Client* client)
+{
+    _clients[client->id()] = nullptr;
+    client->disconnect();
+    client->_nextFree = _freeClients;
+    _freeClients = client;
 }
 
 err_t EspTCP::clientConnected(tcp_pcb* pcb, err_t err)
 {
-    assert(!_clients[0].inUse());
-    _clients[0] = Client(pcb, this);
+    assert(!client(0));
+    if (!openClient(pcb, 0)) {
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
     _delegate->TCPevent(this, TCPDelegate::Event::Connected, 0);
     return 0;
 }
@@ -53,106 +134,392 @@ err_t EspTCP::accept(tcp_pcb* pcb, int8_t err)
 {
     tcp_accepted(_listenpcb);
     
-    for (auto& it : _clients) {
-        if (!it.inUse()) {
-            it = Client(pcb, this);
-            _delegate->TCPevent(this, TCPDelegate::Event::Connected, &it - _clients);
-            return 0;
-        }
+    Client* client = openClient(pcb);
+    if (!client) {
+        tcp_abort(pcb);
+        return ERR_ABRT;
     }
-    tcp_abort(pcb);
+    _delegate->TCPevent(this, TCPDelegate::Event::Connected, client->id());
     return 0;
 }
 
-int16_t EspTCP::findConnection(tcp_pcb* pcb)
+err_t EspTCP::Client::_recv(void *arg, tcp_pcb* pcb, pbuf* buf, err_t err)
 {
-    for (auto& it : _clients) {
-        if (it.matches(pcb)) {
-            return &it - _clients;
-        }
-    }
-    return -1;
+    Client* client = reinterpret_cast<Client*>(arg);
+    return client->_tcp->recv(client, buf, err);
 }
 
-err_t EspTCP::recv(tcp_pcb* pcb, pbuf* buf, int8_t err)
+err_t EspTCP::Client::_sent(void *arg, tcp_pcb* pcb, u16_t len)
 {
-    int16_t connectionId = findConnection(pcb);
-    if (connectionId < 0) {
-        return -1;
+    Client* client = reinterpret_cast<Client*>(arg);
+    return client->_tcp->sent(client, len);
+}
+
+err_t EspTCP::Client::_poll(void *arg, tcp_pcb* pcb)
+{
+    // A tcp_write that failed with ERR_MEM when nothing was in flight has
+    // no ack coming to retry it, so retry from here
+    Client* client = reinterpret_cast<Client*>(arg);
+    if (client->_tail != client->_head) {
+        client->write();
+        client->_tcp->checkBackpressure(client);
     }
+    return ERR_OK;
+}
+
+void EspTCP::Client::flushTimerCB(void* arg)
+{
+    reinterpret_cast<Client*>(arg)->flush();
+}
+
+void EspTCP::Client::_error(void *arg, err_t err)
+{
+    // lwIP has already freed the pcb
+    Client* client = reinterpret_cast<Client*>(arg);
+    client->_pcb = nullptr;
+    client->_tcp->error(client);
+}
+
+err_t EspTCP::recv(Client* client, pbuf* buf, int8_t err)
+{
+    int16_t connectionId = client->id();
     
     if (!buf) {
         // Disconnected
-        _clients[connectionId].disconnect();
+        closeClient(client);
         _delegate->TCPevent(this, TCPDelegate::Event::SentData, connectionId);
         return 0;
     }
     
-    assert(buf->len == buf->tot_len);
-    _delegate->TCPevent(this, TCPDelegate::Event::ReceivedData, connectionId, reinterpret_cast<const char*>(buf->payload), buf->len);
-    tcp_recved(pcb, buf->tot_len);
+    if (_segmentDelegate) {
+        // Hold before calling out so a release from inside the delegate
+        // finds it. If the delegate doesn't keep it, give back this chain
+        // and not the oldest, which the delegate may still be using. It's
+        // already gone if the delegate released it or closed the connection
+        client->hold(buf);
+        if (!_segmentDelegate->TCPreceived(this, connectionId, EspTCPSegments(buf))) {
+            client->release(buf);
+        }
+        return 0;
+    }
+    
+    // lwIP chains segments under load. Hand each one over where it is
+    for (pbuf* p = buf; p; p = p->next) {
+        _delegate->TCPevent(this, TCPDelegate::Event::ReceivedData, connectionId, reinterpret_cast<const char*>(p->payload), p->len);
+    }
+    
+    // The delegate might have closed the connection
+    if (client->inUse()) {
+        tcp_recved(client->pcb(), buf->tot_len);
+    }
     pbuf_free(buf);
     return 0;
 }
 
-err_t EspTCP::sent(tcp_pcb* pcb, u16_t len)
+err_t EspTCP::sent(Client* client, u16_t len)
 {
-    int16_t connectionId = findConnection(pcb);
-    assert(_clients[connectionId].inUse());
-    
-    _clients[connectionId].sent(len);
-    _delegate->TCPevent(this, TCPDelegate::Event::SentData, connectionId);
+    client->sent(len);
+    checkBackpressure(client);
+    _delegate->TCPevent(this, TCPDelegate::Event::SentData, client->id());
     return 0;
 }
 
-void EspTCP::Client::send(const char* data, uint16_t length)
+void EspTCP::error(Client* client)
+{
+    int16_t connectionId = client->id();
+    closeClient(client);
+    _delegate->TCPevent(this, TCPDelegate::Event::SentData, connectionId);
+}
+
+void EspTCP::checkBackpressure(Client* client)
+{
+    // Half the mark to let go, so it doesn't flap on every ack
+    bool throttle = client->throttled() ? (client->queued() > _highWaterMark / 2) : (client->queued() > _highWaterMark);
+    if (throttle == client->throttled()) {
+        return;
+    }
+    
+    client->setThrottled(throttle);
+    if (_backpressureFunction) {
+        _backpressureFunction(this, client->id(), throttle);
+    }
+}
+
+uint16_t EspTCP::Client::send(const char* data, uint16_t length)
 {
     if (!length) {
         length = strlen(data);
     }
-
-    if (_sending) {
-        _buffer += String(data, length);
-        return;
+    
+    if (!_buffer) {
+        _buffer = Mallocator::shared()->allocate<char>(MemoryType::Network, SendBufferSize).get();
+        if (!_buffer) {
+            return length;
+        }
     }
 
-    _sending = true;
+    // Behind anything already waiting in the overflow, to keep the order
+    if (!_overflowFirst) {
+        uint16_t copied = copyIn(data, length);
+        data += copied;
+        length -= copied;
+    }
+    if (length) {
+        length -= queueOverflow(data, length);
+    }
     
-    uint16_t maxSize = tcp_sndbuf(_pcb);
+    write();
+    return length;
+}
 
-    if (maxSize < length) {
-        // Put the remainder in the buffer
-        _buffer = String(data + maxSize, length - maxSize);
-        length = maxSize;
+EspTCP::OverflowBlock* EspTCP::allocOverflowBlock()
+{
+    OverflowBlock* block = _freeOverflowBlocks;
+    if (block) {
+        _freeOverflowBlocks = block->next;
+        _freeOverflowBlockCount--;
+    } else {
+        block = Mallocator::shared()->allocate<OverflowBlock>(MemoryType::Network).get();
+        if (!block) {
+            return nullptr;
+        }
     }
-    int8_t result = tcp_write(_pcb, data, length, 0);
-    if (result != 0) {
-        system()->printf(ROMSTR("TCP ERROR(%d): failed to send %d bytes to port %d\n"), result, length, _pcb->local_port);
+    block->next = nullptr;
+    block->start = 0;
+    block->end = 0;
+    return block;
+}
+
+void EspTCP::freeOverflowBlock(OverflowBlock* block)
+{
+    if (_freeOverflowBlockCount >= MaxOverflowBlocks) {
+        Mallocator::shared()->deallocate<OverflowBlock>(MemoryType::Network, Mad<OverflowBlock>(block));
+        return;
     }
+    block->next = _freeOverflowBlocks;
+    _freeOverflowBlocks = block;
+    _freeOverflowBlockCount++;
 }
 
-void EspTCP::Client::sent(uint16_t len)
+uint16_t EspTCP::Client::queueOverflow(const char* data, uint16_t length)
 {
-    assert(_sending);
+    uint16_t queued = 0;
+    while (queued < length) {
+        if (!_overflowLast || _overflowLast->end == OverflowBlockSize) {
+            if (_overflowBlocks >= MaxOverflowBlocks) {
+                break;
+            }
+            OverflowBlock* block = allocOverflowBlock();
+            if (!block) {
+                break;
+            }
+            if (_overflowLast) {
+                _overflowLast->next = block;
+            } else {
+                _overflowFirst = block;
+            }
+            _overflowLast = block;
+            _overflowBlocks++;
+        }
+        
+        uint16_t count = OverflowBlockSize - _overflowLast->end;
+        if (count > length - queued) {
+            count = length - queued;
+        }
+        memcpy(_overflowLast->data + _overflowLast->end, data + queued, count);
+        _overflowLast->end += count;
+        queued += count;
+    }
+    _overflowBytes += queued;
+    return queued;
+}
 
-    if (!_buffer.empty()) {
-        uint16_t maxSize = tcp_sndbuf(_pcb);
-        if (maxSize < _buffer.size()) {
-            int8_t result = tcp_write(_pcb, _buffer.c_str(), maxSize, 0);
-            _buffer = _buffer.slice(maxSize);
+void EspTCP::Client::drainOverflow()
+{
+    while (_overflowFirst) {
+        OverflowBlock* block = _overflowFirst;
+        uint16_t copied = copyIn(block->data + block->start, block->end - block->start);
+        block->start += copied;
+        _overflowBytes -= copied;
+        if (block->start < block->end) {
+            // The ring is full
             return;
         }
         
-        int8_t result = tcp_write(_pcb, _buffer.c_str(), _buffer.size(), 0);
-        _buffer.clear();
+        _overflowFirst = block->next;
+        if (!_overflowFirst) {
+            _overflowLast = nullptr;
+        }
+        _overflowBlocks--;
+        freeOverflowBlock(block);
+    }
+}
+
+void EspTCP::Client::clearOverflow()
+{
+    while (_overflowFirst) {
+        OverflowBlock* block = _overflowFirst;
+        _overflowFirst = block->next;
+        freeOverflowBlock(block);
+    }
+    _overflowLast = nullptr;
+    _overflowBlocks = 0;
+    _overflowBytes = 0;
+}
+
+uint16_t EspTCP::Client::copyIn(const char* data, uint16_t length)
+{
+    uint16_t room = SendBufferSize - uint16_t(_head - _tail);
+    if (length > room) {
+        length = room;
+    }
+    
+    // In two pieces if it wraps
+    uint16_t index = _head & (SendBufferSize - 1);
+    uint16_t first = (length < SendBufferSize - index) ? length : SendBufferSize - index;
+    memcpy(_buffer + index, data, first);
+    memcpy(_buffer, data + first, length - first);
+    _head += length;
+    return length;
+}
+
+// Segments lwIP hasn't sent yet. A write that fits in the last one is
+// appended to it, so the change across a write is the segments it made
+static uint32_t unsentSegments(tcp_pcb* pcb)
+{
+    uint32_t count = 0;
+    for (tcp_seg* seg = pcb->unsent; seg; seg = seg->next) {
+        count++;
+    }
+    return count;
+}
+
+void EspTCP::Client::write()
+{
+    for (;;) {
+        // Refill the ring from the overflow as lwIP drains it
+        drainOverflow();
+        if (_tail == _head) {
+            break;
+        }
+        
+        // Up to the end of the ring, or as much as lwIP has room for
+        uint16_t index = _tail & (SendBufferSize - 1);
+        uint16_t length = _head - _tail;
+        if (length > SendBufferSize - index) {
+            length = SendBufferSize - index;
+        }
+        uint16_t room = tcp_sndbuf(_pcb);
+        if (length > room) {
+            length = room;
+        }
+        if (!length) {
+            break;
+        }
+        
+        // lwIP copies, so the ring space is free again as soon as this
+        // returns and a closed connection can't leave it referenced
+        uint32_t segmentsBefore = unsentSegments(_pcb);
+        err_t result = tcp_write(_pcb, _buffer + index, length, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+        if (result != ERR_OK) {
+            // ERR_MEM is lwIP out of segments, try again on the next ack
+            // or poll
+            if (result != ERR_MEM) {
+                system()->printf(ROMSTR("TCP ERROR(%d): failed to send %d bytes to port %d\n"), result, length, _pcb->local_port);
+            }
+            break;
+        }
+        _tail += length;
+        
+        _tcp->_sendStats.bytes += length;
+        _tcp->_sendStats.segments += unsentSegments(_pcb) - segmentsBefore;
+        if (!_unflushed) {
+            _unflushedSince = SystemInterface::currentMicroseconds();
+            uint32_t ms = (_tcp->_flushUs + 999) / 1000;
+            os_timer_disarm(&_flushTimer);
+            os_timer_arm(&_flushTimer, ms ? ms : 1, false);
+        }
+        _unflushed += length;
+    }
+    
+    if (_unflushed && (_unflushed >= _tcp->_flushBytes ||
+            SystemInterface::currentMicroseconds() - _unflushedSince >= _tcp->_flushUs)) {
+        flush();
+    }
+}
+
+void EspTCP::Client::flush()
+{
+    os_timer_disarm(&_flushTimer);
+    if (!_unflushed || !_pcb) {
+        return;
+    }
+    
+    // Nagle still applies, so a small segment can wait here for the ack
+    // of the one before it
+    _unflushed = 0;
+    tcp_output(_pcb);
+    _tcp->_sendStats.flushes++;
+}
+
+void EspTCP::Client::sent(uint16_t len)
+{
+    write();
+}
+
+void EspTCP::Client::release()
+{
+    if (_held.empty()) {
         return;
     }
     
-    _sending = false;
+    pbuf* buf = _held[0];
+    _held.erase(_held.begin());
+    tcp_recved(_pcb, buf->tot_len);
+    pbuf_free(buf);
+}
+
+void EspTCP::Client::release(pbuf* buf)
+{
+    // Newest first, it's almost always the last one
+    for (size_t i = _held.size(); i > 0; --i) {
+        if (_held[i - 1] == buf) {
+            _held.erase(_held.begin() + (i - 1));
+            tcp_recved(_pcb, buf->tot_len);
+            pbuf_free(buf);
+            return;
+        }
+    }
 }
 
 void EspTCP::Client::disconnect()
 {
-    tcp_close(_pcb);
+    // Nothing to acknowledge on a closing connection
+    for (auto it : _held) {
+        pbuf_free(it);
+    }
+    _held.clear();
+    
+    if (_buffer) {
+        Mallocator::shared()->deallocate<char>(MemoryType::Network, Mad<char>(_buffer), SendBufferSize);
+        _buffer = nullptr;
+    }
+    _head = 0;
+    _tail = 0;
+    clearOverflow();
+    _unflushed = 0;
+    os_timer_disarm(&_flushTimer);
+    _throttled = false;
+    
+    // Detach first. The client goes back to the pool, and lwIP can still
+    // call back while the pcb closes. There is no pcb after an error
+    if (_pcb) {
+        tcp_arg(_pcb, nullptr);
+        tcp_recv(_pcb, nullptr);
+        tcp_sent(_pcb, nullptr);
+        tcp_err(_pcb, nullptr);
+        tcp_poll(_pcb, nullptr, 0);
+        tcp_close(_pcb);
+    }
     _pcb = nullptr;
 }
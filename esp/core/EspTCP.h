@@ -15,75 +15,353 @@
 
 #include <lwip/init.h>
 #include <lwip/tcp.h>
+#include <functional>
+
+extern "C" {
+#include "user_interface.h"
+}
+
+// Bytes each connection can queue for sending beyond what lwIP will take.
+// Must be a power of 2
+#ifndef ESP_TCP_SEND_BUFFER_SIZE
+#define ESP_TCP_SEND_BUFFER_SIZE 2048
+#endif
+
+// Data that doesn't fit in the send buffer waits behind it in blocks of
+// ESP_TCP_OVERFLOW_BLOCK_SIZE bytes, at most ESP_TCP_OVERFLOW_BLOCKS per
+// connection. Free blocks are pooled across connections
+#ifndef ESP_TCP_OVERFLOW_BLOCK_SIZE
+#define ESP_TCP_OVERFLOW_BLOCK_SIZE 512
+#endif
+
+#ifndef ESP_TCP_OVERFLOW_BLOCKS
+#define ESP_TCP_OVERFLOW_BLOCKS 4
+#endif
+
+// Writes are coalesced and pushed out by flush(), or sooner once this many
+// bytes are waiting or the oldest of them has waited this long
+#ifndef ESP_TCP_FLUSH_BYTES
+#define ESP_TCP_FLUSH_BYTES TCP_MSS
+#endif
+
+#ifndef ESP_TCP_FLUSH_US
+#define ESP_TCP_FLUSH_US 20000
+#endif
+
+// Default connection limit. Change it per EspTCP with setMaxConnections()
+#ifndef ESP_TCP_MAX_CONNECTIONS
+#define ESP_TCP_MAX_CONNECTIONS m8r::TCP::MaxConnections
+#endif
 
 namespace m8r {
 
+class EspTCP;
+
+// A received pbuf chain seen as a list of segments, straight out of
+// lwIP's buffers. Use with a range for:
+//
+//     for (auto segment : segments) { consume(segment.data, segment.length); }
+//
+class EspTCPSegments
+{
+public:
+    struct Segment
+    {
+        const char* data;
+        uint16_t length;
+    };
+    
+    class const_iterator
+    {
+    public:
+        const_iterator(const pbuf* p) : _p(p) { }
+        Segment operator*() const { return { reinterpret_cast<const char*>(_p->payload), _p->len }; }
+        const_iterator& operator++() { _p = _p->next; return *this; }
+        bool operator!=(const const_iterator& other) const { return _p != other._p; }
+        
+    private:
+        const pbuf* _p;
+    };
+    
+    EspTCPSegments(const pbuf* buf) : _buf(buf) { }
+    
+    const_iterator begin() const { return const_iterator(_buf); }
+    const_iterator end() const { return const_iterator(nullptr); }
+    
+    // Total bytes in all segments
+    uint16_t size() const { return _buf ? _buf->tot_len : 0; }
+    
+private:
+    const pbuf* _buf;
+};
+
+// Receives data from an EspTCP without it being copied. Data the delegate
+// holds on to stays in lwIP's buffers and isn't acknowledged until it is
+// released, so the receive window closes when the consumer falls behind
+class EspTCPSegmentDelegate
+{
+public:
+    virtual ~EspTCPSegmentDelegate() { }
+    
+    // Return true to hold the segments, which then stay valid until they
+    // are given back with EspTCP::release. Returning false releases them
+    // right away
+    virtual bool TCPreceived(EspTCP*, int16_t connectionId, const EspTCPSegments&) = 0;
+};
+
 class EspTCP : public TCP {
 public:
+    static constexpr uint16_t SendBufferSize = ESP_TCP_SEND_BUFFER_SIZE;
+    static_assert(SendBufferSize && (SendBufferSize & (SendBufferSize - 1)) == 0 && SendBufferSize <= 0x8000,
+                  "ESP_TCP_SEND_BUFFER_SIZE must be a power of 2 no bigger than 32768");
+    
+    // Called with true when a connection's send buffer fills past the high
+    // water mark and with false once it has drained to half of that
+    using BackpressureFunction = std::function<void(EspTCP*, int16_t connectionId, bool throttle)>;
+    
+    struct SendStats
+    {
+        uint32_t bytes = 0;
+        uint32_t segments = 0;
+        uint32_t flushes = 0;
+        
+        uint32_t bytesPerSegment() const { return segments ? bytes / segments : 0; }
+        float segmentsPerKB() const { return bytes ? float(segments) * 1024 / bytes : 0; }
+    };
+    
     virtual ~EspTCP();
     
+    // Data that doesn't fit in the send buffer is queued behind it in a
+    // few overflow blocks. What doesn't fit in those either, or can't get
+    // a block, is dropped and counted in droppedBytes(). Watch for
+    // backpressure or check sendSpace() to stay clear of that
     virtual void send(int16_t connectionId, char c) override { send(connectionId, &c, 1); }
     virtual void send(int16_t connectionId, const char* data, uint16_t length = 0) override
     {
-        if (connectionId < 0 || connectionId >= MaxConnections || !_clients[connectionId].inUse()) {
+        Client* c = client(connectionId);
+        if (!c) {
             return;
         }
-        _clients[connectionId].send(data, length);
+        _droppedBytes += c->send(data, length);
+        checkBackpressure(c);
     }
     
     virtual void disconnect(int16_t connectionId) override
     {
-        if (connectionId < 0 || connectionId >= MaxConnections || !_clients[connectionId].inUse()) {
+        Client* c = client(connectionId);
+        if (!c) {
             return;
         }
-        _clients[connectionId].disconnect();
+        closeClient(c);
         _delegate->TCPevent(this, TCPDelegate::Event::SentData, connectionId);
     }
     
     void init(TCPDelegate*, uint16_t, IPAddr);
+    
+    // Connections accepted at once. Lowering it doesn't close connections
+    // already open, it only turns new ones away until there is room
+    void setMaxConnections(uint16_t max) { _maxConnections = max; }
+    uint16_t maxConnections() const { return _maxConnections; }
+    
+    // With a segment delegate, received data goes to it instead of the
+    // TCPDelegate. Other events still go to the TCPDelegate
+    void setSegmentDelegate(EspTCPSegmentDelegate* delegate) { _segmentDelegate = delegate; }
+    
+    // Give back the oldest segments held on the connection, which
+    // acknowledges them and opens the receive window
+    void release(int16_t connectionId)
+    {
+        if (Client* c = client(connectionId)) {
+            c->release();
+        }
+    }
+    
+    // Defaults to 3/4 of SendBufferSize
+    void setHighWaterMark(uint16_t bytes) { _highWaterMark = (bytes > SendBufferSize) ? SendBufferSize : bytes; }
+    void setBackpressureFunction(BackpressureFunction f) { _backpressureFunction = f; }
+    
+    uint16_t sendSpace(int16_t connectionId) const
+    {
+        Client* c = client(connectionId);
+        return c ? c->space() : 0;
+    }
+    
+    uint32_t droppedBytes() const { return _droppedBytes; }
+    
+    // Sends go to lwIP with TCP_WRITE_FLAG_MORE and without a tcp_output,
+    // so small writes pile up in one segment. They go out on flush(), when
+    // a connection has bytes waiting or when a timer armed by the first of
+    // them finds it has waited us. flushAll() is also called at the end of
+    // every task manager iteration
+    void setFlushThreshold(uint16_t bytes, uint32_t us)
+    {
+        _flushBytes = bytes;
+        _flushUs = us;
+    }
+    
+    void flush();
+    static void flushAll();
+    
+    const SendStats& sendStats() const { return _sendStats; }
+    void resetSendStats() { _sendStats = SendStats(); }
 
 private:
     static err_t _clientConnected(void* arg, tcp_pcb *pcb, err_t err) { return reinterpret_cast<EspTCP*>(arg)->clientConnected(pcb, err); }
     err_t clientConnected(tcp_pcb* pcb, err_t err);
 
+    static constexpr uint16_t OverflowBlockSize = ESP_TCP_OVERFLOW_BLOCK_SIZE;
+    static constexpr uint16_t MaxOverflowBlocks = ESP_TCP_OVERFLOW_BLOCKS;
+    
+    // Read from start, written at end. Data never moves once it's in
+    struct OverflowBlock
+    {
+        OverflowBlock* next;
+        uint16_t start;
+        uint16_t end;
+        char data[OverflowBlockSize];
+    };
+    
+    // Free blocks are kept, up to MaxOverflowBlocks, for the next
+    // connection that overflows
+    static OverflowBlock* allocOverflowBlock();
+    static void freeOverflowBlock(OverflowBlock*);
+    static OverflowBlock* _freeOverflowBlocks;
+    static uint16_t _freeOverflowBlockCount;
+
 
+    // Each connection is its own lwIP arg, so callbacks go straight to it
     class Client {
     public:
-        Client() : _pcb(nullptr) { }
-        Client(tcp_pcb* pcb, EspTCP* tcp) : _pcb(pcb)
+        void open(tcp_pcb* pcb, EspTCP* tcp, int16_t id)
         {
-            tcp_arg(pcb, tcp);
+            _pcb = pcb;
+            _tcp = tcp;
+            _id = id;
+            tcp_arg(pcb, this);
             tcp_recv(pcb, _recv);
             tcp_sent(pcb, _sent);
+            tcp_err(pcb, _error);
+            tcp_poll(pcb, _poll, PollInterval);
+            os_timer_disarm(&_flushTimer);
+            os_timer_setfn(&_flushTimer, (os_timer_func_t*) flushTimerCB, this);
         }
         
         bool inUse() const { return _pcb; }
+        int16_t id() const { return _id; }
+        tcp_pcb* pcb() const { return _pcb; }
 
-        void send(const char* data, uint16_t length = 0);
+        // Returns the number of bytes dropped for lack of room or memory
+        uint16_t send(const char* data, uint16_t length = 0);
         void sent(uint16_t len);
         void disconnect();
+        void flush();
+        
+        uint32_t queued() const { return uint16_t(_head - _tail) + _overflowBytes; }
+        uint16_t space() const { return _overflowFirst ? 0 : SendBufferSize - uint16_t(_head - _tail); }
+        
+        bool throttled() const { return _throttled; }
+        void setThrottled(bool throttled) { _throttled = throttled; }
+        
+        void hold(pbuf* buf) { _held.push_back(buf); }
+        
+        // Give back the oldest held chain, or buf if it's still held
+        void release();
+        void release(pbuf* buf);
         
-        bool matches(tcp_pcb* pcb) { return pcb == _pcb; }
+        // Pool free list link
+        Client* _nextFree = nullptr;
         
     private:
-        tcp_pcb* _pcb;
-        bool _sending = false;
-        String _buffer;
+        static err_t _recv(void *arg, tcp_pcb* pcb, pbuf* buf, err_t err);
+        static err_t _sent(void *arg, tcp_pcb* pcb, u16_t len);
+        static void _error(void *arg, err_t err);
+        static err_t _poll(void *arg, tcp_pcb* pcb);
+        static void flushTimerCB(void* arg);
+        
+        // Units of lwIP's 500ms slow timer
+        static constexpr uint8_t PollInterval = 1;
+        
+        // Copy as much as fits into the ring, returns the bytes copied
+        uint16_t copyIn(const char* data, uint16_t length);
+        
+        // Append to the overflow blocks, returns the bytes that fit
+        uint16_t queueOverflow(const char* data, uint16_t length);
+        
+        // Move what the ring has room for out of the overflow blocks
+        void drainOverflow();
+        void clearOverflow();
+        
+        // Hand lwIP as much of the unwritten data as it will take
+        void write();
+        
+        tcp_pcb* _pcb = nullptr;
+        EspTCP* _tcp = nullptr;
+        int16_t _id = -1;
+        
+        // Written to lwIP but not pushed out with tcp_output yet
+        uint16_t _unflushed = 0;
+        uint64_t _unflushedSince = 0;
+        
+        // Pushes them out once they have waited the flush time, for sends
+        // made with no task running to flush them after
+        os_timer_t _flushTimer;
+        
+        // Ring of SendBufferSize bytes, allocated on the first send, for
+        // data lwIP has no room for yet. The counters run freely and wrap,
+        // only their difference matters
+        char* _buffer = nullptr;
+        uint16_t _head = 0;
+        uint16_t _tail = 0;
+        bool _throttled = false;
+        
+        // Sent data that didn't fit in the ring, oldest block first. It moves
+        // into the ring as lwIP takes data out
+        OverflowBlock* _overflowFirst = nullptr;
+        OverflowBlock* _overflowLast = nullptr;
+        uint16_t _overflowBlocks = 0;
+        uint32_t _overflowBytes = 0;
+        
+        // Chains held by the segment delegate, oldest first
+        Vector<pbuf*> _held;
     };
 
     static err_t _accept(void *arg, tcp_pcb* pcb, err_t err) { return reinterpret_cast<EspTCP*>(arg)->accept(pcb, err); }
-    static err_t _recv(void *arg, tcp_pcb* pcb, pbuf* buf, err_t err) { return reinterpret_cast<EspTCP*>(arg)->recv(pcb, buf, err); }
-    static err_t _sent(void *arg, tcp_pcb* pcb, u16_t len) { return reinterpret_cast<EspTCP*>(arg)->sent(pcb, len); }
 
     err_t accept(tcp_pcb*, int8_t err);
-    err_t recv(tcp_pcb*, pbuf*, int8_t err);
-    err_t sent(tcp_pcb*, u16_t len);
-
-    int16_t findConnection(tcp_pcb*);
+    err_t recv(Client*, pbuf*, int8_t err);
+    err_t sent(Client*, u16_t len);
+    void error(Client*);
+    
+    Client* client(int16_t connectionId) const
+    {
+        return (connectionId >= 0 && connectionId < int16_t(_clients.size())) ? _clients[connectionId] : nullptr;
+    }
+    
+    // Put a connection in the table at connectionId, or the first free slot
+    // if that is -1. Returns nullptr if the table is full
+    Client* openClient(tcp_pcb*, int16_t connectionId = -1);
+    void closeClient(Client*);
+    
+    void checkBackpressure(Client*);
     
     tcp_pcb* _listenpcb;
-        
-    Client _clients[MaxConnections];
+    EspTCPSegmentDelegate* _segmentDelegate = nullptr;
+    BackpressureFunction _backpressureFunction;
+    uint16_t _highWaterMark = SendBufferSize / 4 * 3;
+    uint32_t _droppedBytes = 0;
+    uint16_t _flushBytes = ESP_TCP_FLUSH_BYTES;
+    uint32_t _flushUs = ESP_TCP_FLUSH_US;
+    SendStats _sendStats;
+    
+    // Every EspTCP, for flushAll
+    EspTCP* _next = nullptr;
+    static EspTCP* _first;
+    
+    // Indexed by connection id, nullptr for a free slot. Clients that
+    // close go on the free list and are reused by the next connection
+    Vector<Client*> _clients;
+    Client* _freeClients = nullptr;
+    uint16_t _maxConnections = ESP_TCP_MAX_CONNECTIONS;
 };
 
 }
@@ -41,9 +41,23 @@ void EspTaskManager::executionTask(os_event_t *event)
     Duration durationToNextEvent = taskManager->nextTimeToFire() - now;
     if (durationToNextEvent <= 5_ms) {
         taskManager->executeNextTask();
-    } else {
-        os_timer_arm(&taskManager->_executionTimer, durationToNextEvent.ms(), false);
+        if (taskManager->_iterationFunction) {
+            taskManager->_iterationFunction();
+        }
+        return;
+    }
+    
+    uint32_t idleMs = static_cast<uint32_t>(durationToNextEvent.ms());
+    if (taskManager->_idleFunction && idleMs > 2 * IdleMarginMs) {
+        idleMs -= IdleMarginMs;
+        taskManager->_idleFunction(((idleMs > MaxIdleMs) ? MaxIdleMs : idleMs) * 1000);
+        durationToNextEvent = taskManager->nextTimeToFire() - Time::now();
+        if (durationToNextEvent <= 5_ms) {
+            taskManager->readyToExecuteNextTask();
+            return;
+        }
     }
+    os_timer_arm(&taskManager->_executionTimer, durationToNextEvent.ms(), false);
 }
 
 void EspTaskManager::executionTimerTick(void* data)
@@ -12,6 +12,7 @@
 #include "TaskManager.h"
 
 #include "Esp.h"
+#include <functional>
 
 extern "C" {
 #include <osapi.h>
@@ -25,6 +26,16 @@ public:
     EspTaskManager();
     virtual ~EspTaskManager();
     
+    // Called with the number of microseconds available when there is idle
+    // time before the next task is due. Used for background work like
+    // garbage collection. The function must return within that time.
+    void setIdleFunction(std::function<void(uint32_t us)> f) { _idleFunction = f; }
+    
+    // Called after each task runs, the end of one iteration of the run
+    // loop. Used to push out work batched up during the task, like TCP
+    // writes.
+    void setIterationFunction(std::function<void()> f) { _iterationFunction = f; }
+    
 private:
     // The ESP handlles it's own runloop, we can just return here
     virtual void runLoop() { }
@@ -33,12 +44,19 @@ private:
     
     static constexpr uint32_t ExecutionTaskPrio = 0;
     static constexpr uint32_t ExecutionTaskQueueLen = 1;
+    
+    // Time kept back from the idle function so the next task isn't late, and
+    // the most it gets in one call so the SDK and wifi get to run
+    static constexpr uint32_t IdleMarginMs = 5;
+    static constexpr uint32_t MaxIdleMs = 20;
 
     static void executionTask(os_event_t*);
     static void executionTimerTick(void* data);
 
     os_timer_t _executionTimer;
     os_event_t _executionTaskQueue[ExecutionTaskQueueLen];
+    std::function<void(uint32_t us)> _idleFunction;
+    std::function<void()> _iterationFunction;
 };
 
 }
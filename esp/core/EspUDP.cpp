@@ -54,6 +54,9 @@ void EspUDP::init(UDPDelegate* delegate, uint16_t port)
 EspUDP::~EspUDP()
 {
     udp_remove(_pcb);
+    if (_sendBuf) {
+        pbuf_free(_sendBuf);
+    }
 }
 
 void EspUDP::recv(udp_pcb* pcb, pbuf* buf, ip_addr_t *addr, u16_t port)
@@ -64,7 +67,6 @@ void EspUDP::recv(udp_pcb* pcb, pbuf* buf, ip_addr_t *addr, u16_t port)
     }
     
     assert(buf->len == buf->tot_len);
-    String s(reinterpret_cast<const char*>(buf->payload), buf->len);
     _delegate->UDPevent(this, UDPDelegate::Event::ReceivedData, reinterpret_cast<const char*>(buf->payload), buf->len);
     pbuf_free(buf);
 }
@@ -75,17 +77,43 @@ void EspUDP::send(IPAddr addr, uint16_t port, const char* data, uint16_t length)
         length = strlen(data);
     }
     
-    pbuf* buf = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
+    pbuf* buf = sendBuffer(length);
+    if (!buf) {
+        m8r::system()->printf(ROMSTR("UDP ERROR: no memory to send %d bytes to port %d\n"), length, port);
+        return;
+    }
+    
     memcpy(buf->payload, data, length);
     ip_addr_t ip;
     IP4_ADDR(&ip, addr[0], addr[1], addr[2], addr[3]);
     err_t result = udp_sendto(_pcb, buf, &ip, port);
-    pbuf_free(buf);
     if (result != 0) {
         m8r::system()->printf(ROMSTR("UDP ERROR: failed to send %d bytes to port %d\n"), length, port);
     }
 }
 
+pbuf* EspUDP::sendBuffer(uint16_t length)
+{
+    if (_sendBuf && (_sendBuf->ref > 1 || length > _sendCapacity)) {
+        pbuf_free(_sendBuf);
+        _sendBuf = nullptr;
+    }
+    
+    if (!_sendBuf) {
+        _sendBuf = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
+        if (!_sendBuf) {
+            return nullptr;
+        }
+        _sendPayload = _sendBuf->payload;
+        _sendCapacity = length;
+    }
+    
+    // A single PBUF_RAM pbuf only we hold, so it can be reset in place
+    _sendBuf->payload = _sendPayload;
+    _sendBuf->len = _sendBuf->tot_len = length;
+    return _sendBuf;
+}
+
 void EspUDP::disconnect()
 {
     udp_remove(_pcb);
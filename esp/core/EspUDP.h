@@ -44,7 +44,19 @@ private:
 
     void recv(udp_pcb*, pbuf*, ip_addr_t *addr, u16_t port);
 
+    // Returns a pbuf with room for length bytes of payload. The driver may
+    // still hold the last one sent, so it is reused only once it is ours
+    // alone, otherwise it is let go and a new one is allocated
+    pbuf* sendBuffer(uint16_t length);
+
     udp_pcb* _pcb;
+
+    // Kept from send to send so datagrams don't each go through the
+    // allocator. _sendPayload is where the payload starts, lwIP moves
+    // payload back over the headers it adds
+    pbuf* _sendBuf = nullptr;
+    void* _sendPayload = nullptr;
+    uint16_t _sendCapacity = 0;
 };
 
 }
@@ -0,0 +1,257 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "FlashCache.h"
+
+#include "Mallocator.h"
+#include "SystemInterface.h"
+#include "flashmem.h"
+#include <cstring>
+
+using namespace m8r;
+
+static constexpr uint32_t SectorSize = INTERNAL_FLASH_SECTOR_SIZE;
+static constexpr uint32_t WriteUnitMask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
+
+FlashCache::Slot FlashCache::_slots[NumSlots ? NumSlots : 1];
+uint32_t FlashCache::_useCount = 0;
+uint32_t FlashCache::_dirtyCount = 0;
+void (*FlashCache::_dirtyFunction)() = nullptr;
+FlashCache::Stats FlashCache::_stats;
+
+bool FlashCache::read(uint32_t addr, void* dst, uint32_t size)
+{
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    while (size) {
+        uint32_t sector = addr / SectorSize;
+        uint32_t offset = addr % SectorSize;
+        uint32_t chunk = SectorSize - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        Slot* slot = find(sector);
+        if (!slot && chunk < SectorSize) {
+            slot = load(sector);
+        }
+        if (slot) {
+            memcpy(to, slot->bytes() + offset, chunk);
+        } else if (flashmem_read(to, addr, chunk) != chunk) {
+            return false;
+        }
+
+        to += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool FlashCache::write(uint32_t addr, const void* src, uint32_t size)
+{
+    const uint8_t* from = static_cast<const uint8_t*>(src);
+    while (size) {
+        uint32_t sector = addr / SectorSize;
+        uint32_t offset = addr % SectorSize;
+        uint32_t chunk = SectorSize - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        Slot* slot = find(sector);
+        if (!slot && chunk < SectorSize) {
+            slot = load(sector);
+        }
+        if (slot) {
+            // Programming only clears bits
+            uint8_t* p = slot->bytes() + offset;
+            for (uint32_t i = 0; i < chunk; ++i) {
+                p[i] &= from[i];
+            }
+
+            if (!slot->dirty()) {
+                slot->_dirtyStart = offset;
+                slot->_dirtyEnd = offset + chunk;
+                slot->_dirtySinceUs = SystemInterface::currentMicroseconds();
+                slot->_dirtySeq = ++_dirtyCount;
+                if (_dirtyFunction) {
+                    _dirtyFunction();
+                }
+            } else {
+                if (offset < slot->_dirtyStart) {
+                    slot->_dirtyStart = offset;
+                }
+                if (offset + chunk > slot->_dirtyEnd) {
+                    slot->_dirtyEnd = offset + chunk;
+                }
+            }
+        } else if (!sync() || flashmem_write(from, addr, chunk) != chunk) {
+            // Sectors changed before this one go first
+            return false;
+        }
+
+        from += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool FlashCache::eraseSector(uint32_t sector)
+{
+    return erase(sector * SectorSize, SectorSize);
+}
+
+bool FlashCache::erase(uint32_t addr, uint32_t size)
+{
+    if (!size) {
+        return true;
+    }
+
+    uint32_t first = addr / SectorSize;
+    uint32_t last = (addr + size - 1) / SectorSize;
+    _stats.erases += last - first + 1;
+
+    // Whatever was waiting to be written is erased too. Other sectors
+    // changed before the erase go first, they may hold what was moved
+    // out of the ones being erased
+    for (auto& it : _slots) {
+        if (it._sector >= first && it._sector <= last) {
+            it._dirtyStart = it._dirtyEnd = 0;
+        }
+    }
+
+    bool success = sync() && flashmem_erase(addr, size);
+    for (auto& it : _slots) {
+        if (it._sector >= first && it._sector <= last) {
+            if (success) {
+                memset(it._buffer, 0xff, SectorSize);
+            } else {
+                it._sector = NoSector;
+            }
+        }
+    }
+    return success;
+}
+
+bool FlashCache::sync()
+{
+    return writeBackThrough(_dirtyCount);
+}
+
+void FlashCache::syncDue()
+{
+    // Anything dirty before a due sector is due too
+    uint64_t now = SystemInterface::currentMicroseconds();
+    uint32_t seq = 0;
+    bool due = false;
+    for (auto& it : _slots) {
+        if (it.dirty() && now - it._dirtySinceUs >= FLASH_CACHE_SYNC_MS * 1000ULL && it._dirtySeq - seq < 0x80000000) {
+            seq = it._dirtySeq;
+            due = true;
+        }
+    }
+    if (due) {
+        writeBackThrough(seq);
+    }
+}
+
+bool FlashCache::dirty()
+{
+    for (auto& it : _slots) {
+        if (it.dirty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FlashCache::writeBackThrough(uint32_t seq)
+{
+    // Sequence numbers wrap, compare by distance back from seq
+    for (;;) {
+        Slot* oldest = nullptr;
+        for (auto& it : _slots) {
+            if (it.dirty() && seq - it._dirtySeq < 0x80000000 &&
+                    (!oldest || seq - it._dirtySeq > seq - oldest->_dirtySeq)) {
+                oldest = &it;
+            }
+        }
+        if (!oldest) {
+            return true;
+        }
+        if (!writeBack(*oldest)) {
+            return false;
+        }
+    }
+}
+
+FlashCache::Slot* FlashCache::find(uint32_t sector)
+{
+    for (uint8_t i = 0; i < NumSlots; ++i) {
+        Slot& slot = _slots[i];
+        if (slot._sector == sector) {
+            slot._lastUse = ++_useCount;
+            _stats.hits++;
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+FlashCache::Slot* FlashCache::load(uint32_t sector)
+{
+    if (!NumSlots) {
+        return nullptr;
+    }
+
+    Slot* slot = &_slots[0];
+    for (uint8_t i = 1; i < NumSlots; ++i) {
+        if (_slots[i]._lastUse < slot->_lastUse) {
+            slot = &_slots[i];
+        }
+    }
+
+    if (slot->dirty() && !writeBackThrough(slot->_dirtySeq)) {
+        return nullptr;
+    }
+
+    if (!slot->_buffer) {
+        slot->_buffer = Mallocator::shared()->allocate<uint32_t>(MemoryType::Fixed, SectorSize / sizeof(uint32_t)).get();
+        if (!slot->_buffer) {
+            return nullptr;
+        }
+    }
+
+    _stats.misses++;
+    slot->_sector = NoSector;
+    if (flashmem_read_internal(slot->_buffer, sector * SectorSize, SectorSize) != SectorSize) {
+        return nullptr;
+    }
+    slot->_sector = sector;
+    slot->_lastUse = ++_useCount;
+    return slot;
+}
+
+bool FlashCache::writeBack(Slot& slot)
+{
+    // The cache has the whole sector, so the burst can be widened to whole
+    // write units and needs no read-modify-write
+    uint32_t start = slot._dirtyStart & ~WriteUnitMask;
+    uint32_t end = (slot._dirtyEnd + WriteUnitMask) & ~WriteUnitMask;
+    uint32_t size = end - start;
+    if (flashmem_write_internal(slot.bytes() + start, slot._sector * SectorSize + start, size) != size) {
+        return false;
+    }
+
+    slot._dirtyStart = slot._dirtyEnd = 0;
+    _stats.writeBacks++;
+    _stats.bytesProgrammed += size;
+    return true;
+}
@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstdint>
+
+// Flash sectors held in RAM, 4KB each. 0 sends everything straight to flash
+#ifndef FLASH_CACHE_SECTORS
+#define FLASH_CACHE_SECTORS 2
+#endif
+
+// How long a sector stays dirty before syncDue() writes it back
+#ifndef FLASH_CACHE_SYNC_MS
+#define FLASH_CACHE_SYNC_MS 1000
+#endif
+
+namespace m8r {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: FlashCache
+//
+//  Write-back cache of whole flash sectors under the file system HAL. An
+//  access smaller than a sector brings the sector into RAM and is served
+//  from there, so repeated metadata reads and small appends don't each go
+//  to flash. Writes behave like NOR flash and can only clear bits, so a
+//  cached sector always holds what flash will once it is written back.
+//
+//  A dirty sector is programmed in one aligned burst covering the bytes
+//  that changed. That happens when it is evicted, least recently used
+//  first, on sync(), or from syncDue() once it has been dirty for
+//  FLASH_CACHE_SYNC_MS. Whole sector accesses to sectors not in the
+//  cache go straight to flash.
+//
+//  Flash sees changes in the order the file system made them, sector by
+//  sector: dirty sectors are written back in the order they became dirty,
+//  and all of them before a sector is programmed directly or erased. A
+//  file system that relies on its write order to survive power loss still
+//  can.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class FlashCache
+{
+public:
+    struct Stats
+    {
+        // Sector accesses served from RAM and sectors read in to serve them
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+
+        // Dirty sectors programmed and the bytes in those bursts
+        uint32_t writeBacks = 0;
+        uint32_t bytesProgrammed = 0;
+
+        // Sectors erased
+        uint32_t erases = 0;
+    };
+
+    static bool read(uint32_t addr, void* dst, uint32_t size);
+    static bool write(uint32_t addr, const void* src, uint32_t size);
+    static bool eraseSector(uint32_t sector);
+
+    // Erase every sector with a byte in the range, whole 64KB blocks at a
+    // time where it can
+    static bool erase(uint32_t addr, uint32_t size);
+
+    // Write back every dirty sector
+    static bool sync();
+
+    // Write back the sectors that have been dirty too long
+    static void syncDue();
+    
+    // True if any sector is waiting to be written back
+    static bool dirty();
+    
+    // Called when a sector goes from clean to dirty, to arm a timer that
+    // calls syncDue()
+    static void setDirtyFunction(void (*f)()) { _dirtyFunction = f; }
+
+    static const Stats& stats() { return _stats; }
+    static void resetStats() { _stats = Stats(); }
+
+private:
+    static constexpr uint32_t NoSector = 0xffffffff;
+    static constexpr uint8_t NumSlots = FLASH_CACHE_SECTORS;
+
+    struct Slot
+    {
+        // Word aligned, as flashmem_read_internal and write_internal want
+        uint32_t* _buffer = nullptr;
+        uint32_t _sector = NoSector;
+        uint32_t _lastUse = 0;
+
+        // Bytes changed since the sector was read or written back
+        uint16_t _dirtyStart = 0;
+        uint16_t _dirtyEnd = 0;
+        uint64_t _dirtySinceUs = 0;
+        
+        // Order in which sectors became dirty
+        uint32_t _dirtySeq = 0;
+
+        bool dirty() const { return _dirtyEnd > _dirtyStart; }
+        uint8_t* bytes() const { return reinterpret_cast<uint8_t*>(_buffer); }
+    };
+
+    static Slot* find(uint32_t sector);
+
+    // Returns nullptr if the sector couldn't be read or there's no memory,
+    // in which case the access goes to flash
+    static Slot* load(uint32_t sector);
+    static bool writeBack(Slot&);
+    
+    // Write back, oldest first, every sector that became dirty no later
+    // than seq
+    static bool writeBackThrough(uint32_t seq);
+
+    static Slot _slots[NumSlots ? NumSlots : 1];
+    static uint32_t _useCount;
+    static uint32_t _dirtyCount;
+    static void (*_dirtyFunction)();
+    static Stats _stats;
+};
+
+}
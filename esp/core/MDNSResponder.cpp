@@ -23,26 +23,30 @@ using namespace m8r;
 //#define MDNSRESP_DEBUG
 
 static os_timer_t bc_timer;
+static os_timer_t response_timer;
 
-void MDNSResponder::init(const char* name, uint32_t broadcastInterval, uint32_t ttl)
+void MDNSResponder::init(const char* name, uint32_t broadcastInterval, uint32_t ttl, Mad<UDP> udp)
 {
 	_ttl = ttl;
     _hostname = name;
+    buildReplies();
     
     UDP::joinMulticastGroup({ 224,0,0,251 });
-    _udp = system()->createUDP(this, 5353);
+    _udp = udp.valid() ? udp : system()->createUDP(this, 5353);
+
+	os_timer_disarm(&response_timer);
+    os_timer_setfn(&response_timer, (os_timer_func_t *)responseCB, this);
 
 	os_timer_disarm(&bc_timer);
-	if (broadcastInterval > 0) {
-        broadcastCB(this);
-		os_timer_setfn(&bc_timer, (os_timer_func_t *)broadcastCB, this);
-		os_timer_arm(&bc_timer, broadcastInterval * 1000, true);
-	}
+    os_timer_setfn(&bc_timer, (os_timer_func_t *)broadcastCB, this);
+    _broadcastIntervalMs = broadcastInterval * 1000;
+    startAnnouncing();
 }
 
 MDNSResponder::~MDNSResponder()
 {
 	os_timer_disarm(&bc_timer);
+	os_timer_disarm(&response_timer);
     UDP::leaveMulticastGroup({ 224,0,0,251 });
 }
 
@@ -51,164 +55,308 @@ void MDNSResponder::addService(uint16_t port, const char* instance, const char*
     ServiceRecord service(port, instance, serviceType, protocol, text);
     int32_t serviceIndex = _services.size();
     _services.push_back(service);
+    buildReplies(serviceIndex);
     
     // Announce this service
-    sendAnswer(QuestionType::PTR, serviceIndex);
+    if (_broadcastIntervalMs) {
+        startAnnouncing();
+    } else {
+        sendReply(_services[serviceIndex]._replies[PTRReply]);
+    }
+}
+
+static inline uint16_t uint16FromBuf(const char* buf)
+{
+    return (static_cast<uint16_t>(static_cast<uint8_t>(buf[0])) << 8) | static_cast<uint8_t>(buf[1]);
+}
+
+static inline uint32_t uint32FromBuf(const char* buf)
+{
+    return (static_cast<uint32_t>(uint16FromBuf(buf)) << 16) | uint16FromBuf(buf + 2);
 }
 
-const char* decodeNameStrings(const char* data, uint32_t dataLen, Vector<String>& names, const char* p)
+int32_t MDNSResponder::parseName(const char* data, uint16_t length, uint16_t offset, Name& name)
 {
-    names.clear();
-    
-    const char* pointerReturn = nullptr;
-    while(1) {
-        uint32_t size = static_cast<uint32_t>(*p++);
-        if ((size & 0xc0) == 0) {
-            // this is a direct label
-            names.push_back(String(reinterpret_cast<const char*>(p), size));
-            p += size;
-            if (*p == 0) {
-                ++p;
-                break;
+    name._count = 0;
+    
+    int32_t end = -1;
+    uint8_t pointers = 0;
+    uint16_t nameLength = 0;
+    while (1) {
+        if (offset >= length) {
+            return -1;
+        }
+        uint8_t size = static_cast<uint8_t>(data[offset++]);
+        if (size == 0) {
+            break;
+        }
+        
+        if ((size & 0xc0) == 0xc0) {
+            // Pointer to an earlier name. Each one must point back before
+            // itself, so pointers can't loop
+            if (offset >= length || ++pointers > MaxCompressionPointers) {
+                return -1;
             }
-        } else {
-            // This is a pointer label
-            if (pointerReturn) {
-                break;
+            uint16_t target = ((size & 0x3f) << 8) | static_cast<uint8_t>(data[offset++]);
+            if (target >= offset - 2) {
+                return -1;
             }
-            uint32_t offset = ((size & ~0xc0) << 8) | *p++;
-            pointerReturn = p;
-            p = data + offset;
+            if (end < 0) {
+                end = offset;
+            }
+            offset = target;
+            continue;
+        }
+        
+        if ((size & 0xc0) != 0 || offset + size > length) {
+            return -1;
+        }
+        
+        // A name is at most 255 bytes
+        nameLength += size + 1;
+        if (nameLength > 255) {
+            return -1;
+        }
+        
+        if (name._count < Name::MaxLabels) {
+            name._label[name._count] = data + offset;
+            name._size[name._count] = size;
         }
+        if (name._count < 255) {
+            name._count++;
+        }
+        offset += size;
     }
-    return pointerReturn ?: p;
+    return (end < 0) ? offset : end;
 }
 
-static inline uint16_t uint16FromBuf(const char* buf)
+bool MDNSResponder::sameName(const Name& a, const Name& b)
 {
-    return (static_cast<uint16_t>(buf[0]) << 8) | static_cast<uint16_t>(buf[1]);
+    if (a._count != b._count || a._count > Name::MaxLabels) {
+        return false;
+    }
+    for (uint8_t i = 0; i < a._count; ++i) {
+        if (!a.equals(i, b._label[i], b._size[i])) {
+            return false;
+        }
+    }
+    return true;
 }
 
-MDNSResponder::ParseServiceReturn MDNSResponder::parseService(
-                                    const String& serviceString, const String& protocolString, 
-                                    String& serviceName, ServiceProtocol& protocol)
+bool MDNSResponder::matchName(const Name& name, int32_t& serviceIndex) const
 {
-    if (serviceString[0] == '_') {
-        // this is a service name
-        serviceName = serviceString.slice(1);
-        if (protocolString == "_tcp") {
-            protocol = ServiceProtocol::TCP;
-        } else if (protocolString == "_udp") {
-            protocol = ServiceProtocol::UDP;
-        } else {
-            return ParseServiceReturn::BadProtocol;
+    serviceIndex = -1;
+    
+    if (name._count < 2 || name._count > Name::MaxLabels || !name.equals(name._count - 1, "local", 5)) {
+        return false;
+    }
+    
+    bool haveHostname = name.equals(0, _hostname);
+    if (name._count == 2) {
+        return haveHostname;
+    }
+    
+    uint8_t first = 0;
+    if (name._count == 4) {
+        if (!haveHostname) {
+            return false;
+        }
+        first = 1;
+    }
+    
+    for (int32_t i = 0; i < _services.size(); ++i) {
+        const ServiceRecord& service = _services[i];
+        if (name.equals(first, service._serviceLabel) &&
+                name.equals(first + 1, (service._protocol == ServiceProtocol::TCP) ? "_tcp" : "_udp", 4)) {
+            serviceIndex = i;
+            return true;
         }
-        return ParseServiceReturn::OK;
     }
-    return ParseServiceReturn::NotAService;
+    return false;
+}
+
+int32_t MDNSResponder::skipRecord(const char* data, uint16_t length, int32_t offset)
+{
+    Name name;
+    offset = parseName(data, length, offset, name);
+    if (offset < 0 || offset + 10 > length) {
+        return -1;
+    }
+    offset += 10 + uint16FromBuf(data + offset + 8);
+    return (offset > length) ? -1 : offset;
+}
+
+bool MDNSResponder::isKnownAnswer(const char* data, uint16_t length, int32_t offset, const Reply& reply) const
+{
+    if (reply._packet.empty()) {
+        return false;
+    }
+    
+    // Our answer record comes right after the header
+    const char* ours = reinterpret_cast<const char*>(&(reply._packet[0]));
+    uint16_t oursLength = reply._packet.size();
+    
+    Name name;
+    Name ourName;
+    offset = parseName(data, length, offset, name);
+    int32_t ourOffset = parseName(ours, oursLength, sizeof(MDNSHeader), ourName);
+    if (offset < 0 || offset + 10 > length || ourOffset < 0 || !sameName(name, ourName)) {
+        return false;
+    }
+    
+    uint16_t type = uint16FromBuf(data + offset);
+    if (type != uint16FromBuf(ours + ourOffset) ||
+            (uint16FromBuf(data + offset + 2) & 0x7fff) != (uint16FromBuf(ours + ourOffset + 2) & 0x7fff) ||
+            uint32FromBuf(data + offset + 4) < _ttl / 2) {
+        return false;
+    }
+    
+    uint16_t rdLength = uint16FromBuf(data + offset + 8);
+    uint16_t ourRdLength = uint16FromBuf(ours + ourOffset + 8);
+    offset += 10;
+    ourOffset += 10;
+    if (offset + rdLength > length) {
+        return false;
+    }
+    
+    // Names in the known answer's data may be compressed, ours aren't
+    switch (static_cast<QuestionType>(type)) {
+        case QuestionType::SRV:
+            // Priority, weight and port, then the target
+            if (rdLength < 6 || memcmp(data + offset, ours + ourOffset, 6) != 0) {
+                return false;
+            }
+            offset += 6;
+            ourOffset += 6;
+            // Fall through
+        case QuestionType::PTR:
+            return parseName(data, length, offset, name) >= 0 &&
+                   parseName(ours, oursLength, ourOffset, ourName) >= 0 && sameName(name, ourName);
+        default:
+            return rdLength == ourRdLength && memcmp(data + offset, ours + ourOffset, rdLength) == 0;
+    }
 }
 
 void MDNSResponder::receivedData(const char* data, uint16_t length)
 {
-    if (data[0] != 0 || data[1] != 0 || data[2] != 0 || data[3] != 0) {
-        // only queries
+    if (length < sizeof(MDNSHeader)) {
+        _stats.malformed++;
         return;
     }
+    
+    if ((data[2] & 0xf8) != 0) {
+        // only standard queries
+        return;
+    }
+    
+    // Truncated, the rest of the known answers come in following packets
+    bool truncated = (data[2] & 0x02) != 0;
 
-    int qcount = data[5]; // purposely ignore qcount > 255
-    const char* p = data+12;
-    Vector<String> names;
+    uint16_t qcount = uint16FromBuf(data + 4);
+    uint16_t ancount = uint16FromBuf(data + 6);
+    int32_t offset = sizeof(MDNSHeader);
+    bool scheduled = false;
+    
+    // Nothing but known answers, the rest of a truncated query
+    bool continuation = qcount == 0;
+    uint32_t query = ++_queryPackets;
     
     while(qcount-- > 0) {
-        p = decodeNameStrings(data, length, names, p);
-        QuestionType qtype = static_cast<QuestionType>(uint16FromBuf(p));
-        uint16_t qclass = uint16FromBuf(p + 2);
-        p += 4;
-        
-        if ((qclass & 0x7fff) != 1 || names.size() < 2 || names[0].empty() || names[1].empty()) {
-            continue;
+        Name name;
+        offset = parseName(data, length, offset, name);
+        if (offset < 0 || offset + 4 > length) {
+            // Malformed, nothing after this can be trusted
+            _stats.malformed++;
+            break;
         }
         
-        // Supported formats:
-        //
-        //      1) <hostname>.local
-        //      2) _<serviceName>.{_tcp | _udp).local
-        //      3) <hostname>._<serviceName>.{_tcp | _udp).local
+        QuestionType qtype = static_cast<QuestionType>(uint16FromBuf(data + offset));
+        uint16_t qclass = uint16FromBuf(data + offset + 2);
+        offset += 4;
         
-        String serviceName;
-        ServiceProtocol protocol;
-        bool haveService = false;
-        bool haveHostname = false;
-                
-        ParseServiceReturn ret = parseService(names[0], names[1], serviceName, protocol);
-        if (ret == ParseServiceReturn::BadProtocol) {
+        int32_t serviceIndex;
+        if ((qclass & 0x7fff) != QClassIN || !matchName(name, serviceIndex)) {
             continue;
-        } else if (ret == ParseServiceReturn::NotAService) {
-            // This is a hostname
-            haveHostname = true;
-            if (names[0] != _hostname) {
-                // But it's not ours
-                continue;
-            }
-        } else {
-            haveService = true;
-            if (names.size() < 3 || names[2] != "local") {
-                continue;
-            }
         }
-        
-        assert(haveHostname || haveService);
-        
-        if (haveHostname && names[1] != "local") {
-            if (names.size() < 4) {
-                continue;
-            }
-            ret = parseService(names[1], names[2], serviceName, protocol);
-            if (ret != ParseServiceReturn::OK) {
-                continue;
-            }
-            haveService = true;
-            if (names[3] != "local") {
-                continue;
-            }
+
+#ifdef MDNSRESP_DEBUG
+        system()->printf (ROMSTR("Got a question for service %d - qtype=%d qclass=%d\n"), serviceIndex, qtype, qclass);
+#endif
+
+        _stats.queries++;
+        Reply* r = reply(qtype, serviceIndex);
+        if (!r) {
+            continue;
         }
         
-        int32_t serviceIndex = -1;
-        
-        if (haveService) {
-            for (int32_t i = 0; i < _services.size(); ++i) {
-                if (_services[i]._serviceType == serviceName && _services[i]._protocol == protocol) {
-                    serviceIndex = i;
-                    break;
-                }
-            }
-            if (serviceIndex < 0) {
-                continue;
-            }
+        // Our PTRs are one of many in a shared set, so they wait a random
+        // time. Other answers are ours alone and go at once, unless more
+        // known answers are on the way (RFC 6762 section 6)
+        uint32_t delayMs = 0;
+        if (truncated) {
+            delayMs = 400 + rand() % 100;
+        } else if (qtype == QuestionType::PTR) {
+            delayMs = _responseDelayMinMs + rand() % (_responseDelayMaxMs - _responseDelayMinMs + 1);
         }
-
-#ifdef MDNSRESP_DEBUG
-        if (haveService) {
-            if (haveHostname) {
-                system()->printf ("Got one of our instances: %s.%s.%s.%s",
-                            names[0].c_str(), names[1].c_str(), names[2].c_str(), names[3].c_str());
-            } else {
-                system()->printf ("Got one of our services: %s.%s.%s",
-                            names[0].c_str(), names[1].c_str(), names[2].c_str());
+        if (scheduleReply(*r, delayMs)) {
+            r->_query = query;
+            r->_truncated = truncated;
+            scheduled = true;
+        }
+	}
+    
+    // Known answers cancel the replies this query scheduled, or the ones
+    // a truncated query scheduled. Replies other queriers are waiting for
+    // still go
+    while (offset >= 0 && ancount-- > 0) {
+        forEachReply([&](Reply& r) {
+            if (r._dueUs && (r._query == query || (continuation && r._truncated)) &&
+                    isKnownAnswer(data, length, offset, r)) {
+                r._dueUs = 0;
+                _stats.knownAnswerSuppressed++;
             }
-        } else {
-            system()->printf ("Got our hostname: %s.%s", names[0].c_str(), names[1].c_str());
+        });
+        offset = skipRecord(data, length, offset);
+        if (offset < 0) {
+            _stats.malformed++;
         }
-        system()->printf (" - qtype=%d qclass=%d\n", qtype, qclass);
-#endif
+    }
+    
+    if (scheduled) {
+        sendDue();
+    }
+}
 
-        sendAnswer(qtype, serviceIndex);
-	}
+void MDNSResponder::startAnnouncing()
+{
+    if (!_broadcastIntervalMs) {
+        return;
+    }
+    
+	os_timer_disarm(&bc_timer);
+    _announcements = 0;
+    _announceIntervalMs = 1000;
+    broadcast();
 }
 
 void MDNSResponder::broadcast()
 {
-    // TBD
+    // Unsolicited responses, at least a second apart and each interval
+    // at least twice the last (RFC 6762 section 8.3)
+    if (_services.empty()) {
+        sendReply(_aReply);
+    }
+    for (auto& it : _services) {
+        sendReply(it._replies[PTRReply]);
+    }
+    _stats.announcements++;
+    
+    // Sending may have found a new address and restarted the announcements
+	os_timer_disarm(&bc_timer);
+    if (++_announcements < MaxAnnouncements) {
+        os_timer_arm(&bc_timer, _announceIntervalMs, false);
+        _announceIntervalMs = (_announceIntervalMs * 2 < _broadcastIntervalMs) ? _announceIntervalMs * 2 : _broadcastIntervalMs;
+    }
 }
 
 void MDNSResponder::writeHeader(uint8_t answerCount, uint8_t additionalCount)
@@ -249,7 +397,7 @@ void MDNSResponder::writeHostname()
 
 void MDNSResponder::writeServiceName(int32_t serviceIndex)
 {
-    write("_" + _services[serviceIndex]._serviceType);
+    write(_services[serviceIndex]._serviceLabel);
     write((_services[serviceIndex]._protocol == ServiceProtocol::TCP) ? "_tcp" : "_udp");
     write("local");
     _replyBuffer.push_back(0);
@@ -311,55 +459,167 @@ void MDNSResponder::writeTXT(int32_t serviceIndex)
     setAnswerLength(lengthIndex);
 }
 
-void MDNSResponder::sendReply()
+void MDNSResponder::buildReplies()
 {
-    if (_replyBuffer.empty()) {
-        return;
+    // Bring the replies already built up to the current address first,
+    // since the new ones are built with it
+    updateAddress();
+    
+    writeHeader(1, 0);
+    writeA();
+    takeReply(_aReply);
+    
+    for (int32_t i = 0; i < _services.size(); ++i) {
+        buildReplies(i);
     }
+}
+
+void MDNSResponder::buildReplies(int32_t serviceIndex)
+{
+    updateAddress();
     
-#ifdef MDNSRESP_DEBUG
-    hexdump("reply", &(_replyBuffer[0]), _replyBuffer.size());
-#endif
-    _udp->send({ 224,0,0,251 }, 5353, reinterpret_cast<char*>(&(_replyBuffer[0])), _replyBuffer.size());
+    ServiceRecord& service = _services[serviceIndex];
+    
+    writeHeader(1, 0);
+    writeTXT(serviceIndex);
+    takeReply(service._replies[TXTReply]);
+    
+    writeHeader(1, 1);
+    writeSRV(serviceIndex);
+    writeA();
+    takeReply(service._replies[SRVReply]);
+    
+    writeHeader(1, 3);
+    writePTR(serviceIndex);
+    writeSRV(serviceIndex);
+    writeTXT(serviceIndex);
+    writeA();
+    takeReply(service._replies[PTRReply]);
+}
+
+void MDNSResponder::takeReply(Reply& reply)
+{
+    reply._packet = _replyBuffer;
     _replyBuffer.clear();
 }
 
-void MDNSResponder::sendAnswer(QuestionType qtype, int32_t service)
+bool MDNSResponder::updateAddress()
 {
+    IPAddr addr = IPAddr::myIPAddr();
+    if (static_cast<uint32_t>(addr) == _replyAddr) {
+        return false;
+    }
+    _replyAddr = static_cast<uint32_t>(addr);
+    
+    auto patch = [addr](Vector<uint8_t>& packet) {
+        size_t size = packet.size();
+        if (size < 4) {
+            return;
+        }
+        for (int i = 0; i < 4; ++i) {
+            packet[size - 4 + i] = addr[i];
+        }
+    };
+    
+    patch(_aReply._packet);
+    for (auto& it : _services) {
+        patch(it._replies[SRVReply]._packet);
+        patch(it._replies[PTRReply]._packet);
+    }
+    
+    // These are new records, announce them from the start
+    forEachReply([](Reply& r) { r._sentUs = 0; });
+    if (_broadcastIntervalMs) {
+        _announcements = 0;
+        _announceIntervalMs = 1000;
+        os_timer_disarm(&bc_timer);
+        os_timer_arm(&bc_timer, 1, false);
+    }
+    return true;
+}
+
+MDNSResponder::Reply* MDNSResponder::reply(QuestionType qtype, int32_t service)
+{
+    // The hostname matches with no service, and only has an A record
+    if (qtype == QuestionType::A) {
+        return &_aReply;
+    }
+    
     if (service < 0 || service >= _services.size()) {
-        return;
+        return nullptr;
     }
     
-    uint8_t additionalCount = 0;
     switch(qtype) {
-        case QuestionType::A:
-        case QuestionType::TXT: break;
-        case QuestionType::SRV: additionalCount = 1; break;
-        case QuestionType::PTR: additionalCount = 3; break;
-        default: return;
+        case QuestionType::TXT: return &_services[service]._replies[TXTReply];
+        case QuestionType::SRV: return &_services[service]._replies[SRVReply];
+        case QuestionType::PTR: return &_services[service]._replies[PTRReply];
+        default: return nullptr;
+    }
+}
+
+bool MDNSResponder::scheduleReply(Reply& reply, uint32_t delayMs)
+{
+    if (reply._dueUs) {
+        return false;
     }
     
-    writeHeader(1, additionalCount);
+    // A reply that went out too recently waits out the rest of the interval
+    // rather than leaving the query unanswered (RFC 6762 section 6)
+    uint64_t due = SystemInterface::currentMicroseconds() + delayMs * 1000ULL;
+    uint64_t earliest = reply._sentUs ? reply._sentUs + _minIntervalMs * 1000ULL : 0;
+    if (earliest > due) {
+        _stats.rateLimited++;
+        due = earliest;
+    }
     
-    switch(qtype) {
-        case QuestionType::A:
-            writeA();
-            break;
-        case QuestionType::TXT:
-            writeTXT(service);
-            break;
-        case QuestionType::SRV:
-            writeSRV(service);
-            writeA();
-            break;
-        case QuestionType::PTR:
-            writePTR(service);
-            writeSRV(service);
-            writeTXT(service);
-            writeA();
-            break;
+    reply._dueUs = due;
+    return true;
+}
+
+void MDNSResponder::sendDue()
+{
+	os_timer_disarm(&response_timer);
+    
+    uint64_t now = SystemInterface::currentMicroseconds();
+    uint64_t next = 0;
+    forEachReply([&](Reply& r) {
+        if (!r._dueUs) {
+            return;
+        }
+        if (r._dueUs <= now) {
+            // An announcement may have sent it since it was scheduled
+            uint64_t earliest = r._sentUs ? r._sentUs + _minIntervalMs * 1000ULL : 0;
+            if (earliest <= now) {
+                r._dueUs = 0;
+                sendReply(r);
+                return;
+            }
+            r._dueUs = earliest;
+        }
+        if (!next || r._dueUs < next) {
+            next = r._dueUs;
+        }
+    });
+    
+    if (next) {
+        uint32_t ms = static_cast<uint32_t>((next - now + 999) / 1000);
+        os_timer_arm(&response_timer, ms, false);
     }
+}
 
-    sendReply();
+void MDNSResponder::sendReply(Reply& reply)
+{
+    if (reply._packet.empty()) {
+        return;
+    }
+    
+    updateAddress();
+    
+#ifdef MDNSRESP_DEBUG
+    hexdump("reply", &(reply._packet[0]), reply._packet.size());
+#endif
+    _udp->send({ 224,0,0,251 }, 5353, reinterpret_cast<const char*>(&(reply._packet[0])), reply._packet.size());
+    reply._sentUs = SystemInterface::currentMicroseconds();
+    _stats.sent++;
 }
 
@@ -12,6 +12,22 @@
 #include "Esp.h"
 #include "Containers.h"
 #include "UDP.h"
+#include <strings.h>
+
+// Least time between multicasts of the same reply, RFC 6762 section 6
+#ifndef MDNS_MIN_INTERVAL_MS
+#define MDNS_MIN_INTERVAL_MS 1000
+#endif
+
+// Answers from a shared record set, our PTRs, are held back a random time
+// in this range so devices on the same network don't all answer at once
+#ifndef MDNS_RESPONSE_DELAY_MIN_MS
+#define MDNS_RESPONSE_DELAY_MIN_MS 20
+#endif
+
+#ifndef MDNS_RESPONSE_DELAY_MAX_MS
+#define MDNS_RESPONSE_DELAY_MAX_MS 120
+#endif
 
 namespace m8r {
 
@@ -19,12 +35,47 @@ class MDNSResponder : public UDPDelegate {
 public:
     enum class ServiceProtocol { TCP, UDP };
     
-    void init(const char* name, uint32_t broadcastInterval = 30, uint32_t ttl = 120);
+    struct Stats
+    {
+        // Questions for one of our names
+        uint32_t queries = 0;
+        
+        // Replies multicast, announcements included
+        uint32_t sent = 0;
+        uint32_t announcements = 0;
+        
+        // Replies not sent because the querier listed them as known
+        // answers, and replies delayed because they went out too recently
+        uint32_t knownAnswerSuppressed = 0;
+        uint32_t rateLimited = 0;
+        
+        uint32_t malformed = 0;
+    };
+    
+    // Services are announced when added and again after 1, 2, 4... seconds,
+    // up to MaxAnnouncements in all. broadcastInterval caps the interval,
+    // 0 turns the announcements off. Replies go out on udp if given, which
+    // must already be bound to port 5353 with this responder as its
+    // delegate. Otherwise on one from system()->createUDP()
+    void init(const char* name, uint32_t broadcastInterval = 30, uint32_t ttl = 120, Mad<UDP> udp = Mad<UDP>());
     ~MDNSResponder();
 
     void addService(uint16_t port, const char* instance, const char* serviceType, 
                     ServiceProtocol protocol = ServiceProtocol::TCP, const char* text = "");
     
+    // For testing, 0 sends every reply at once
+    void setMinInterval(uint32_t ms) { _minIntervalMs = ms; }
+    void setResponseDelay(uint32_t minMs, uint32_t maxMs)
+    {
+        _responseDelayMinMs = minMs;
+        _responseDelayMaxMs = (maxMs < minMs) ? minMs : maxMs;
+    }
+    
+    const Stats& stats() const { return _stats; }
+    void resetStats() { _stats = Stats(); }
+    
+    static constexpr uint8_t MaxAnnouncements = 8;
+    
 private:
     enum class QuestionType {
        A = 0x0001,
@@ -40,6 +91,24 @@ private:
     };
     
     static const uint16_t QClassIN = 1;
+    
+    // Replies built for each service, see buildReplies()
+    enum ReplyType { TXTReply, SRVReply, PTRReply, NumReplyTypes };
+    
+    struct Reply
+    {
+        Vector<uint8_t> _packet;
+        
+        // When it was last multicast, and when it is due to be, 0 if it
+        // isn't waiting to go
+        uint64_t _sentUs = 0;
+        uint64_t _dueUs = 0;
+        
+        // The query packet that scheduled it. Only known answers in that
+        // packet, or in the ones that follow a truncated query, cancel it
+        uint32_t _query = 0;
+        bool _truncated = false;
+    };
 
     struct MDNSHeader {
        uint16_t    xid;
@@ -65,6 +134,7 @@ private:
             : _port(port)
             , _instance(String(instance))
             , _serviceType(String(serviceType))
+            , _serviceLabel("_" + _serviceType)
             , _protocol(protocol)
             , _text(String(text))
         {
@@ -73,24 +143,57 @@ private:
         uint16_t _port = 0;
         String _instance;
         String _serviceType;
+        String _serviceLabel;
         ServiceProtocol _protocol = ServiceProtocol::TCP;
         String _text;
+        
+        Reply _replies[NumReplyTypes];
     };
     
-    void receivedData(const char* data, uint16_t length);
-
-    bool matchesHostname(const String& s) const
+    // The labels of a name in a received packet, pointing into the packet.
+    // No name we answer to has more than MaxLabels labels, so only the
+    // first MaxLabels are kept. count is all of them
+    struct Name
     {
-        size_t length = _hostname.size();
-        if (s.size() != length + 6) {
-            return false;
+        static constexpr uint8_t MaxLabels = 4;
+        
+        bool equals(uint8_t i, const char* s, size_t size) const
+        {
+            return _size[i] == size && strncasecmp(_label[i], s, size) == 0;
         }
-        return strncmp(_hostname.c_str(), s.c_str(), length) == 0 && strcmp(s.c_str() + length, ".local") == 0;
-    }
-
-    enum class ParseServiceReturn { OK, NotAService, BadProtocol };
-    ParseServiceReturn parseService(const String& serviceString, const String& protocolString, 
-                                 String& serviceName, ServiceProtocol& protocol);
+        bool equals(uint8_t i, const String& s) const { return equals(i, s.c_str(), s.size()); }
+        
+        const char* _label[MaxLabels];
+        uint8_t _size[MaxLabels];
+        uint8_t _count = 0;
+    };
+    
+    // Compression pointers followed in one name before it is taken as a loop
+    static constexpr uint8_t MaxCompressionPointers = 8;
+    
+    void receivedData(const char* data, uint16_t length);
+    
+    // Returns the offset just past the name at offset in data, or -1 if it
+    // runs off the end, has a bad label or too many pointers
+    static int32_t parseName(const char* data, uint16_t length, uint16_t offset, Name&);
+    static bool sameName(const Name&, const Name&);
+    
+    // Names asked about are:
+    //
+    //      1) <hostname>.local
+    //      2) _<serviceName>.{_tcp | _udp}.local
+    //      3) <hostname>._<serviceName>.{_tcp | _udp}.local
+    //
+    // Returns false if it isn't one of ours. serviceIndex is -1 for 1)
+    bool matchName(const Name&, int32_t& serviceIndex) const;
+    
+    // Returns the offset just past the resource record at offset, or -1
+    static int32_t skipRecord(const char* data, uint16_t length, int32_t offset);
+    
+    // Returns true if the resource record at offset in data is the answer
+    // record of reply with at least half our TTL left, so the querier
+    // already has it (RFC 6762 section 7.1)
+    bool isKnownAnswer(const char* data, uint16_t length, int32_t offset, const Reply&) const;
     
     void write(uint32_t value)
     {
@@ -125,19 +228,70 @@ private:
     void writeSRV(int32_t serviceIndex);
     void writeTXT(int32_t serviceIndex);
     
-    void sendReply();
+    // Answers only change with the hostname, TTL and services, so each
+    // reply packet is built once, when those are set. The A record is last
+    // in every reply that has one, and its address is patched in place
+    // when ours changes
+    void buildReplies();
+    void buildReplies(int32_t serviceIndex);
+    void takeReply(Reply& reply);
+    
+    // Returns true if our address changed since the replies were patched
+    bool updateAddress();
+    
+    // The reply that answers a question, nullptr if there is none
+    Reply* reply(QuestionType, int32_t service);
+    
+    // Replies wait to be sent until they are due, so known answers in
+    // later packets can still suppress them. sendDue() sends those that
+    // are due and sets the timer for the next. A reply isn't sent again
+    // within the min interval, it's put off until the interval is up.
+    // scheduleReply returns false if the reply was already waiting.
+    // sendReply sends at once, announcements go straight there since
+    // their own timing spaces them out
+    bool scheduleReply(Reply&, uint32_t delayMs);
+    void sendDue();
+    void sendReply(Reply&);
+    
+    template<typename F> void forEachReply(F f)
+    {
+        f(_aReply);
+        for (auto& it : _services) {
+            for (auto& reply : it._replies) {
+                f(reply);
+            }
+        }
+    }
     
     static void broadcastCB(void* arg) { reinterpret_cast<MDNSResponder*>(arg)->broadcast(); } 
+    static void responseCB(void* arg) { reinterpret_cast<MDNSResponder*>(arg)->sendDue(); } 
     
+    void startAnnouncing();
     void broadcast();
-    
-    void sendAnswer(QuestionType, int32_t service);
 
     String _hostname;
     Vector<ServiceRecord> _services;
     uint32_t _ttl = 0;
+    
+    // Where replies are built
     Vector<uint8_t> _replyBuffer;
     
+    Reply _aReply;
+    uint32_t _replyAddr = 0;
+    
+    uint32_t _broadcastIntervalMs = 0;
+    uint32_t _announceIntervalMs = 0;
+    uint8_t _announcements = 0;
+    
+    uint32_t _minIntervalMs = MDNS_MIN_INTERVAL_MS;
+    uint32_t _responseDelayMinMs = MDNS_RESPONSE_DELAY_MIN_MS;
+    uint32_t _responseDelayMaxMs = MDNS_RESPONSE_DELAY_MAX_MS;
+    
+    // Query packets received, to tell which one scheduled a reply
+    uint32_t _queryPackets = 0;
+    
+    Stats _stats;
+    
     // UDPDelegate
     virtual void UDPevent(UDP*, Event event, const char* data = nullptr, uint16_t length = 0) override
     {
@@ -0,0 +1,201 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "UDPBatcher.h"
+
+#include "SystemInterface.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace m8r;
+
+UDPBatcher* UDPBatcher::_first = nullptr;
+
+void UDPBatcher::init(Mad<UDP> udp, IPAddr addr, uint16_t port)
+{
+    _udp = udp;
+    _addr = addr;
+    _port = port;
+    _next = _first;
+    _first = this;
+    
+    os_timer_disarm(&_timer);
+    os_timer_setfn(&_timer, (os_timer_func_t*) timerCB, this);
+}
+
+UDPBatcher::~UDPBatcher()
+{
+    os_timer_disarm(&_timer);
+    for (UDPBatcher** it = &_first; *it; it = &(*it)->_next) {
+        if (*it == this) {
+            *it = _next;
+            break;
+        }
+    }
+    freeBuffer();
+}
+
+void UDPBatcher::setDatagramSize(uint16_t size)
+{
+    _datagramSize = (size && size < UDP_BATCHER_DATAGRAM_SIZE) ? size : UDP_BATCHER_DATAGRAM_SIZE;
+}
+
+void UDPBatcher::send(const char* record, uint16_t length)
+{
+    if (!length) {
+        length = strlen(record);
+    }
+
+    _stats.records++;
+    char* p = reserve(length);
+    if (!p) {
+        sendAlone(record, length);
+        return;
+    }
+    memcpy(p, record, length);
+}
+
+void UDPBatcher::sendAlone(const char* record, uint16_t length)
+{
+    _stats.oversize++;
+    _stats.datagrams++;
+    _stats.bytes += length;
+    _udp->send(_addr, _port, record, length);
+}
+
+void UDPBatcher::count(const char* name, int32_t value)
+{
+    setPending();
+    _countsPending = true;
+
+    for (auto& it : _counters) {
+        if (strcmp(it.name.c_str(), name) == 0) {
+            it.value += value;
+            return;
+        }
+    }
+    _counters.push_back({ String(name), value });
+}
+
+void UDPBatcher::flush()
+{
+    for (auto& it : _counters) {
+        if (!it.value) {
+            continue;
+        }
+
+        char total[16];
+        uint16_t totalLength = snprintf(total, sizeof(total), ":%d|c", int(it.value));
+        uint16_t nameLength = it.name.size();
+        it.value = 0;
+        _stats.records++;
+        char* p = reserve(nameLength + totalLength);
+        if (p) {
+            memcpy(p, it.name.c_str(), nameLength);
+            memcpy(p + nameLength, total, totalLength);
+        } else {
+            String record = it.name;
+            record += total;
+            sendAlone(record.c_str(), record.size());
+        }
+    }
+    _countsPending = false;
+
+    if (_length) {
+        sendBatch();
+    }
+    clearPending();
+}
+
+void UDPBatcher::setPending()
+{
+    if (_pendingSince) {
+        return;
+    }
+    _pendingSince = SystemInterface::currentMicroseconds();
+    uint32_t ms = (_intervalUs + 999) / 1000;
+    os_timer_disarm(&_timer);
+    os_timer_arm(&_timer, ms ? ms : 1, false);
+}
+
+void UDPBatcher::clearPending()
+{
+    _pendingSince = 0;
+    os_timer_disarm(&_timer);
+}
+
+void UDPBatcher::timerCB(void* arg)
+{
+    reinterpret_cast<UDPBatcher*>(arg)->flush();
+}
+
+void UDPBatcher::flushDue()
+{
+    uint64_t now = SystemInterface::currentMicroseconds();
+    for (UDPBatcher* batcher = _first; batcher; batcher = batcher->_next) {
+        if (batcher->_pendingSince && now - batcher->_pendingSince >= batcher->_intervalUs) {
+            batcher->flush();
+        }
+    }
+}
+
+char* UDPBatcher::reserve(uint16_t length)
+{
+    if (_length && _length + 1 + length > _bufferSize) {
+        sendBatch();
+    }
+
+    if (!_buffer) {
+        _buffer = Mallocator::shared()->allocate<char>(MemoryType::Network, _datagramSize).get();
+        if (!_buffer) {
+            return nullptr;
+        }
+        _bufferSize = _datagramSize;
+    }
+
+    if (length > _bufferSize) {
+        return nullptr;
+    }
+
+    if (_length) {
+        _buffer[_length++] = '\n';
+    }
+    setPending();
+
+    char* p = _buffer + _length;
+    _length += length;
+    return p;
+}
+
+void UDPBatcher::sendBatch()
+{
+    _stats.datagrams++;
+    _stats.bytes += _length;
+    _udp->send(_addr, _port, _buffer, _length);
+    _length = 0;
+
+    // Counters still waiting keep their start time
+    if (!_countsPending) {
+        clearPending();
+    }
+
+    // Picks up a new datagram size
+    if (_bufferSize != _datagramSize) {
+        freeBuffer();
+    }
+}
+
+void UDPBatcher::freeBuffer()
+{
+    if (_buffer) {
+        Mallocator::shared()->deallocate<char>(MemoryType::Network, Mad<char>(_buffer), _bufferSize);
+        _buffer = nullptr;
+        _bufferSize = 0;
+    }
+}
@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "UDP.h"
+
+extern "C" {
+#include "user_interface.h"
+}
+
+// Largest datagram a batch is sent in. 1472 fills one 1500 byte ethernet
+// or wifi frame after the IP and UDP headers
+#ifndef UDP_BATCHER_DATAGRAM_SIZE
+#define UDP_BATCHER_DATAGRAM_SIZE 1472
+#endif
+
+// A batch goes out once it is full or has waited this long
+#ifndef UDP_BATCHER_INTERVAL_US
+#define UDP_BATCHER_INTERVAL_US 1000000
+#endif
+
+namespace m8r {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: UDPBatcher
+//
+//  Packs small records, like metrics, into as few datagrams as it can.
+//  Records are separated by '\n' and never split across datagrams. A
+//  datagram is sent when the next record won't fit, on flush(), or by a
+//  timer, armed by the first record of a batch, once that record has
+//  waited the interval. flushDue() checks the same deadline and is called
+//  at the end of every task manager iteration.
+//
+//  count() adds to a named counter instead. Counters are sent once per
+//  interval as "name:total|c" records, the statsd convention, so a counter
+//  bumped on every event costs one record per interval.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class UDPBatcher {
+public:
+    struct Stats
+    {
+        uint32_t records = 0;
+        uint32_t datagrams = 0;
+        uint32_t bytes = 0;
+
+        // Records bigger than a datagram, sent on their own
+        uint32_t oversize = 0;
+
+        uint32_t recordsPerDatagram() const { return datagrams ? records / datagrams : 0; }
+    };
+
+    ~UDPBatcher();
+
+    // Records go to addr:port through udp, which stays the caller's
+    void init(Mad<UDP> udp, IPAddr addr, uint16_t port);
+
+    void setInterval(uint32_t us) { _intervalUs = us; }
+
+    // Smaller than UDP_BATCHER_DATAGRAM_SIZE for a path with a smaller MTU.
+    // Takes effect with the next batch
+    void setDatagramSize(uint16_t size);
+
+    void send(const char* record, uint16_t length = 0);
+    void count(const char* name, int32_t value = 1);
+
+    // Send the counters and whatever records are waiting
+    void flush();
+    static void flushDue();
+
+    const Stats& stats() const { return _stats; }
+    void resetStats() { _stats = Stats(); }
+
+private:
+    struct Counter
+    {
+        String name;
+        int32_t value;
+    };
+
+    // Make room for a record of length bytes, sending the batch if it
+    // doesn't fit, and return where it goes. Returns nullptr if the record
+    // is bigger than a datagram
+    char* reserve(uint16_t length);
+    void sendBatch();
+    
+    // Send a record that can't go in a batch in a datagram of its own
+    void sendAlone(const char* record, uint16_t length);
+    
+    // Note that something is waiting and start the interval if it's first
+    void setPending();
+    void clearPending();
+    static void timerCB(void* arg);
+    void freeBuffer();
+
+    Mad<UDP> _udp;
+    IPAddr _addr;
+    uint16_t _port = 0;
+    uint32_t _intervalUs = UDP_BATCHER_INTERVAL_US;
+
+    // Allocated with the first record
+    char* _buffer = nullptr;
+    uint16_t _bufferSize = 0;
+    uint16_t _datagramSize = UDP_BATCHER_DATAGRAM_SIZE;
+    uint16_t _length = 0;
+
+    // When the oldest waiting record or count came in, 0 if nothing waits
+    uint64_t _pendingSince = 0;
+    bool _countsPending = false;
+    os_timer_t _timer;
+
+    // Names are kept from interval to interval, only nonzero ones are sent
+    Vector<Counter> _counters;
+
+    Stats _stats;
+
+    // Every UDPBatcher, for flushDue
+    UDPBatcher* _next = nullptr;
+    static UDPBatcher* _first;
+};
+
+}
@@ -1,6 +1,12 @@
 #include "flashmem.h"
 #include "Esp.h"
 
+// ROM and SDK functions spi_flash_erase_sector is built on
+extern void Cache_Read_Disable_2( void );
+extern void Cache_Read_Enable_2( void );
+extern SpiFlashOpResult SPIUnlock( void );
+extern SpiFlashOpResult SPIEraseBlock( uint32_t block );
+
 // Based on NodeMCU platform_flash
 // https://github.com/nodemcu/nodemcu-firmware
 
@@ -8,7 +14,7 @@ uint32_t flashmem_write( const void *from, uint32_t toaddr, uint32_t size )
 {
   uint32_t temp, rest, ssize = size;
   unsigned i;
-  char tmpdata[ INTERNAL_FLASH_WRITE_UNIT_SIZE ];
+  char tmpdata[ INTERNAL_FLASH_WRITE_UNIT_SIZE ] __attribute__((aligned(4)));
   const uint8_t *pfrom = ( const uint8_t* )from;
   const uint32_t blksize = INTERNAL_FLASH_WRITE_UNIT_SIZE;
   const uint32_t blkmask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
@@ -64,7 +70,7 @@ uint32_t flashmem_read( void *to, uint32_t fromaddr, uint32_t size )
 {
   uint32_t temp, rest, ssize = size;
   unsigned i;
-  char tmpdata[ INTERNAL_FLASH_READ_UNIT_SIZE ];
+  char tmpdata[ INTERNAL_FLASH_READ_UNIT_SIZE ] __attribute__((aligned(4)));
   uint8_t *pto = ( uint8_t* )to;
   const uint32_t blksize = INTERNAL_FLASH_READ_UNIT_SIZE;
   const uint32_t blkmask = INTERNAL_FLASH_READ_UNIT_SIZE - 1;
@@ -94,17 +100,18 @@ uint32_t flashmem_read( void *to, uint32_t fromaddr, uint32_t size )
   {
       // The start address is now a multiple of blksize
       // flashmem_read_internal requires destination buffer to be 4 byte aligned. 
-      // If not, use a buffer and move into place
+      // If not, read into an aligned buffer a chunk at a time and move into place
       if ((((int) pto) & 0x03) != 0) {
+        uint32_t bounce[ FLASHMEM_BOUNCE_SIZE / sizeof( uint32_t ) ];
         while (temp) {
-            assert((((int) tmpdata) & 0x03) == 0);
-            if (flashmem_read_internal(tmpdata, fromaddr, blksize) != blksize) {
+            uint32_t chunk = temp < sizeof( bounce ) ? temp : sizeof( bounce );
+            if (flashmem_read_internal(bounce, fromaddr, chunk) != chunk) {
                 return 0;
             }
-            memcpy(pto, tmpdata, blksize);
-            pto += blksize;
-            fromaddr += blksize;
-            temp -= blksize;
+            memcpy(pto, bounce, chunk);
+            pto += chunk;
+            fromaddr += chunk;
+            temp -= chunk;
         }
     } else {
         assert((((int) pto) & 0x03) == 0);
@@ -134,6 +141,54 @@ bool flashmem_erase_sector( uint32_t sector_id )
   return spi_flash_erase_sector( sector_id ) == SPI_FLASH_RESULT_OK;
 }
 
+// What spi_flash_erase_sector does, with the block erase command. The
+// flash cache is off until the chip is done, so this has to be in IRAM
+static SpiFlashOpResult __attribute__((section(".iram.text"))) flashmem_erase_block_internal( uint32_t block_id )
+{
+  SpiFlashOpResult r;
+  Cache_Read_Disable_2();
+  r = SPIUnlock();
+  if( r == SPI_FLASH_RESULT_OK )
+    r = SPIEraseBlock( block_id );
+  Cache_Read_Enable_2();
+  return r;
+}
+
+bool flashmem_erase_block( uint32_t block_id )
+{
+  WRITE_PERI_REG(0x60000914, 0x73);
+  return flashmem_erase_block_internal( block_id ) == SPI_FLASH_RESULT_OK;
+}
+
+bool flashmem_erase( uint32_t addr, uint32_t size )
+{
+  const uint32_t sectors_per_block = INTERNAL_FLASH_BLOCK_SIZE / INTERNAL_FLASH_SECTOR_SIZE;
+  uint32_t sector, end;
+
+  if( size == 0 )
+    return true;
+  sector = flashmem_get_sector_of_address( addr );
+  end = flashmem_get_sector_of_address( addr + size - 1 ) + 1;
+
+  // Sectors up to a block boundary, whole blocks, then the sectors left
+  while( sector < end )
+  {
+    if( FLASHMEM_BLOCK_ERASE && ( sector % sectors_per_block ) == 0 && end - sector >= sectors_per_block )
+    {
+      if( !flashmem_erase_block( sector / sectors_per_block ) )
+        return false;
+      sector += sectors_per_block;
+    }
+    else
+    {
+      if( !flashmem_erase_sector( sector ) )
+        return false;
+      sector ++;
+    }
+  }
+  return true;
+}
+
 SPIFlashInfo flashmem_get_info()
 {
     volatile SPIFlashInfo spi_flash_info STORE_ATTR;
@@ -209,17 +264,22 @@ uint32_t flashmem_write_internal( const void *from, uint32_t toaddr, uint32_t si
 {
   SpiFlashOpResult r;
   const uint32_t blkmask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
-  uint32_t *apbuf = NULL;
   if( ((uint32_t)from) & blkmask ){
-    //apbuf = (uint32_t *)umm_malloc(size);
-    if(!apbuf)
-      return 0;
-    memcpy(apbuf, from, size);
+    // Program through an aligned buffer a chunk at a time
+    uint32_t bounce[ FLASHMEM_BOUNCE_SIZE / sizeof( uint32_t ) ];
+    const uint8_t *pfrom = ( const uint8_t* )from;
+    uint32_t done, chunk;
+    for( done = 0; done < size; done += chunk )
+    {
+      chunk = size - done < sizeof( bounce ) ? size - done : sizeof( bounce );
+      memcpy( bounce, pfrom + done, chunk );
+      if( flashmem_write_internal( bounce, toaddr + done, chunk ) != chunk )
+        return 0;
+    }
+    return size;
   }
   WRITE_PERI_REG(0x60000914, 0x73);
-  r = spi_flash_write(toaddr, apbuf?(uint32 *)apbuf:(uint32 *)from, size);
-  if(apbuf)
-    umm_free(apbuf);
+  r = spi_flash_write(toaddr, (uint32 *)from, size);
   if(SPI_FLASH_RESULT_OK == r)
     return size;
   else{
@@ -256,3 +316,14 @@ uint32_t flashmem_get_first_free_block_address()
   flashmem_find_sector( ( uint32_t )_SPIFFS_start - 1, NULL, &end);
   return end + 1;
 }
+
+uint32_t flashmem_get_fs_start()
+{
+  // The linker script symbols are addresses in the mapped flash
+  return ( uint32_t )&_SPIFFS_start - INTERNAL_FLASH_START_ADDRESS;
+}
+
+uint32_t flashmem_get_fs_end()
+{
+  return ( uint32_t )&_SPIFFS_end - INTERNAL_FLASH_START_ADDRESS;
+}
@@ -89,9 +89,22 @@ extern u32_t _SPIFFS_block;
 #define FLASH_WORK_SEC_COUNT (FLASH_TOTAL_SEC_COUNT - SYS_PARAM_SEC_COUNT)
 
 #define INTERNAL_FLASH_SECTOR_SIZE      SPI_FLASH_SEC_SIZE
+#define INTERNAL_FLASH_BLOCK_SIZE       0x10000
 #define INTERNAL_FLASH_SIZE             ( (FLASH_WORK_SEC_COUNT) * INTERNAL_FLASH_SECTOR_SIZE )
 #define INTERNAL_FLASH_START_ADDRESS    0x40200000
 
+// flashmem_erase uses the chip's 64KB block erase for whole blocks. 0 for
+// a chip without it
+#ifndef FLASHMEM_BLOCK_ERASE
+#define FLASHMEM_BLOCK_ERASE 1
+#endif
+
+// Bytes of stack used to read into or program from a buffer that isn't
+// word aligned, which the SDK can't do directly
+#ifndef FLASHMEM_BOUNCE_SIZE
+#define FLASHMEM_BOUNCE_SIZE 256
+#endif
+
 typedef struct
 {
     uint8_t unknown0;
@@ -123,6 +136,10 @@ typedef struct
 extern uint32_t flashmem_write( const void *from, uint32_t toaddr, uint32_t size );
 extern uint32_t flashmem_read( void *to, uint32_t fromaddr, uint32_t size );
 extern bool flashmem_erase_sector( uint32_t sector_id );
+extern bool flashmem_erase_block( uint32_t block_id );
+
+// Erase every sector with a byte in size bytes from addr
+extern bool flashmem_erase( uint32_t addr, uint32_t size );
 
 extern SPIFlashInfo flashmem_get_info();
 extern uint8_t flashmem_get_size_type();
@@ -135,6 +152,11 @@ extern uint32_t flashmem_write_internal( const void *from, uint32_t toaddr, uint
 extern uint32_t flashmem_read_internal( void *to, uint32_t fromaddr, uint32_t size );
 extern uint32_t flashmem_get_first_free_block_address();
 
+// The file system partition, _SPIFFS_start to _SPIFFS_end in the linker
+// script, as flash offsets
+extern uint32_t flashmem_get_fs_start();
+extern uint32_t flashmem_get_fs_end();
+
 #ifdef __cplusplus
 }
 #endif
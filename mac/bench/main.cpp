@@ -0,0 +1,280 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Runs every .lua file under a directory (scripts/ by default), or the
+// files given, a number of times each and prints how long they took.
+// Each run is a fresh LuaEngine, loaded and executed to completion. The
+// free system heap is sampled between time slices for its low point,
+// -s 0 turns slicing off and samples only before and after.
+//
+//     m8rlua-bench [-n iterations] [-s slice us] [-rom file] [-json file] [directory or script.lua...]
+//
+// -rom compiles the scripts into a ROM image in file, maps it and loads
+// each run from there instead of the source, as the device does from
+// flash.
+//
+// -json writes the results to file, one object per script with the
+// iterations, wall times, heap high-water marks and collections, so they
+// can be compared from commit to commit.
+
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "LuaEngine.h"
+#include "LuaROMImage.h"
+#include "MacSystemInterface.h"
+#include "ReadFile.h"
+#include "SystemInterface.h"
+
+static bool isDirectory(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Add the .lua files under path, sorted so runs are in the same order
+static void findScripts(const m8r::String& path, m8r::Vector<m8r::String>& scripts)
+{
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return;
+    }
+
+    m8r::Vector<m8r::String> entries;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            entries.push_back(m8r::String(entry->d_name));
+        }
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end(), [](const m8r::String& a, const m8r::String& b) { return strcmp(a.c_str(), b.c_str()) < 0; });
+
+    for (auto& it : entries) {
+        m8r::String child = path;
+        child += "/";
+        child += it;
+        size_t length = child.size();
+        if (isDirectory(child.c_str())) {
+            findScripts(child, scripts);
+        } else if (length > 4 && strcmp(child.c_str() + length - 4, ".lua") == 0) {
+            scripts.push_back(child);
+        }
+    }
+}
+
+struct Result
+{
+    m8r::String filename;
+    bool success = true;
+    uint32_t iterations = 0;
+    uint64_t totalUs = 0;
+    uint64_t minUs = UINT64_MAX;
+    uint64_t maxUs = 0;
+    
+    // Lua heap high-water mark from the engine's allocator, and how far
+    // the free system heap dropped below where it was before the load
+    size_t luaHeapPeak = 0;
+    uint32_t systemHeapPeak = 0;
+    
+    // Most in any one iteration
+    uint32_t gcCollections = 0;
+};
+
+static Result runScript(const char* filename, uint32_t iterations, uint32_t sliceUs, const lua::LuaROMImage* rom)
+{
+    Result result;
+    result.filename = filename;
+    
+    m8r::String source;
+    if (!rom && !readFile(filename, source)) {
+        fprintf(stderr, "Unable to open '%s', skipping\n", filename);
+        result.success = false;
+        return result;
+    }
+
+    for (uint32_t i = 0; i < iterations && result.success; ++i) {
+        lua::LuaEngine engine;
+        engine.setTimeSlice(sliceUs ? LUAENGINE_SLICE_INSTRUCTIONS : 0, sliceUs);
+        
+        uint32_t freeBefore = m8r::system()->heapFreeSize();
+        uint32_t freeLow = freeBefore;
+
+        uint64_t start = m8r::SystemInterface::currentMicroseconds();
+        result.success = rom ? engine.load(*rom, filename) : engine.load(source.c_str(), source.size());
+        while (result.success) {
+            freeLow = std::min(freeLow, m8r::system()->heapFreeSize());
+            m8r::CallReturnValue r = engine.execute();
+            if (!r.isYield()) {
+                result.success = r.isFinished();
+                break;
+            }
+        }
+        uint64_t elapsed = m8r::SystemInterface::currentMicroseconds() - start;
+        freeLow = std::min(freeLow, m8r::system()->heapFreeSize());
+
+        result.iterations++;
+        result.totalUs += elapsed;
+        result.minUs = std::min(result.minUs, elapsed);
+        result.maxUs = std::max(result.maxUs, elapsed);
+        result.luaHeapPeak = std::max(result.luaHeapPeak, engine.heapPeak());
+        result.systemHeapPeak = std::max(result.systemHeapPeak, freeBefore - freeLow);
+        result.gcCollections = std::max(result.gcCollections, engine.gcCollections());
+    }
+
+    if (!result.success) {
+        printf("%-40s FAILED\n", filename);
+        return result;
+    }
+
+    printf("%-40s %6d runs, mean %10.1f us, min %10llu us, max %10llu us, heap peak %8d, %4d collections\n",
+           filename, result.iterations, double(result.totalUs) / result.iterations,
+           (unsigned long long) result.minUs, (unsigned long long) result.maxUs,
+           int(result.luaHeapPeak), result.gcCollections);
+    return result;
+}
+
+// Chunks are named by their script's path
+static bool buildROM(const char* filename, const m8r::Vector<m8r::String>& scripts, lua::LuaROMImage& rom)
+{
+    m8r::Vector<m8r::String> sources;
+    for (auto& it : scripts) {
+        sources.push_back(m8r::String());
+        if (!readFile(it.c_str(), sources.back())) {
+            fprintf(stderr, "Unable to open '%s'\n", it.c_str());
+            return false;
+        }
+    }
+    
+    m8r::Vector<lua::LuaROMImage::Script> entries;
+    for (size_t i = 0; i < scripts.size(); ++i) {
+        entries.push_back({ scripts[i].c_str(), sources[i].c_str(), sources[i].size() });
+    }
+    
+    m8r::Vector<uint8_t> image;
+    m8r::String error;
+    if (!lua::LuaROMImage::build(entries.data(), entries.size(), image, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return false;
+    }
+    
+    FILE* file = fopen(filename, "wb");
+    bool written = file && fwrite(image.data(), 1, image.size(), file) == image.size();
+    if (file) {
+        written = fclose(file) == 0 && written;
+    }
+    if (!written || !rom.map(filename)) {
+        fprintf(stderr, "Unable to write and map '%s'\n", filename);
+        return false;
+    }
+    return true;
+}
+
+static void writeJSONString(FILE* file, const char* s)
+{
+    fputc('"', file);
+    for ( ; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+static bool writeJSON(const char* filename, const m8r::Vector<Result>& results, uint32_t sliceUs, uint64_t totalUs)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Unable to open '%s' for results\n", filename);
+        return false;
+    }
+    
+    fprintf(file, "{\n  \"sliceUs\": %u,\n  \"totalUs\": %llu,\n  \"benchmarks\": [", sliceUs, (unsigned long long) totalUs);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(file, "%s\n    { \"name\": ", i ? "," : "");
+        writeJSONString(file, r.filename.c_str());
+        fprintf(file, ", \"success\": %s, \"iterations\": %u", r.success ? "true" : "false", r.iterations);
+        if (r.iterations) {
+            fprintf(file, ", \"meanUs\": %.1f, \"minUs\": %llu, \"maxUs\": %llu",
+                    double(r.totalUs) / r.iterations, (unsigned long long) r.minUs, (unsigned long long) r.maxUs);
+        }
+        fprintf(file, ", \"luaHeapPeak\": %u, \"systemHeapPeak\": %u, \"gcCollections\": %u }",
+                unsigned(r.luaHeapPeak), r.systemHeapPeak, r.gcCollections);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char * argv[])
+{
+    uint32_t iterations = 10;
+    uint32_t sliceUs = LUAENGINE_SLICE_US;
+    const char* jsonFile = nullptr;
+    const char* romFile = nullptr;
+
+    int i = 1;
+    for ( ; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            iterations = std::max(1, atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-s") == 0) {
+            sliceUs = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-rom") == 0) {
+            romFile = argv[i + 1];
+        } else if (strcmp(argv[i], "-json") == 0) {
+            jsonFile = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+
+    m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
+
+    m8r::Vector<m8r::String> scripts;
+    if (i >= argc) {
+        findScripts("scripts", scripts);
+    }
+    for ( ; i < argc; ++i) {
+        if (isDirectory(argv[i])) {
+            findScripts(argv[i], scripts);
+        } else {
+            scripts.push_back(m8r::String(argv[i]));
+        }
+    }
+
+    if (scripts.empty()) {
+        fprintf(stderr, "usage: m8rlua-bench [-n iterations] [-s slice us] [-rom file] [-json file] [directory or script.lua...]\n");
+        return 1;
+    }
+    
+    lua::LuaROMImage rom;
+    if (romFile && !buildROM(romFile, scripts, rom)) {
+        return 1;
+    }
+
+    bool success = true;
+    m8r::Vector<Result> results;
+    uint64_t start = m8r::SystemInterface::currentMicroseconds();
+    for (auto& it : scripts) {
+        results.push_back(runScript(it.c_str(), iterations, sliceUs, romFile ? &rom : nullptr));
+        success = results.back().success && success;
+    }
+    uint64_t totalUs = m8r::SystemInterface::currentMicroseconds() - start;
+    printf("Total %.3f s\n", double(totalUs) / 1000000);
+    
+    if (jsonFile && !writeJSON(jsonFile, results, sliceUs, totalUs)) {
+        success = false;
+    }
+    return success ? 0 : 1;
+}
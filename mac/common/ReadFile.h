@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdio.h>
+
+#include "MString.h"
+
+// Append the contents of filename to contents. Shared by the host tools
+static inline bool readFile(const char* filename, m8r::String& contents)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        return false;
+    }
+
+    char buf[4096];
+    size_t size;
+    while ((size = fread(buf, 1, sizeof(buf), file)) > 0) {
+        contents += m8r::String(buf, size);
+    }
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,465 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "FlashEmulator.h"
+
+#include "flashmem.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace m8r;
+
+static constexpr uint32_t SectorSize = INTERNAL_FLASH_SECTOR_SIZE;
+static constexpr uint32_t WriteUnitMask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
+static constexpr uint32_t ReadUnitMask = INTERNAL_FLASH_READ_UNIT_SIZE - 1;
+
+namespace {
+
+struct State
+{
+    FlashEmulator::Config config;
+    FlashEmulator::Stats stats;
+    uint8_t* image = nullptr;
+    uint32_t size = 0;
+    int fd = -1;
+    std::vector<uint32_t> erases;
+
+    // Kept in ns so short commands add up
+    uint64_t simulatedNs = 0;
+};
+
+State _state;
+
+bool inPartition(uint32_t addr, uint32_t size)
+{
+    return _state.image && addr >= _state.config.start && addr <= _state.config.end && size <= _state.config.end - addr;
+}
+
+void simulate(uint64_t ns)
+{
+    _state.simulatedNs += ns;
+    _state.stats.simulatedUs = _state.simulatedNs / 1000;
+}
+
+bool fail(const char* what, uint32_t addr, uint32_t size)
+{
+    _state.stats.failures++;
+    fprintf(stderr, "FlashEmulator: %s of %u bytes at 0x%08x failed\n", what, size, addr);
+    return false;
+}
+
+// One read command on the bus
+bool readFlash(uint32_t addr, void* dst, uint32_t size)
+{
+    if (!inPartition(addr, size) || (addr & ReadUnitMask) || (reinterpret_cast<uintptr_t>(dst) & ReadUnitMask)) {
+        return fail("read", addr, size);
+    }
+
+    memcpy(dst, _state.image + addr - _state.config.start, size);
+    _state.stats.bytesRead += size;
+    simulate(_state.config.readCommandNs + uint64_t(size) * _state.config.readByteNs);
+    return true;
+}
+
+// What spi_flash_write does, a program command for each page the range
+// touches
+bool programFlash(uint32_t addr, const void* src, uint32_t size)
+{
+    if (!inPartition(addr, size) || (addr & WriteUnitMask) || (size & WriteUnitMask)
+            || (reinterpret_cast<uintptr_t>(src) & WriteUnitMask)) {
+        return fail("program", addr, size);
+    }
+
+    const uint8_t* from = static_cast<const uint8_t*>(src);
+    uint8_t* to = _state.image + addr - _state.config.start;
+    bool conflict = false;
+    for (uint32_t i = 0; i < size; ++i) {
+        conflict = conflict || (from[i] & ~to[i]);
+        to[i] &= from[i];
+    }
+    if (conflict) {
+        _state.stats.conflicts++;
+    }
+
+    uint32_t pageSize = _state.config.pageSize;
+    while (size) {
+        uint32_t chunk = std::min(size, pageSize - addr % pageSize);
+        _state.stats.programCommands++;
+        _state.stats.bytesProgrammed += chunk;
+        simulate(_state.config.programFirstByteUs * 1000ULL + uint64_t(chunk - 1) * _state.config.programByteNs);
+        addr += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// What flashmem_write_internal does, programming a misaligned source
+// through an aligned buffer
+bool programInternal(uint32_t addr, const void* src, uint32_t size)
+{
+    if (!(reinterpret_cast<uintptr_t>(src) & WriteUnitMask)) {
+        return programFlash(addr, src, size);
+    }
+
+    uint32_t bounce[FLASHMEM_BOUNCE_SIZE / sizeof(uint32_t)];
+    const uint8_t* from = static_cast<const uint8_t*>(src);
+    for (uint32_t done = 0, chunk = 0; done < size; done += chunk) {
+        chunk = std::min(size - done, uint32_t(sizeof(bounce)));
+        memcpy(bounce, from + done, chunk);
+        if (!programFlash(addr + done, bounce, chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool eraseFlash(uint32_t addr, uint32_t size, uint32_t us)
+{
+    if (!inPartition(addr, size)) {
+        return fail("erase", addr, size);
+    }
+
+    simulate(us * 1000ULL);
+    for (uint32_t i = 0; i < size / SectorSize; ++i) {
+        _state.erases[(addr - _state.config.start) / SectorSize + i]++;
+    }
+    memset(_state.image + addr - _state.config.start, 0xff, size);
+    return true;
+}
+
+}
+
+void FlashEmulator::setConfig(const Config& config)
+{
+    _state.config = config;
+}
+
+const FlashEmulator::Config& FlashEmulator::config()
+{
+    return _state.config;
+}
+
+bool FlashEmulator::open(const char* filename, bool format)
+{
+    close();
+
+    const Config& config = _state.config;
+    if (config.start % SectorSize || config.end % SectorSize || config.end <= config.start
+            || config.end > config.chipSize || !config.pageSize) {
+        fprintf(stderr, "FlashEmulator: partition 0x%08x to 0x%08x doesn't fit the flash\n", config.start, config.end);
+        return false;
+    }
+
+    int fd = ::open(filename, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "FlashEmulator: unable to open '%s'\n", filename);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+
+    uint32_t size = config.end - config.start;
+    uint32_t existing = format ? 0 : uint32_t(std::min(off_t(size), st.st_size));
+    if (st.st_size != off_t(size) && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "FlashEmulator: unable to size '%s'\n", filename);
+        ::close(fd);
+        return false;
+    }
+
+    void* image = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "FlashEmulator: unable to map '%s'\n", filename);
+        ::close(fd);
+        return false;
+    }
+
+    _state.image = static_cast<uint8_t*>(image);
+    _state.size = size;
+    _state.fd = fd;
+    _state.erases.resize(size / SectorSize);
+    memset(_state.image + existing, 0xff, size - existing);
+    resetStats();
+    return true;
+}
+
+void FlashEmulator::close()
+{
+    if (_state.image) {
+        msync(_state.image, _state.size, MS_SYNC);
+        munmap(_state.image, _state.size);
+        ::close(_state.fd);
+        _state.image = nullptr;
+        _state.size = 0;
+        _state.fd = -1;
+    }
+}
+
+bool FlashEmulator::isOpen()
+{
+    return _state.image;
+}
+
+const FlashEmulator::Stats& FlashEmulator::stats()
+{
+    return _state.stats;
+}
+
+void FlashEmulator::resetStats()
+{
+    _state.stats = Stats();
+    _state.simulatedNs = 0;
+    std::fill(_state.erases.begin(), _state.erases.end(), 0);
+}
+
+uint32_t FlashEmulator::erases(uint32_t sector)
+{
+    uint32_t first = _state.config.start / SectorSize;
+    return (sector >= first && sector - first < _state.erases.size()) ? _state.erases[sector - first] : 0;
+}
+
+FlashEmulator::Wear FlashEmulator::wear()
+{
+    Wear wear;
+    if (_state.erases.empty()) {
+        return wear;
+    }
+
+    uint64_t total = 0;
+    wear.min = _state.erases[0];
+    for (auto it : _state.erases) {
+        wear.min = std::min(wear.min, it);
+        wear.max = std::max(wear.max, it);
+        total += it;
+    }
+    wear.mean = double(total) / _state.erases.size();
+    return wear;
+}
+
+// The flashmem functions, with the same alignment handling as
+// esp/core/flashmem.c so the same commands reach the chip
+
+uint32_t flashmem_write(const void* from, uint32_t toaddr, uint32_t size)
+{
+    _state.stats.programs++;
+    const uint8_t* pfrom = static_cast<const uint8_t*>(from);
+    uint32_t ssize = size;
+    uint32_t word[1];
+    uint8_t* tmp = reinterpret_cast<uint8_t*>(word);
+
+    // Ragged ends are read, merged and programmed a word at a time
+    if (toaddr & WriteUnitMask) {
+        uint32_t aligned = toaddr & ~WriteUnitMask;
+        if (!readFlash(aligned, tmp, sizeof(word))) {
+            return 0;
+        }
+        for (uint32_t i = toaddr & WriteUnitMask; size && i < sizeof(word); ++i, --size) {
+            tmp[i] = *pfrom++;
+        }
+        if (!programFlash(aligned, tmp, sizeof(word))) {
+            return 0;
+        }
+        if (!size) {
+            return ssize;
+        }
+        toaddr = aligned + sizeof(word);
+    }
+
+    uint32_t whole = size & ~WriteUnitMask;
+    if (whole) {
+        if (!programInternal(toaddr, pfrom, whole)) {
+            return 0;
+        }
+        toaddr += whole;
+        pfrom += whole;
+        size -= whole;
+    }
+
+    if (size) {
+        if (!readFlash(toaddr, tmp, sizeof(word))) {
+            return 0;
+        }
+        memcpy(tmp, pfrom, size);
+        if (!programFlash(toaddr, tmp, sizeof(word))) {
+            return 0;
+        }
+    }
+    return ssize;
+}
+
+uint32_t flashmem_read(void* to, uint32_t fromaddr, uint32_t size)
+{
+    _state.stats.reads++;
+    uint8_t* pto = static_cast<uint8_t*>(to);
+    uint32_t ssize = size;
+    uint32_t word[1];
+    uint8_t* tmp = reinterpret_cast<uint8_t*>(word);
+
+    if (fromaddr & ReadUnitMask) {
+        uint32_t aligned = fromaddr & ~ReadUnitMask;
+        if (!readFlash(aligned, tmp, sizeof(word))) {
+            return 0;
+        }
+        for (uint32_t i = fromaddr & ReadUnitMask; size && i < sizeof(word); ++i, --size) {
+            *pto++ = tmp[i];
+        }
+        if (!size) {
+            return ssize;
+        }
+        fromaddr = aligned + sizeof(word);
+    }
+
+    uint32_t whole = size & ~ReadUnitMask;
+    if (whole) {
+        if (reinterpret_cast<uintptr_t>(pto) & ReadUnitMask) {
+            // A chunk at a time through an aligned buffer
+            uint32_t bounce[FLASHMEM_BOUNCE_SIZE / sizeof(uint32_t)];
+            for (uint32_t done = 0, chunk = 0; done < whole; done += chunk) {
+                chunk = std::min(whole - done, uint32_t(sizeof(bounce)));
+                if (!readFlash(fromaddr + done, bounce, chunk)) {
+                    return 0;
+                }
+                memcpy(pto + done, bounce, chunk);
+            }
+        } else if (!readFlash(fromaddr, pto, whole)) {
+            return 0;
+        }
+        fromaddr += whole;
+        pto += whole;
+        size -= whole;
+    }
+
+    if (size) {
+        if (!readFlash(fromaddr, tmp, sizeof(word))) {
+            return 0;
+        }
+        memcpy(pto, tmp, size);
+    }
+    return ssize;
+}
+
+bool flashmem_erase_sector(uint32_t sector_id)
+{
+    _state.stats.erases++;
+    return eraseFlash(sector_id * SectorSize, SectorSize, _state.config.eraseUs);
+}
+
+bool flashmem_erase_block(uint32_t block_id)
+{
+    _state.stats.blockErases++;
+    return eraseFlash(block_id * INTERNAL_FLASH_BLOCK_SIZE, INTERNAL_FLASH_BLOCK_SIZE, _state.config.blockEraseUs);
+}
+
+bool flashmem_erase(uint32_t addr, uint32_t size)
+{
+    const uint32_t sectorsPerBlock = INTERNAL_FLASH_BLOCK_SIZE / SectorSize;
+    if (!size) {
+        return true;
+    }
+
+    uint32_t sector = addr / SectorSize;
+    uint32_t end = (addr + size - 1) / SectorSize + 1;
+    while (sector < end) {
+        if (FLASHMEM_BLOCK_ERASE && sector % sectorsPerBlock == 0 && end - sector >= sectorsPerBlock) {
+            if (!flashmem_erase_block(sector / sectorsPerBlock)) {
+                return false;
+            }
+            sector += sectorsPerBlock;
+        } else {
+            if (!flashmem_erase_sector(sector)) {
+                return false;
+            }
+            sector++;
+        }
+    }
+    return true;
+}
+
+SPIFlashInfo flashmem_get_info()
+{
+    SPIFlashInfo info;
+    memset(&info, 0, sizeof(info));
+    info.mode = SPIFlashInfo::MODE_DIO;
+    info.speed = SPIFlashInfo::SPEED_40MHZ;
+    switch (_state.config.chipSize) {
+        case 256 * 1024: info.size = SPIFlashInfo::SIZE_2MBIT; break;
+        case 1024 * 1024: info.size = SPIFlashInfo::SIZE_8MBIT; break;
+        case 2 * 1024 * 1024: info.size = SPIFlashInfo::SIZE_16MBIT; break;
+        case 4 * 1024 * 1024: info.size = SPIFlashInfo::SIZE_32MBIT; break;
+        default: info.size = SPIFlashInfo::SIZE_4MBIT; break;
+    }
+    return info;
+}
+
+uint8_t flashmem_get_size_type()
+{
+    return flashmem_get_info().size;
+}
+
+uint32_t flashmem_get_size_bytes()
+{
+    return _state.config.chipSize;
+}
+
+uint16_t flashmem_get_size_sectors()
+{
+    return flashmem_get_size_bytes() / SectorSize;
+}
+
+uint32_t flashmem_find_sector(uint32_t address, uint32_t* pstart, uint32_t* pend)
+{
+    uint32_t sector = address / SectorSize;
+    if (pstart) {
+        *pstart = sector * SectorSize;
+    }
+    if (pend) {
+        *pend = (sector + 1) * SectorSize - 1;
+    }
+    return sector;
+}
+
+uint32_t flashmem_get_sector_of_address(uint32_t addr)
+{
+    return flashmem_find_sector(addr, nullptr, nullptr);
+}
+
+uint32_t flashmem_write_internal(const void* from, uint32_t toaddr, uint32_t size)
+{
+    _state.stats.programs++;
+    return programInternal(toaddr, from, size) ? size : 0;
+}
+
+uint32_t flashmem_read_internal(void* to, uint32_t fromaddr, uint32_t size)
+{
+    _state.stats.reads++;
+    return readFlash(fromaddr, to, size) ? size : 0;
+}
+
+uint32_t flashmem_get_first_free_block_address()
+{
+    return _state.config.start;
+}
+
+uint32_t flashmem_get_fs_start()
+{
+    return _state.config.start;
+}
+
+uint32_t flashmem_get_fs_end()
+{
+    return _state.config.end;
+}
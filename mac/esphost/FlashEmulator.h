@@ -0,0 +1,109 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace m8r {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: FlashEmulator
+//
+//  SPI NOR flash behind the flashmem_* functions in esp/core/flashmem.h,
+//  so FlashCache and the file system HAL above it can run on the host.
+//  The file system partition is an image file mapped into memory. It is
+//  addressed by flash offset, like on the device, and an access outside
+//  it fails.
+//
+//  Like NOR flash, programming can only clear bits and erasing sets a
+//  whole sector back to 0xff. A program that asks for a 1 where flash
+//  has a 0 keeps the 0 and is counted as a conflict, which is a file
+//  system writing over data it didn't erase. Every operation adds what
+//  it would take on the chip to the simulated time, and each sector's
+//  erases are counted to show wear.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class FlashEmulator
+{
+public:
+    struct Config
+    {
+        // Flash offsets of the partition, _SPIFFS_start and _SPIFFS_end in
+        // esp/core/eagle.flash.4m.ld less where the flash is mapped
+        uint32_t start = 0x100000;
+        uint32_t end = 0x3fb000;
+
+        // What flashmem_get_size_bytes says the chip is
+        uint32_t chipSize = 4 * 1024 * 1024;
+
+        // Typical times for the W25Q32 on most ESP-12 modules, with the bus
+        // at 40MHz DIO. A program command takes the first byte time plus
+        // the byte time for each one after it and can't cross a page
+        uint32_t readCommandNs = 2000;
+        uint32_t readByteNs = 100;
+        uint32_t programFirstByteUs = 30;
+        uint32_t programByteNs = 2500;
+        uint32_t pageSize = 256;
+        uint32_t eraseUs = 45000;
+        uint32_t blockEraseUs = 150000;
+    };
+
+    struct Stats
+    {
+        // Calls to flashmem_* and the program and erase commands they
+        // send to the chip. Erases are of 4KB sectors, blockErases of 64KB
+        uint32_t reads = 0;
+        uint32_t programs = 0;
+        uint32_t programCommands = 0;
+        uint32_t erases = 0;
+        uint32_t blockErases = 0;
+
+        uint64_t bytesRead = 0;
+        uint64_t bytesProgrammed = 0;
+
+        // Programs that asked for a 0 bit to be set to 1
+        uint32_t conflicts = 0;
+
+        // Accesses outside the partition or not aligned as the SDK needs
+        uint32_t failures = 0;
+
+        uint64_t simulatedUs = 0;
+    };
+
+    struct Wear
+    {
+        uint32_t min = 0;
+        uint32_t max = 0;
+        double mean = 0;
+    };
+
+    // Takes effect with the next open()
+    static void setConfig(const Config&);
+    static const Config& config();
+
+    // Map filename as the partition, creating it if needed. Anything
+    // the file doesn't cover yet reads as erased, and format erases all
+    // of it. Returns false if the file can't be opened or mapped
+    static bool open(const char* filename, bool format = false);
+    static void close();
+    static bool isOpen();
+
+    static const Stats& stats();
+    static void resetStats();
+
+    // Erases since open() or resetStats() of a sector, numbered as for
+    // flashmem_erase_sector, and of all the sectors in the partition
+    static uint32_t erases(uint32_t sector);
+    static Wear wear();
+};
+
+}
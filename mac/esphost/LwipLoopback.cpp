@@ -0,0 +1,1326 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "LwipLoopback.h"
+
+#include "ets_sys.h"
+#include "lwip/igmp.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/udp.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace m8r;
+
+const ip_addr_t ip_addr_any = { 0 };
+const ip_addr_t ip_addr_broadcast = { 0xffffffff };
+
+// Set on a segment once it has been on the wire. It is never added to
+// after that, so a resend has the same bounds as the original
+#define TF_SEG_SENT ((u8_t) 0x80U)
+
+namespace {
+
+// Room left in front of the payload for the headers of each layer below
+const u16_t LayerOffset[] = { 20 + 20 + 14, 20 + 14, 14, 0 };
+
+struct Packet
+{
+    enum class Type { Syn, SynAck, Rst, Data, Ack, Datagram };
+
+    Packet(Type t) : type(t) { }
+
+    Type type;
+    uint64_t at = 0;
+    u32_t to = 0;
+    u32_t from = 0;
+
+    // Syn is to a port. SynAck and Data carry a sequence number, Ack an
+    // acknowledgment number and window
+    u16_t port = 0;
+    u32_t seqno = 0;
+    u16_t window = 0;
+    bool fin = false;
+    std::vector<char> bytes;
+
+    ip_addr_t srcIP = { 0 };
+};
+
+struct ArmedTimer
+{
+    ETSTimer* timer;
+    uint64_t at;
+    uint64_t periodUs;
+};
+
+struct Loopback
+{
+    LwipLoopback::Config config;
+    LwipLoopback::Stats stats;
+    std::mt19937 random { 1 };
+
+    // In order of arrival time, every packet has the same latency
+    std::deque<Packet> packets;
+
+    // Live pcbs by id. Packets are addressed by id, so one for a pcb that
+    // has gone away is dropped rather than delivered to a new pcb at the
+    // same address. Freed TCP pcbs are kept until the end of poll()
+    // because the code calling back still has them on the stack
+    std::unordered_map<u32_t, tcp_pcb*> tcpPcbs;
+    std::unordered_map<u32_t, udp_pcb*> udpPcbs;
+    std::vector<tcp_pcb*> deadTcpPcbs;
+
+    std::vector<ArmedTimer> timers;
+    std::map<u32_t, uint32_t> groups;
+
+    u32_t nextId = 0;
+    u16_t nextPort = 0;
+    uint32_t pbufs = 0;
+    uint64_t nextSlowTimer = 0;
+};
+
+Loopback _loopback;
+
+}
+
+static uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool lose()
+{
+    return _loopback.config.loss > 0 && std::uniform_real_distribution<double>(0, 1)(_loopback.random) < _loopback.config.loss;
+}
+
+static u16_t ephemeralPort()
+{
+    if (_loopback.nextPort < 49152) {
+        _loopback.nextPort = 49152;
+    }
+    return _loopback.nextPort++;
+}
+
+static ip_addr_t localhost()
+{
+    ip_addr_t addr;
+    IP4_ADDR(&addr, 127, 0, 0, 1);
+    return addr;
+}
+
+static void send(Packet&& packet)
+{
+    packet.at = now() + _loopback.config.latencyUs;
+    _loopback.packets.push_back(std::move(packet));
+}
+
+static tcp_pcb* tcpPcb(u32_t id)
+{
+    auto it = _loopback.tcpPcbs.find(id);
+    return (it == _loopback.tcpPcbs.end()) ? nullptr : it->second;
+}
+
+static bool alive(tcp_pcb* pcb)
+{
+    return tcpPcb(pcb->id) == pcb;
+}
+
+static u32_t span(const tcp_seg* seg)
+{
+    return seg->len + ((seg->flags & TF_SEG_FIN) ? 1 : 0);
+}
+
+static tcp_seg* newSeg(u32_t seqno, u8_t flags)
+{
+    tcp_seg* seg = static_cast<tcp_seg*>(calloc(1, sizeof(tcp_seg)));
+    seg->seqno = seqno;
+    seg->flags = flags;
+    return seg;
+}
+
+static void freeSegs(tcp_seg* seg)
+{
+    while (seg) {
+        tcp_seg* next = seg->next;
+        if (seg->p) {
+            pbuf_free(seg->p);
+        }
+        free(seg);
+        seg = next;
+    }
+}
+
+static void appendSeg(tcp_seg** list, tcp_seg* seg)
+{
+    while (*list) {
+        list = &(*list)->next;
+    }
+    *list = seg;
+}
+
+static void freeTcpPcb(tcp_pcb* pcb)
+{
+    if (!_loopback.tcpPcbs.erase(pcb->id)) {
+        return;
+    }
+    freeSegs(pcb->unsent);
+    freeSegs(pcb->unacked);
+    freeSegs(pcb->ooseq);
+    if (pcb->refused_data) {
+        pbuf_free(pcb->refused_data);
+    }
+    pcb->unsent = pcb->unacked = pcb->ooseq = nullptr;
+    pcb->refused_data = nullptr;
+    pcb->state = CLOSED;
+    _loopback.deadTcpPcbs.push_back(pcb);
+}
+
+static void sendReset(u32_t to, u32_t from)
+{
+    Packet packet(Packet::Type::Rst);
+    packet.to = to;
+    packet.from = from;
+    send(std::move(packet));
+}
+
+static void sendAck(tcp_pcb* pcb)
+{
+    if (!tcpPcb(pcb->peer)) {
+        return;
+    }
+    Packet packet(Packet::Type::Ack);
+    packet.to = pcb->peer;
+    packet.from = pcb->id;
+    packet.seqno = pcb->rcv_nxt;
+    packet.window = pcb->rcv_wnd;
+    pcb->rcv_ann_wnd = pcb->rcv_wnd;
+    send(std::move(packet));
+}
+
+static void transmit(tcp_pcb* pcb, tcp_seg* seg)
+{
+    _loopback.stats.segments++;
+    if (seg->flags & TF_SEG_SENT) {
+        _loopback.stats.retransmits++;
+    }
+    seg->flags |= TF_SEG_SENT;
+
+    if (lose()) {
+        _loopback.stats.lost++;
+        return;
+    }
+
+    // Read now, like lwIP does, so data written without
+    // TCP_WRITE_FLAG_COPY has to still be there
+    Packet packet(Packet::Type::Data);
+    packet.to = pcb->peer;
+    packet.from = pcb->id;
+    packet.seqno = seg->seqno;
+    packet.fin = (seg->flags & TF_SEG_FIN) != 0;
+    packet.bytes.resize(seg->len);
+    if (seg->len) {
+        pbuf_copy_partial(seg->p, packet.bytes.data(), seg->len, 0);
+    }
+    send(std::move(packet));
+}
+
+// A pbuf for a segment. Copies get room for the rest of the segment, so
+// small writes after it go into the same pbuf
+static pbuf* segmentPbuf(const char* data, u16_t length, u16_t capacity, bool copy, u16_t& oversize)
+{
+    if (!copy) {
+        pbuf* p = pbuf_alloc(PBUF_RAW, length, PBUF_ROM);
+        p->payload = const_cast<char*>(data);
+        oversize = 0;
+        return p;
+    }
+
+    pbuf* p = pbuf_alloc(PBUF_RAW, capacity, PBUF_RAM);
+    memcpy(p->payload, data, length);
+    p->len = p->tot_len = length;
+    oversize = capacity - length;
+    return p;
+}
+
+// The segment's data as handed to the receiver, split into pbufs of
+// pbufSize. Takes the segment's pbuf when it doesn't need splitting
+static pbuf* receivedPbufs(tcp_seg* seg)
+{
+    u16_t size = _loopback.config.pbufSize;
+    if (!size || seg->len <= size) {
+        pbuf* p = seg->p;
+        seg->p = nullptr;
+        return p;
+    }
+
+    pbuf* head = nullptr;
+    for (u16_t offset = 0; offset < seg->len; offset += size) {
+        u16_t length = (seg->len - offset < size) ? seg->len - offset : size;
+        pbuf* p = pbuf_alloc(PBUF_RAW, length, PBUF_RAM);
+        pbuf_copy_partial(seg->p, p->payload, length, offset);
+        if (head) {
+            pbuf_cat(head, p);
+        } else {
+            head = p;
+        }
+    }
+    return head;
+}
+
+// Returns false if the pcb went away in the callback
+static bool deliverChain(tcp_pcb* pcb, pbuf* chain)
+{
+    _loopback.stats.bytes += chain->tot_len;
+    if (chain->next) {
+        _loopback.stats.chains++;
+    }
+    pcb->rcv_wnd = (chain->tot_len > pcb->rcv_wnd) ? 0 : pcb->rcv_wnd - chain->tot_len;
+
+    if (pcb->refused_data) {
+        pbuf_cat(pcb->refused_data, chain);
+        return true;
+    }
+
+    if (!pcb->recv) {
+        // lwIP's tcp_recv_null
+        tcp_recved(pcb, chain->tot_len);
+        pbuf_free(chain);
+        return true;
+    }
+
+    err_t err = pcb->recv(pcb->callback_arg, pcb, chain, ERR_OK);
+    if (err == ERR_ABRT || !alive(pcb)) {
+        return false;
+    }
+    if (err != ERR_OK) {
+        // Refused, offered again on the next poll
+        pcb->refused_data = chain;
+    }
+    return true;
+}
+
+static void deliverSyn(Packet& packet)
+{
+    tcp_pcb* client = tcpPcb(packet.from);
+    if (!client) {
+        return;
+    }
+
+    tcp_pcb* listener = nullptr;
+    for (auto& it : _loopback.tcpPcbs) {
+        if (it.second->state == LISTEN && it.second->local_port == packet.port) {
+            listener = it.second;
+            break;
+        }
+    }
+    if (!listener || !listener->accept) {
+        _loopback.stats.refused++;
+        sendReset(client->id, 0);
+        return;
+    }
+
+    tcp_pcb* pcb = tcp_new();
+    pcb->local_ip = listener->local_ip;
+    pcb->local_port = listener->local_port;
+    pcb->remote_ip = localhost();
+    pcb->remote_port = client->local_port;
+    pcb->prio = listener->prio;
+    pcb->callback_arg = listener->callback_arg;
+    pcb->state = ESTABLISHED;
+    pcb->peer = client->id;
+    pcb->rcv_nxt = packet.seqno;
+    pcb->snd_wnd = packet.window;
+    client->peer = pcb->id;
+
+    err_t err = listener->accept(listener->callback_arg, pcb, ERR_OK);
+    if (err == ERR_ABRT) {
+        // tcp_abort already reset the client
+        return;
+    }
+    if (err != ERR_OK) {
+        tcp_abort(pcb);
+        return;
+    }
+
+    _loopback.stats.connections++;
+    Packet synAck(Packet::Type::SynAck);
+    synAck.to = client->id;
+    synAck.from = pcb->id;
+    synAck.seqno = pcb->snd_nxt;
+    synAck.window = pcb->rcv_wnd;
+    send(std::move(synAck));
+}
+
+static void deliverSynAck(Packet& packet)
+{
+    tcp_pcb* pcb = tcpPcb(packet.to);
+    if (!pcb || pcb->state != SYN_SENT) {
+        return;
+    }
+
+    pcb->state = ESTABLISHED;
+    pcb->peer = packet.from;
+    pcb->rcv_nxt = packet.seqno;
+    pcb->snd_wnd = packet.window;
+    if (pcb->connected && pcb->connected(pcb->callback_arg, pcb, ERR_OK) == ERR_ABRT) {
+        return;
+    }
+    if (alive(pcb)) {
+        tcp_output(pcb);
+    }
+}
+
+static void deliverReset(Packet& packet)
+{
+    tcp_pcb* pcb = tcpPcb(packet.to);
+    if (!pcb) {
+        return;
+    }
+
+    // lwIP frees the pcb before telling the application
+    _loopback.stats.resets++;
+    tcp_err_fn errf = pcb->errf;
+    void* arg = pcb->callback_arg;
+    freeTcpPcb(pcb);
+    if (errf) {
+        errf(arg, ERR_RST);
+    }
+}
+
+static void deliverData(Packet& packet)
+{
+    tcp_pcb* pcb = tcpPcb(packet.to);
+    if (!pcb) {
+        sendReset(packet.from, packet.to);
+        return;
+    }
+    if (pcb->state == LISTEN || pcb->state == SYN_SENT || pcb->refused_data) {
+        // Dropped, and resent when the acknowledgment doesn't come
+        return;
+    }
+
+    tcp_seg* seg = newSeg(packet.seqno, packet.fin ? TF_SEG_FIN : 0);
+    seg->len = u16_t(packet.bytes.size());
+    if (seg->len) {
+        seg->p = pbuf_alloc(PBUF_RAW, seg->len, PBUF_RAM);
+        memcpy(seg->p->payload, packet.bytes.data(), seg->len);
+    }
+
+    if (TCP_SEQ_LT(seg->seqno, pcb->rcv_nxt)) {
+        // Already have it
+        freeSegs(seg);
+        sendAck(pcb);
+        return;
+    }
+
+    if (TCP_SEQ_GT(seg->seqno, pcb->rcv_nxt)) {
+        // Ahead of a lost segment, hold it until the gap is filled
+        tcp_seg** it = &pcb->ooseq;
+        while (*it && TCP_SEQ_LT((*it)->seqno, seg->seqno)) {
+            it = &(*it)->next;
+        }
+        if (*it && (*it)->seqno == seg->seqno) {
+            freeSegs(seg);
+        } else {
+            seg->next = *it;
+            *it = seg;
+        }
+        sendAck(pcb);
+        return;
+    }
+
+    // In order, along with whatever was held waiting for it
+    std::vector<tcp_seg*> ready { seg };
+    pcb->rcv_nxt += span(seg);
+    while (pcb->ooseq && TCP_SEQ_LEQ(pcb->ooseq->seqno, pcb->rcv_nxt)) {
+        tcp_seg* next = pcb->ooseq;
+        pcb->ooseq = next->next;
+        next->next = nullptr;
+        if (next->seqno == pcb->rcv_nxt) {
+            pcb->rcv_nxt += span(next);
+            ready.push_back(next);
+        } else {
+            freeSegs(next);
+        }
+    }
+
+    bool fin = false;
+    bool open = true;
+    u16_t chainSegments = _loopback.config.chainSegments ? _loopback.config.chainSegments : 1;
+    for (size_t i = 0; open && i < ready.size(); ) {
+        pbuf* chain = nullptr;
+        for (u16_t count = 0; i < ready.size() && count < chainSegments; ++i) {
+            tcp_seg* s = ready[i];
+            if (s->flags & TF_SEG_FIN) {
+                fin = true;
+            }
+            if (!s->len) {
+                continue;
+            }
+            if (chain && u32_t(chain->tot_len) + s->len > 0xffff) {
+                break;
+            }
+            pbuf* p = receivedPbufs(s);
+            if (chain) {
+                pbuf_cat(chain, p);
+            } else {
+                chain = p;
+            }
+            ++count;
+        }
+        if (chain) {
+            open = deliverChain(pcb, chain);
+        }
+    }
+    for (auto it : ready) {
+        freeSegs(it);
+    }
+    if (!open) {
+        return;
+    }
+
+    sendAck(pcb);
+    if (!fin) {
+        return;
+    }
+
+    switch (pcb->state) {
+        case ESTABLISHED: pcb->state = CLOSE_WAIT; break;
+        case FIN_WAIT_1: pcb->state = CLOSING; break;
+        case FIN_WAIT_2: pcb->state = TIME_WAIT; break;
+        default: break;
+    }
+
+    // A recv with no pbuf is the other end closing
+    if (pcb->recv) {
+        if (pcb->recv(pcb->callback_arg, pcb, nullptr, ERR_OK) == ERR_ABRT) {
+            return;
+        }
+    } else {
+        tcp_close(pcb);
+    }
+
+    // No 2MSL wait
+    if (alive(pcb) && pcb->state == TIME_WAIT) {
+        freeTcpPcb(pcb);
+    }
+}
+
+static void deliverAck(Packet& packet)
+{
+    tcp_pcb* pcb = tcpPcb(packet.to);
+    if (!pcb) {
+        sendReset(packet.from, packet.to);
+        return;
+    }
+
+    pcb->snd_wnd = packet.window;
+    u32_t ackno = packet.seqno;
+    if (TCP_SEQ_GT(ackno, pcb->lastack) && TCP_SEQ_LEQ(ackno, pcb->snd_lbb)) {
+        u32_t acked = 0;
+        bool finAcked = false;
+
+        // A go back N resend puts acknowledged segments back on unsent
+        for (tcp_seg** list : { &pcb->unacked, &pcb->unsent }) {
+            while (*list && TCP_SEQ_LEQ((*list)->seqno + span(*list), ackno)) {
+                tcp_seg* seg = *list;
+                *list = seg->next;
+                seg->next = nullptr;
+                acked += seg->len;
+                finAcked = finAcked || (seg->flags & TF_SEG_FIN);
+                if (seg->p) {
+                    pcb->snd_queuelen -= pbuf_clen(seg->p);
+                }
+                freeSegs(seg);
+            }
+        }
+        if (!pcb->unsent) {
+            pcb->unsent_oversize = 0;
+        }
+
+        pcb->lastack = ackno;
+        if (TCP_SEQ_GT(ackno, pcb->snd_nxt)) {
+            pcb->snd_nxt = ackno;
+        }
+        pcb->snd_buf += acked;
+        pcb->rtime = pcb->unacked ? now() + _loopback.config.retransmitUs : 0;
+
+        if (acked && pcb->sent) {
+            if (pcb->sent(pcb->callback_arg, pcb, u16_t(acked)) == ERR_ABRT || !alive(pcb)) {
+                return;
+            }
+        }
+
+        if (finAcked) {
+            if (pcb->state == FIN_WAIT_1) {
+                pcb->state = FIN_WAIT_2;
+            } else {
+                // CLOSING or LAST_ACK, both ends are done
+                freeTcpPcb(pcb);
+                return;
+            }
+        }
+    }
+
+    tcp_output(pcb);
+}
+
+static void deliverDatagram(Packet& packet)
+{
+    auto it = _loopback.udpPcbs.find(packet.to);
+    if (it == _loopback.udpPcbs.end()) {
+        return;
+    }
+    udp_pcb* pcb = it->second;
+
+    _loopback.stats.datagrams++;
+    pbuf* p = pbuf_alloc(PBUF_TRANSPORT, u16_t(packet.bytes.size()), PBUF_RAM);
+    memcpy(p->payload, packet.bytes.data(), packet.bytes.size());
+    if (pcb->recv) {
+        pcb->recv(pcb->recv_arg, pcb, p, &packet.srcIP, packet.port);
+    } else {
+        pbuf_free(p);
+    }
+}
+
+static void deliver(Packet& packet)
+{
+    switch (packet.type) {
+        case Packet::Type::Syn: deliverSyn(packet); break;
+        case Packet::Type::SynAck: deliverSynAck(packet); break;
+        case Packet::Type::Rst: deliverReset(packet); break;
+        case Packet::Type::Data: deliverData(packet); break;
+        case Packet::Type::Ack: deliverAck(packet); break;
+        case Packet::Type::Datagram: deliverDatagram(packet); break;
+    }
+}
+
+// Resend what hasn't been acknowledged in time, or if nothing is in flight
+// and the window was too small, look at it again like a window probe
+static void retransmit(tcp_pcb* pcb)
+{
+    pcb->rtime = 0;
+    if (pcb->unacked) {
+        tcp_seg* last = pcb->unacked;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = pcb->unsent;
+        pcb->unsent = pcb->unacked;
+        pcb->unacked = nullptr;
+        pcb->snd_nxt = pcb->lastack;
+    } else if (tcp_pcb* peer = tcpPcb(pcb->peer)) {
+        pcb->snd_wnd = peer->rcv_wnd;
+    }
+    tcp_output(pcb);
+}
+
+static void runTimers(uint64_t t)
+{
+    std::vector<ArmedTimer> due;
+    for (size_t i = 0; i < _loopback.timers.size(); ) {
+        ArmedTimer& timer = _loopback.timers[i];
+        if (timer.at > t) {
+            ++i;
+            continue;
+        }
+        due.push_back(timer);
+        if (timer.periodUs) {
+            timer.at = t + timer.periodUs;
+            ++i;
+        } else {
+            _loopback.timers.erase(_loopback.timers.begin() + i);
+        }
+    }
+
+    for (auto& it : due) {
+        _loopback.stats.timers++;
+        if (it.timer->timer_func) {
+            it.timer->timer_func(it.timer->timer_arg);
+        }
+    }
+}
+
+void LwipLoopback::setConfig(const Config& config)
+{
+    _loopback.config = config;
+    _loopback.random.seed(config.seed);
+}
+
+const LwipLoopback::Config& LwipLoopback::config()
+{
+    return _loopback.config;
+}
+
+const LwipLoopback::Stats& LwipLoopback::stats()
+{
+    return _loopback.stats;
+}
+
+void LwipLoopback::resetStats()
+{
+    _loopback.stats = Stats();
+}
+
+bool LwipLoopback::poll()
+{
+    uint64_t t = now();
+    bool busy = false;
+
+    // Only what was sent before this call. What callbacks send now waits
+    // for the next one, the way an lwIP application gets a turn between
+    // packets
+    for (size_t count = _loopback.packets.size(); count && _loopback.packets.front().at <= t; --count) {
+        Packet packet = std::move(_loopback.packets.front());
+        _loopback.packets.pop_front();
+        deliver(packet);
+        busy = true;
+    }
+
+    std::vector<tcp_pcb*> pcbs;
+    for (auto& it : _loopback.tcpPcbs) {
+        pcbs.push_back(it.second);
+    }
+
+    for (auto pcb : pcbs) {
+        if (!alive(pcb)) {
+            continue;
+        }
+        if (pcb->refused_data) {
+            busy = true;
+            pbuf* p = pcb->refused_data;
+            pcb->refused_data = nullptr;
+            if (!deliverChain(pcb, p)) {
+                continue;
+            }
+        }
+        if (pcb->rtime) {
+            busy = true;
+            if (t >= pcb->rtime) {
+                retransmit(pcb);
+            }
+        }
+    }
+
+    // lwIP's slow timer, for tcp_poll
+    if (t >= _loopback.nextSlowTimer) {
+        _loopback.nextSlowTimer = t + 500000;
+        for (auto pcb : pcbs) {
+            if (alive(pcb) && pcb->poll && ++pcb->polltmr >= pcb->pollinterval) {
+                pcb->polltmr = 0;
+                pcb->poll(pcb->callback_arg, pcb);
+            }
+        }
+    }
+
+    runTimers(t);
+
+    for (auto it : _loopback.deadTcpPcbs) {
+        free(it);
+    }
+    _loopback.deadTcpPcbs.clear();
+
+    return busy || !_loopback.packets.empty();
+}
+
+uint32_t LwipLoopback::pbufsInUse()
+{
+    return _loopback.pbufs;
+}
+
+uint32_t LwipLoopback::tcpPcbsInUse()
+{
+    return uint32_t(_loopback.tcpPcbs.size());
+}
+
+uint32_t LwipLoopback::udpPcbsInUse()
+{
+    return uint32_t(_loopback.udpPcbs.size());
+}
+
+//
+// pbuf
+//
+
+static pbuf* newPbuf(size_t storage, pbuf_type type, u16_t offset)
+{
+    pbuf* p = static_cast<pbuf*>(malloc(sizeof(pbuf) + storage));
+    if (!p) {
+        return nullptr;
+    }
+    p->next = nullptr;
+    p->payload = storage ? reinterpret_cast<char*>(p + 1) + offset : nullptr;
+    p->tot_len = 0;
+    p->len = 0;
+    p->type = type;
+    p->flags = 0;
+    p->ref = 1;
+    _loopback.pbufs++;
+    return p;
+}
+
+struct pbuf* pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+    u16_t offset = LayerOffset[layer];
+    pbuf* p;
+
+    switch (type) {
+        case PBUF_RAM:
+            p = newPbuf(offset + length, type, offset);
+            if (p) {
+                p->len = p->tot_len = length;
+            }
+            return p;
+        case PBUF_POOL: {
+            p = nullptr;
+            u16_t remaining = length;
+            do {
+                pbuf* q = newPbuf(PBUF_POOL_BUFSIZE, type, offset);
+                if (!q) {
+                    if (p) {
+                        pbuf_free(p);
+                    }
+                    return nullptr;
+                }
+                q->len = (remaining < PBUF_POOL_BUFSIZE - offset) ? remaining : PBUF_POOL_BUFSIZE - offset;
+                q->tot_len = q->len;
+                if (p) {
+                    pbuf_cat(p, q);
+                } else {
+                    p = q;
+                }
+                remaining -= q->len;
+                offset = 0;
+            } while (remaining);
+            return p;
+        }
+        case PBUF_ROM:
+        case PBUF_REF:
+            p = newPbuf(0, type, 0);
+            if (p) {
+                p->len = p->tot_len = length;
+            }
+            return p;
+    }
+    return nullptr;
+}
+
+u8_t pbuf_header(struct pbuf *p, s16_t header_size)
+{
+    if (!header_size) {
+        return 0;
+    }
+    if (header_size < 0 && -header_size > p->len) {
+        return 1;
+    }
+
+    char* payload = static_cast<char*>(p->payload) - header_size;
+    if (p->type == PBUF_RAM || p->type == PBUF_POOL) {
+        if (payload < reinterpret_cast<char*>(p + 1)) {
+            return 1;
+        }
+    } else if (header_size > 0) {
+        // Nothing in front of referenced data
+        return 1;
+    }
+
+    p->payload = payload;
+    p->len += header_size;
+    p->tot_len += header_size;
+    return 0;
+}
+
+void pbuf_ref(struct pbuf *p)
+{
+    if (p) {
+        p->ref++;
+    }
+}
+
+u8_t pbuf_free(struct pbuf *p)
+{
+    u8_t count = 0;
+    while (p) {
+        if (--p->ref > 0) {
+            break;
+        }
+        pbuf* next = p->next;
+        free(p);
+        _loopback.pbufs--;
+        count++;
+        p = next;
+    }
+    return count;
+}
+
+u8_t pbuf_clen(struct pbuf *p)
+{
+    u8_t count = 0;
+    for ( ; p; p = p->next) {
+        count++;
+    }
+    return count;
+}
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail)
+{
+    pbuf* p = head;
+    for ( ; p->next; p = p->next) {
+        p->tot_len += tail->tot_len;
+    }
+    p->tot_len += tail->tot_len;
+    p->next = tail;
+}
+
+void pbuf_chain(struct pbuf *head, struct pbuf *tail)
+{
+    pbuf_cat(head, tail);
+    pbuf_ref(tail);
+}
+
+u16_t pbuf_copy_partial(struct pbuf *buf, void *dataptr, u16_t len, u16_t offset)
+{
+    u16_t copied = 0;
+    for (pbuf* p = buf; p && len; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        u16_t n = (p->len - offset < len) ? p->len - offset : len;
+        memcpy(static_cast<char*>(dataptr) + copied, static_cast<char*>(p->payload) + offset, n);
+        copied += n;
+        len -= n;
+        offset = 0;
+    }
+    return copied;
+}
+
+err_t pbuf_take(struct pbuf *buf, const void *dataptr, u16_t len)
+{
+    if (!buf || len > buf->tot_len) {
+        return ERR_ARG;
+    }
+    u16_t copied = 0;
+    for (pbuf* p = buf; p && copied < len; p = p->next) {
+        u16_t n = (len - copied < p->len) ? len - copied : p->len;
+        memcpy(p->payload, static_cast<const char*>(dataptr) + copied, n);
+        copied += n;
+    }
+    return ERR_OK;
+}
+
+//
+// TCP
+//
+
+struct tcp_pcb *tcp_new(void)
+{
+    tcp_pcb* pcb = static_cast<tcp_pcb*>(calloc(1, sizeof(tcp_pcb)));
+    pcb->prio = TCP_PRIO_NORMAL;
+    pcb->mss = _loopback.config.mss;
+    pcb->snd_buf = _loopback.config.sendBuffer;
+    pcb->rcv_wnd = pcb->rcv_ann_wnd = _loopback.config.receiveWindow;
+    pcb->snd_wnd = pcb->mss;
+    pcb->pollinterval = 1;
+    pcb->lastack = pcb->snd_nxt = pcb->snd_lbb = _loopback.random();
+    pcb->id = ++_loopback.nextId;
+    _loopback.tcpPcbs[pcb->id] = pcb;
+    return pcb;
+}
+
+void tcp_arg(struct tcp_pcb *pcb, void *arg) { pcb->callback_arg = arg; }
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept) { pcb->accept = accept; }
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv) { pcb->recv = recv; }
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent) { pcb->sent = sent; }
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err) { pcb->errf = err; }
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio) { pcb->prio = prio; }
+
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval)
+{
+    pcb->poll = poll;
+    pcb->pollinterval = interval;
+}
+
+err_t tcp_bind(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port)
+{
+    if (!port) {
+        port = ephemeralPort();
+    }
+    for (auto& it : _loopback.tcpPcbs) {
+        if (it.second != pcb && it.second->state == LISTEN && it.second->local_port == port) {
+            return ERR_USE;
+        }
+    }
+    pcb->local_ip = ipaddr ? *ipaddr : ip_addr_any;
+    pcb->local_port = port;
+    return ERR_OK;
+}
+
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb)
+{
+    pcb->state = LISTEN;
+    return pcb;
+}
+
+err_t tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port, tcp_connected_fn connected)
+{
+    if (pcb->state != CLOSED) {
+        return ERR_ISCONN;
+    }
+    if (!pcb->local_port) {
+        pcb->local_port = ephemeralPort();
+    }
+    pcb->local_ip = localhost();
+    pcb->remote_ip = *ipaddr;
+    pcb->remote_port = port;
+    pcb->connected = connected;
+    pcb->state = SYN_SENT;
+
+    Packet packet(Packet::Type::Syn);
+    packet.from = pcb->id;
+    packet.port = port;
+    packet.seqno = pcb->snd_nxt;
+    packet.window = pcb->rcv_wnd;
+    send(std::move(packet));
+    return ERR_OK;
+}
+
+void tcp_recved(struct tcp_pcb *pcb, u16_t len)
+{
+    u32_t wnd = u32_t(pcb->rcv_wnd) + len;
+    pcb->rcv_wnd = (wnd > _loopback.config.receiveWindow) ? _loopback.config.receiveWindow : u16_t(wnd);
+
+    // Tell the sender once the window has opened enough to matter
+    u16_t threshold = _loopback.config.receiveWindow / 4;
+    if (pcb->rcv_wnd >= pcb->rcv_ann_wnd + threshold || (pcb->rcv_ann_wnd < pcb->mss && pcb->rcv_wnd >= pcb->mss)) {
+        sendAck(pcb);
+    }
+}
+
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags)
+{
+    if (pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT && pcb->state != SYN_SENT) {
+        return ERR_CONN;
+    }
+    if (!len) {
+        return ERR_OK;
+    }
+    if (len > pcb->snd_buf) {
+        pcb->flags |= TF_NAGLEMEMERR;
+        return ERR_MEM;
+    }
+
+    bool copy = (apiflags & TCP_WRITE_FLAG_COPY) != 0;
+    u16_t mss = pcb->mss;
+
+    // Fill out the last segment first, if it hasn't been sent
+    tcp_seg* last = pcb->unsent;
+    while (last && last->next) {
+        last = last->next;
+    }
+    u16_t fill = 0;
+    if (last && !(last->flags & (TF_SEG_FIN | TF_SEG_SENT)) && last->len < mss) {
+        fill = (len < mss - last->len) ? len : mss - last->len;
+    }
+    bool inPlace = fill && copy && fill <= pcb->unsent_oversize;
+
+    u16_t rest = len - fill;
+    u32_t pbufs = (rest + mss - 1) / mss + ((fill && !inPlace) ? 1 : 0);
+    u32_t queueMax = (4 * u32_t(_loopback.config.sendBuffer) + mss - 1) / mss;
+    if (pcb->snd_queuelen + pbufs > queueMax) {
+        pcb->flags |= TF_NAGLEMEMERR;
+        return ERR_MEM;
+    }
+
+    const char* data = static_cast<const char*>(dataptr);
+    if (inPlace) {
+        pbuf* p = last->p;
+        while (p->next) {
+            p = p->next;
+        }
+        memcpy(static_cast<char*>(p->payload) + p->len, data, fill);
+        p->len += fill;
+        for (pbuf* q = last->p; q; q = q->next) {
+            q->tot_len += fill;
+        }
+        pcb->unsent_oversize -= fill;
+    } else if (fill) {
+        pbuf_cat(last->p, segmentPbuf(data, fill, mss - last->len, copy, pcb->unsent_oversize));
+        pcb->snd_queuelen++;
+    }
+    if (fill) {
+        last->len += fill;
+        data += fill;
+    }
+
+    u32_t seqno = pcb->snd_lbb + fill;
+    while (rest) {
+        u16_t length = (rest < mss) ? rest : mss;
+        tcp_seg* seg = newSeg(seqno, 0);
+        seg->p = segmentPbuf(data, length, mss, copy, pcb->unsent_oversize);
+        seg->len = length;
+        appendSeg(&pcb->unsent, seg);
+        pcb->snd_queuelen++;
+        seqno += length;
+        data += length;
+        rest -= length;
+    }
+
+    pcb->snd_lbb += len;
+    pcb->snd_buf -= len;
+    pcb->flags &= ~TF_NAGLEMEMERR;
+    return ERR_OK;
+}
+
+err_t tcp_output(struct tcp_pcb *pcb)
+{
+    switch (pcb->state) {
+        case ESTABLISHED:
+        case CLOSE_WAIT:
+        case FIN_WAIT_1:
+        case CLOSING:
+        case LAST_ACK:
+            break;
+        default:
+            return ERR_OK;
+    }
+
+    while (tcp_seg* seg = pcb->unsent) {
+        // Nagle holds a small last segment while anything is unacknowledged
+        bool nagle = pcb->unacked && !(pcb->flags & (TF_NODELAY | TF_NAGLEMEMERR)) &&
+                     !seg->next && seg->len < pcb->mss && !(seg->flags & TF_SEG_FIN) &&
+                     pcb->snd_buf && pcb->snd_queuelen < (4 * u32_t(_loopback.config.sendBuffer) + pcb->mss - 1) / pcb->mss;
+        if (nagle) {
+            break;
+        }
+
+        u32_t inFlight = pcb->snd_nxt - pcb->lastack;
+        if (seg->len && inFlight + seg->len > pcb->snd_wnd) {
+            if (!pcb->unacked && !pcb->rtime) {
+                // Look at the window again later
+                pcb->rtime = now() + _loopback.config.retransmitUs;
+            }
+            break;
+        }
+
+        pcb->unsent = seg->next;
+        seg->next = nullptr;
+        if (!pcb->unsent) {
+            pcb->unsent_oversize = 0;
+        }
+        appendSeg(&pcb->unacked, seg);
+        pcb->snd_nxt = seg->seqno + span(seg);
+        if (!pcb->rtime) {
+            pcb->rtime = now() + _loopback.config.retransmitUs;
+        }
+        transmit(pcb, seg);
+    }
+    return ERR_OK;
+}
+
+err_t tcp_close(struct tcp_pcb *pcb)
+{
+    switch (pcb->state) {
+        case ESTABLISHED:
+        case SYN_RCVD:
+            pcb->state = FIN_WAIT_1;
+            break;
+        case CLOSE_WAIT:
+            pcb->state = LAST_ACK;
+            break;
+        case FIN_WAIT_1:
+        case FIN_WAIT_2:
+        case CLOSING:
+        case LAST_ACK:
+        case TIME_WAIT:
+            return ERR_OK;
+        default:
+            // Listening or not connected yet
+            if (tcpPcb(pcb->peer)) {
+                sendReset(pcb->peer, pcb->id);
+            }
+            freeTcpPcb(pcb);
+            return ERR_OK;
+    }
+
+    if (!tcpPcb(pcb->peer)) {
+        freeTcpPcb(pcb);
+        return ERR_OK;
+    }
+
+    // The FIN goes after anything still unsent
+    appendSeg(&pcb->unsent, newSeg(pcb->snd_lbb, TF_SEG_FIN));
+    pcb->snd_lbb++;
+    pcb->unsent_oversize = 0;
+    tcp_output(pcb);
+    return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb *pcb)
+{
+    if (!alive(pcb)) {
+        return;
+    }
+    if (tcpPcb(pcb->peer)) {
+        sendReset(pcb->peer, pcb->id);
+    }
+
+    tcp_err_fn errf = pcb->errf;
+    void* arg = pcb->callback_arg;
+    freeTcpPcb(pcb);
+    if (errf) {
+        errf(arg, ERR_ABRT);
+    }
+}
+
+//
+// UDP
+//
+
+struct udp_pcb *udp_new(void)
+{
+    udp_pcb* pcb = static_cast<udp_pcb*>(calloc(1, sizeof(udp_pcb)));
+    pcb->id = ++_loopback.nextId;
+    _loopback.udpPcbs[pcb->id] = pcb;
+    return pcb;
+}
+
+void udp_remove(struct udp_pcb *pcb)
+{
+    if (pcb && _loopback.udpPcbs.erase(pcb->id)) {
+        free(pcb);
+    }
+}
+
+// Any number of pcbs can share a port, like SO_REUSEADDR, so a client and
+// a responder can both be on 5353
+err_t udp_bind(struct udp_pcb *pcb, ip_addr_t *ipaddr, u16_t port)
+{
+    pcb->local_ip = ipaddr ? *ipaddr : ip_addr_any;
+    pcb->local_port = port ? port : ephemeralPort();
+    return ERR_OK;
+}
+
+err_t udp_connect(struct udp_pcb *pcb, ip_addr_t *ipaddr, u16_t port)
+{
+    if (!pcb->local_port) {
+        pcb->local_port = ephemeralPort();
+    }
+    pcb->remote_ip = *ipaddr;
+    pcb->remote_port = port;
+    return ERR_OK;
+}
+
+void udp_disconnect(struct udp_pcb *pcb)
+{
+    pcb->remote_ip = ip_addr_any;
+    pcb->remote_port = 0;
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg)
+{
+    pcb->recv = recv;
+    pcb->recv_arg = recv_arg;
+}
+
+// Every other pcb bound to the port gets a copy, whatever the address
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *dst_ip, u16_t dst_port)
+{
+    if (!pcb->local_port) {
+        pcb->local_port = ephemeralPort();
+    }
+
+    std::vector<char> bytes(p->tot_len);
+    pbuf_copy_partial(p, bytes.data(), p->tot_len, 0);
+
+    for (auto& it : _loopback.udpPcbs) {
+        if (it.second == pcb || it.second->local_port != dst_port) {
+            continue;
+        }
+        if (lose()) {
+            _loopback.stats.datagramsLost++;
+            continue;
+        }
+
+        Packet packet(Packet::Type::Datagram);
+        packet.to = it.second->id;
+        packet.from = pcb->id;
+        packet.port = pcb->local_port;
+        packet.srcIP = ip_addr_isany(&pcb->local_ip) ? localhost() : pcb->local_ip;
+        packet.bytes = bytes;
+        send(std::move(packet));
+    }
+    return ERR_OK;
+}
+
+err_t udp_send(struct udp_pcb *pcb, struct pbuf *p)
+{
+    return udp_sendto(pcb, p, &pcb->remote_ip, pcb->remote_port);
+}
+
+//
+// IGMP, only counts memberships
+//
+
+err_t igmp_joingroup(ip_addr_t *ifaddr, ip_addr_t *groupaddr)
+{
+    if (!ip_addr_ismulticast(groupaddr)) {
+        return ERR_VAL;
+    }
+    _loopback.groups[groupaddr->addr]++;
+    return ERR_OK;
+}
+
+err_t igmp_leavegroup(ip_addr_t *ifaddr, ip_addr_t *groupaddr)
+{
+    auto it = _loopback.groups.find(groupaddr->addr);
+    if (it == _loopback.groups.end()) {
+        return ERR_VAL;
+    }
+    if (--it->second == 0) {
+        _loopback.groups.erase(it);
+    }
+    return ERR_OK;
+}
+
+//
+// ETS timers
+//
+
+void ets_timer_setfn(ETSTimer *t, ETSTimerFunc *fn, void *parg)
+{
+    t->timer_func = fn;
+    t->timer_arg = parg;
+}
+
+void ets_timer_arm_new(ETSTimer *t, int time, int repeat, int isMstimer)
+{
+    ets_timer_disarm(t);
+    uint64_t us = isMstimer ? uint64_t(time) * 1000 : uint64_t(time);
+    t->timer_period = repeat ? time : 0;
+    _loopback.timers.push_back({ t, now() + us, repeat ? us : 0 });
+}
+
+void ets_timer_disarm(ETSTimer *t)
+{
+    for (auto it = _loopback.timers.begin(); it != _loopback.timers.end(); ++it) {
+        if (it->timer == t) {
+            _loopback.timers.erase(it);
+            return;
+        }
+    }
+}
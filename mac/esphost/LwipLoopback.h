@@ -0,0 +1,100 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/opt.h"
+
+#include <cstdint>
+
+namespace m8r {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LwipLoopback
+//
+//  In-process network behind the lwIP headers in this directory, so the
+//  real EspTCP, EspUDP and MDNSResponder can run on the host. Every pcb
+//  is on the same host. A tcp_connect reaches whatever is listening on its
+//  port, and a datagram reaches every other udp pcb bound to its port.
+//
+//  Like lwIP, everything happens on one thread, and callbacks only come
+//  from poll(). Each call delivers the packets that are due, resends
+//  segments whose acknowledgment is overdue and fires the ets timers.
+//  Segments honor the receiver's window, tcp_sndbuf and Nagle. A lost
+//  segment is resent after retransmitUs, go back N, and the receiver
+//  holds the segments after it until the gap is filled.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LwipLoopback
+{
+public:
+    struct Config
+    {
+        // Fraction, 0 to 1, of TCP segments and UDP datagrams dropped
+        double loss = 0;
+
+        // One way, for every packet
+        uint32_t latencyUs = 0;
+        uint32_t retransmitUs = 100000;
+
+        // For pcbs made after this is set. A small sendBuffer is a small
+        // tcp_sndbuf, a small receiveWindow a slow reader
+        uint16_t sendBuffer = TCP_SND_BUF;
+        uint16_t receiveWindow = TCP_WND;
+        uint16_t mss = TCP_MSS;
+
+        // Received TCP data is split into pbufs of at most this many bytes,
+        // 0 for a pbuf per segment. Up to chainSegments segments that
+        // arrive together are handed over as one chain
+        uint16_t pbufSize = 0;
+        uint16_t chainSegments = 1;
+
+        uint32_t seed = 1;
+    };
+
+    struct Stats
+    {
+        uint32_t connections = 0;
+        uint32_t refused = 0;
+        uint32_t resets = 0;
+
+        // Put on the wire, resends included
+        uint32_t segments = 0;
+        uint32_t retransmits = 0;
+        uint32_t lost = 0;
+
+        // TCP payload given to recv callbacks and the calls made with
+        // more than one pbuf
+        uint64_t bytes = 0;
+        uint32_t chains = 0;
+
+        uint32_t datagrams = 0;
+        uint32_t datagramsLost = 0;
+        uint32_t timers = 0;
+    };
+
+    static void setConfig(const Config&);
+    static const Config& config();
+
+    static const Stats& stats();
+    static void resetStats();
+
+    // Returns false if there was nothing to do, no packets in flight and no
+    // segments waiting to be resent
+    static bool poll();
+
+    // Still allocated, for finding leaks
+    static uint32_t pbufsInUse();
+    static uint32_t tcpPcbsInUse();
+    static uint32_t udpPcbsInUse();
+};
+
+}
@@ -0,0 +1,26 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Host stand-in for the lwIP 1.4 raw API the ESP8266 SDK ships, enough of
+// it for esp/core to build and run on the host. See LwipLoopback.h
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t u8_t;
+typedef int8_t s8_t;
+typedef uint16_t u16_t;
+typedef int16_t s16_t;
+typedef uint32_t u32_t;
+typedef int32_t s32_t;
+typedef uintptr_t mem_ptr_t;
+
+#define LWIP_UNUSED_ARG(x) (void)(x)
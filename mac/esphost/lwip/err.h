@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/arch.h"
+
+typedef s8_t err_t;
+
+#define ERR_OK          0
+#define ERR_MEM        -1
+#define ERR_BUF        -2
+#define ERR_TIMEOUT    -3
+#define ERR_RTE        -4
+#define ERR_INPROGRESS -5
+#define ERR_VAL        -6
+#define ERR_WOULDBLOCK -7
+#define ERR_ABRT       -8
+#define ERR_RST        -9
+#define ERR_CLSD       -10
+#define ERR_CONN       -11
+#define ERR_ARG        -12
+#define ERR_USE        -13
+#define ERR_IF         -14
+#define ERR_ISCONN     -15
@@ -0,0 +1,17 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/opt.h"
+#include "lwip/err.h"
+
+#define LWIP_VERSION_MAJOR 1
+#define LWIP_VERSION_MINOR 4
+#define LWIP_VERSION_REVISION 0
@@ -0,0 +1,44 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/arch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// In network order, like lwIP
+struct ip_addr {
+    u32_t addr;
+};
+typedef struct ip_addr ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+extern const ip_addr_t ip_addr_broadcast;
+
+#define IP_ADDR_ANY ((ip_addr_t*) &ip_addr_any)
+#define IP_ADDR_BROADCAST ((ip_addr_t*) &ip_addr_broadcast)
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+    (ipaddr)->addr = ((u32_t) ((d) & 0xff) << 24) | ((u32_t) ((c) & 0xff) << 16) | \
+                     ((u32_t) ((b) & 0xff) << 8) | (u32_t) ((a) & 0xff)
+
+#define ip4_addr1(ipaddr) ((u8_t) ((ipaddr)->addr))
+#define ip4_addr2(ipaddr) ((u8_t) ((ipaddr)->addr >> 8))
+#define ip4_addr3(ipaddr) ((u8_t) ((ipaddr)->addr >> 16))
+#define ip4_addr4(ipaddr) ((u8_t) ((ipaddr)->addr >> 24))
+
+#define ip_addr_isany(ipaddr) ((ipaddr) == NULL || (ipaddr)->addr == 0)
+#define ip_addr_ismulticast(ipaddr) (((ipaddr)->addr & 0xf0) == 0xe0)
+
+#ifdef __cplusplus
+}
+#endif
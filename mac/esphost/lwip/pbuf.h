@@ -0,0 +1,56 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PBUF_TRANSPORT,
+    PBUF_IP,
+    PBUF_LINK,
+    PBUF_RAW
+} pbuf_layer;
+
+typedef enum {
+    PBUF_RAM,
+    PBUF_ROM,
+    PBUF_REF,
+    PBUF_POOL
+} pbuf_type;
+
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+    u8_t type;
+    u8_t flags;
+    u16_t ref;
+};
+
+// PBUF_RAM is one block, PBUF_POOL a chain of PBUF_POOL_BUFSIZE blocks and
+// PBUF_ROM and PBUF_REF have no storage, set payload to the data
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_header(struct pbuf *p, s16_t header_size);
+void pbuf_ref(struct pbuf *p);
+u8_t pbuf_free(struct pbuf *p);
+u8_t pbuf_clen(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+void pbuf_chain(struct pbuf *head, struct pbuf *tail);
+u16_t pbuf_copy_partial(struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+err_t pbuf_take(struct pbuf *buf, const void *dataptr, u16_t len);
+
+#ifdef __cplusplus
+}
+#endif
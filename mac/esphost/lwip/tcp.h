@@ -0,0 +1,138 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/opt.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "lwip/err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tcp_pcb;
+struct tcp_seg;
+
+typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *newpcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+typedef err_t (*tcp_sent_fn)(void *arg, struct tcp_pcb *tpcb, u16_t len);
+typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
+
+enum tcp_state {
+    CLOSED = 0,
+    LISTEN = 1,
+    SYN_SENT = 2,
+    SYN_RCVD = 3,
+    ESTABLISHED = 4,
+    FIN_WAIT_1 = 5,
+    FIN_WAIT_2 = 6,
+    CLOSE_WAIT = 7,
+    CLOSING = 8,
+    LAST_ACK = 9,
+    TIME_WAIT = 10
+};
+
+#define TF_ACK_DELAY   ((u8_t) 0x01U)
+#define TF_ACK_NOW     ((u8_t) 0x02U)
+#define TF_INFR        ((u8_t) 0x04U)
+#define TF_TIMESTAMP   ((u8_t) 0x08U)
+#define TF_RXCLOSED    ((u8_t) 0x10U)
+#define TF_FIN         ((u8_t) 0x20U)
+#define TF_NODELAY     ((u8_t) 0x40U)
+#define TF_NAGLEMEMERR ((u8_t) 0x80U)
+
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+
+#define TCP_PRIO_MIN    1
+#define TCP_PRIO_NORMAL 64
+#define TCP_PRIO_MAX    127
+
+struct tcp_pcb {
+    ip_addr_t local_ip;
+    ip_addr_t remote_ip;
+    u16_t local_port;
+    u16_t remote_port;
+    
+    enum tcp_state state;
+    u8_t prio;
+    u8_t flags;
+    void *callback_arg;
+    
+    tcp_accept_fn accept;
+    tcp_recv_fn recv;
+    tcp_sent_fn sent;
+    tcp_connected_fn connected;
+    tcp_poll_fn poll;
+    tcp_err_fn errf;
+    u8_t pollinterval;
+    u8_t polltmr;
+    
+    u16_t mss;
+    
+    // Receiver
+    u32_t rcv_nxt;
+    u16_t rcv_wnd;
+    u16_t rcv_ann_wnd;
+    struct tcp_seg *ooseq;
+    struct pbuf *refused_data;
+    
+    // Sender. snd_lbb is the sequence number of the next byte written
+    u32_t lastack;
+    u32_t snd_nxt;
+    u32_t snd_lbb;
+    u16_t snd_wnd;
+    u16_t snd_buf;
+    u16_t snd_queuelen;
+    u16_t unsent_oversize;
+    struct tcp_seg *unsent;
+    struct tcp_seg *unacked;
+    
+    // Loopback only. The other end of the connection and when the oldest
+    // unacknowledged segment is resent, in us
+    u32_t id;
+    u32_t peer;
+    uint64_t rtime;
+};
+
+struct tcp_pcb *tcp_new(void);
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv);
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent);
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio);
+
+err_t tcp_bind(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port);
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb);
+err_t tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port, tcp_connected_fn connected);
+
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags);
+err_t tcp_output(struct tcp_pcb *pcb);
+err_t tcp_close(struct tcp_pcb *pcb);
+void tcp_abort(struct tcp_pcb *pcb);
+
+#define tcp_listen_with_backlog(pcb, backlog) tcp_listen(pcb)
+#define tcp_accepted(pcb) LWIP_UNUSED_ARG(pcb)
+#define tcp_mss(pcb) ((pcb)->mss)
+#define tcp_sndbuf(pcb) ((pcb)->snd_buf)
+#define tcp_sndqueuelen(pcb) ((pcb)->snd_queuelen)
+#define tcp_nagle_disable(pcb) ((pcb)->flags |= TF_NODELAY)
+#define tcp_nagle_enable(pcb) ((pcb)->flags &= ~TF_NODELAY)
+#define tcp_nagle_disabled(pcb) (((pcb)->flags & TF_NODELAY) != 0)
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,38 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/tcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TF_SEG_FIN    ((u8_t) 0x01U)
+#define TF_SEG_REXMIT ((u8_t) 0x02U)
+
+// lwIP keeps the sequence number in the TCP header of the segment, the
+// loopback has no headers so it is here
+struct tcp_seg {
+    struct tcp_seg *next;
+    struct pbuf *p;
+    u16_t len;
+    u8_t flags;
+    u32_t seqno;
+};
+
+#define TCP_SEQ_LT(a, b) ((s32_t) ((u32_t) (a) - (u32_t) (b)) < 0)
+#define TCP_SEQ_LEQ(a, b) ((s32_t) ((u32_t) (a) - (u32_t) (b)) <= 0)
+#define TCP_SEQ_GT(a, b) ((s32_t) ((u32_t) (a) - (u32_t) (b)) > 0)
+#define TCP_SEQ_GEQ(a, b) ((s32_t) ((u32_t) (a) - (u32_t) (b)) >= 0)
+
+#ifdef __cplusplus
+}
+#endif
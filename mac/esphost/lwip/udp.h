@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "lwip/err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct udp_pcb;
+
+// The callback owns p and must free it
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t port);
+
+struct udp_pcb {
+    ip_addr_t local_ip;
+    ip_addr_t remote_ip;
+    u16_t local_port;
+    u16_t remote_port;
+    
+    udp_recv_fn recv;
+    void *recv_arg;
+    
+    // Loopback only
+    u32_t id;
+};
+
+struct udp_pcb *udp_new(void);
+void udp_remove(struct udp_pcb *pcb);
+err_t udp_bind(struct udp_pcb *pcb, ip_addr_t *ipaddr, u16_t port);
+err_t udp_connect(struct udp_pcb *pcb, ip_addr_t *ipaddr, u16_t port);
+void udp_disconnect(struct udp_pcb *pcb);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *dst_ip, u16_t dst_port);
+err_t udp_send(struct udp_pcb *pcb, struct pbuf *p);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,17 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "ets_sys.h"
+
+#define os_timer_arm(t, ms, repeat) ets_timer_arm_new(t, ms, repeat, 1)
+#define os_timer_arm_us(t, us, repeat) ets_timer_arm_new(t, us, repeat, 0)
+#define os_timer_disarm ets_timer_disarm
+#define os_timer_setfn ets_timer_setfn
@@ -0,0 +1,21 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Host stand-in for the ESP8266 SDK's spi_flash.h. The flashmem_*
+// functions built on it are in FlashEmulator.cpp
+
+#pragma once
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+    SPI_FLASH_RESULT_OK,
+    SPI_FLASH_RESULT_ERR,
+    SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
@@ -0,0 +1,459 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Benchmarks the file system flash HAL, FlashCache over flashmem_*, on the
+// host. Flash is the emulator in mac/esphost, so the times reported are
+// what the chip would take, and erases are counted per sector for wear.
+// The tests are the access patterns the file systems make:
+//
+//     append   -b bytes written as a log in -w byte writes, erasing each
+//              sector ahead of it and marking each finished 256 byte page
+//              in a header at the start of its sector, then read back
+//     update   a -w byte record rewritten -n times, each copy going to the
+//              next slot of a ring of -s sectors and clearing a flag in
+//              the one before it. Slots are padded to -prog bytes, the
+//              way LittleFS pads each commit to its prog_size
+//     read     -n reads of -w bytes from random places in -b bytes
+//     bulk     -b bytes erased in one call, then written and read back in
+//              sector sized pieces from and to a misaligned buffer, like
+//              an OTA image or a big file
+//
+//     m8rlua-flashbench [-n count] [-b bytes] [-w bytes] [-s sectors]
+//                       [-prog bytes] [-image file] [-direct] [-json file]
+//                       [test...]
+//
+// -direct goes straight to flashmem_*, without FlashCache. The image is
+// erased before the tests run and kept afterwards.
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "FlashCache.h"
+#include "FlashEmulator.h"
+#include "MacSystemInterface.h"
+#include "SystemInterface.h"
+#include "flashmem.h"
+
+static constexpr uint32_t SectorSize = INTERNAL_FLASH_SECTOR_SIZE;
+static constexpr uint32_t PageSize = 256;
+
+// Byte n of the data written at flash offset a is (a + n) % PatternPeriod,
+// so a read can be checked wherever it starts
+static constexpr uint32_t PatternPeriod = 251;
+static uint8_t _pattern[PatternPeriod + 0x10000];
+
+struct Options
+{
+    uint32_t count = 1000;
+    uint32_t bytes = 256 * 1024;
+    uint16_t writeSize = 64;
+    uint32_t sectors = 16;
+    uint16_t progSize = INTERNAL_FLASH_WRITE_UNIT_SIZE;
+    bool direct = false;
+};
+
+struct Result
+{
+    Result(const char* n) : name(n) { }
+
+    const char* name;
+    bool success = true;
+    uint32_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t elapsedUs = 0;
+
+    m8r::FlashEmulator::Stats flash;
+    m8r::FlashEmulator::Wear wear;
+    m8r::FlashCache::Stats cache;
+
+    double perSecond() const { return flash.simulatedUs ? double(count) * 1000000 / flash.simulatedUs : 0; }
+    double kbPerSecond() const { return flash.simulatedUs ? double(bytes) * 1000000 / 1024 / flash.simulatedUs : 0; }
+};
+
+static bool _direct = false;
+
+static bool flashRead(uint32_t addr, void* dst, uint32_t size)
+{
+    return _direct ? flashmem_read(dst, addr, size) == size : m8r::FlashCache::read(addr, dst, size);
+}
+
+static bool flashWrite(uint32_t addr, const void* src, uint32_t size)
+{
+    return _direct ? flashmem_write(src, addr, size) == size : m8r::FlashCache::write(addr, src, size);
+}
+
+static bool flashErase(uint32_t sector)
+{
+    return _direct ? flashmem_erase_sector(sector) : m8r::FlashCache::eraseSector(sector);
+}
+
+static bool flashErase(uint32_t addr, uint32_t size)
+{
+    return _direct ? flashmem_erase(addr, size) : m8r::FlashCache::erase(addr, size);
+}
+
+// What the flash sync timer does when it fires
+static void idle()
+{
+    if (!_direct) {
+        m8r::FlashCache::syncDue();
+    }
+}
+
+static bool sync()
+{
+    return _direct || m8r::FlashCache::sync();
+}
+
+// The file systems write from their own word aligned buffers, so does this
+static bool writePattern(uint32_t addr, uint32_t offset, uint32_t size)
+{
+    static uint32_t buffer[SectorSize / sizeof(uint32_t)];
+    memcpy(buffer, _pattern + offset % PatternPeriod, size);
+    return flashWrite(addr, buffer, size);
+}
+
+static bool check(uint32_t addr, const uint8_t* data, uint32_t size)
+{
+    return memcmp(data, _pattern + addr % PatternPeriod, size) == 0;
+}
+
+static void start(Result& result)
+{
+    m8r::FlashEmulator::resetStats();
+    m8r::FlashCache::resetStats();
+    result.elapsedUs = m8r::SystemInterface::currentMicroseconds();
+}
+
+static void finish(Result& result)
+{
+    result.success = sync() && result.success;
+    result.elapsedUs = m8r::SystemInterface::currentMicroseconds() - result.elapsedUs;
+    result.flash = m8r::FlashEmulator::stats();
+    result.wear = m8r::FlashEmulator::wear();
+    result.cache = m8r::FlashCache::stats();
+    if (result.flash.failures || result.flash.conflicts) {
+        result.success = false;
+    }
+}
+
+//
+// append
+//
+
+static Result testAppend(const Options& options)
+{
+    Result result("append");
+    uint32_t base = m8r::FlashEmulator::config().start;
+    uint32_t size = std::min(options.bytes, m8r::FlashEmulator::config().end - base);
+    uint32_t pagesPerSector = SectorSize / PageSize;
+
+    // The first page of each sector is its header, a byte per page that is
+    // cleared when the page is full
+    start(result);
+    uint32_t length = 0;
+    while (length < size && result.success) {
+        uint32_t addr = base + length;
+        uint32_t offset = addr % SectorSize;
+        if (offset == 0) {
+            result.success = flashErase(addr / SectorSize);
+            length += PageSize;
+            continue;
+        }
+
+        uint32_t chunk = std::min(uint32_t(options.writeSize), size - length);
+        chunk = std::min(chunk, PageSize - offset % PageSize);
+        result.success = result.success && writePattern(addr, addr, chunk);
+        result.count++;
+        result.bytes += chunk;
+        length += chunk;
+
+        if ((offset + chunk) % PageSize == 0) {
+            uint8_t done = 0;
+            uint32_t page = offset / PageSize;
+            result.success = result.success && page < pagesPerSector && flashWrite(addr - offset + page, &done, 1);
+        }
+        idle();
+    }
+    result.success = sync() && result.success;
+
+    std::vector<uint8_t> buffer(options.writeSize);
+    for (length = 0; length < size && result.success; ) {
+        uint32_t addr = base + length;
+        if (addr % SectorSize < PageSize) {
+            length += PageSize;
+            continue;
+        }
+        uint32_t chunk = std::min(uint32_t(options.writeSize), size - length);
+        chunk = std::min(chunk, PageSize - addr % PageSize);
+        length += chunk;
+        result.success = flashRead(addr, buffer.data(), chunk) && check(addr, buffer.data(), chunk);
+        idle();
+    }
+    finish(result);
+    return result;
+}
+
+//
+// update
+//
+
+static Result testUpdate(const Options& options)
+{
+    Result result("update");
+    uint32_t base = m8r::FlashEmulator::config().start;
+
+    // A slot is a flag word then the record, padded to the prog size.
+    // The padding is programmed too
+    uint32_t slotSize = (sizeof(uint32_t) + options.writeSize + options.progSize - 1) / options.progSize * options.progSize;
+    uint32_t recordSize = slotSize - sizeof(uint32_t);
+    uint32_t slotsPerSector = SectorSize / slotSize;
+    uint32_t slots = slotsPerSector * options.sectors;
+
+    start(result);
+    std::vector<uint8_t> buffer(options.writeSize);
+    uint32_t slot = 0;
+    for (uint32_t i = 0; i < options.count && result.success; ++i, slot = (slot + 1) % slots) {
+        uint32_t sector = slot / slotsPerSector;
+        uint32_t addr = base + sector * SectorSize + (slot % slotsPerSector) * slotSize;
+        if (slot % slotsPerSector == 0) {
+            result.success = flashErase(base / SectorSize + sector);
+        }
+
+        // Each copy has different contents
+        uint32_t data = addr + sizeof(uint32_t);
+        result.success = result.success && writePattern(data, data + i, recordSize);
+        if (i) {
+            uint32_t previous = (slot + slots - 1) % slots;
+            uint32_t previousAddr = base + (previous / slotsPerSector) * SectorSize + (previous % slotsPerSector) * slotSize;
+            uint32_t stale = 0;
+            result.success = result.success && flashWrite(previousAddr, &stale, sizeof(stale));
+        }
+        result.success = result.success && flashRead(data, buffer.data(), options.writeSize)
+                                        && memcmp(buffer.data(), _pattern + (data + i) % PatternPeriod, options.writeSize) == 0;
+        result.count++;
+        result.bytes += options.writeSize;
+        idle();
+    }
+    finish(result);
+    return result;
+}
+
+//
+// read
+//
+
+static Result testRead(const Options& options)
+{
+    Result result("read");
+    uint32_t base = m8r::FlashEmulator::config().start;
+    uint32_t size = std::min(options.bytes, m8r::FlashEmulator::config().end - base);
+    size = std::max(size - size % SectorSize, SectorSize);
+
+    // Straight to flash, so the cache starts out empty
+    for (uint32_t addr = base; addr < base + size && result.success; addr += SectorSize) {
+        bool wasDirect = _direct;
+        _direct = true;
+        result.success = flashErase(addr / SectorSize) && writePattern(addr, addr, SectorSize);
+        _direct = wasDirect;
+    }
+
+    std::mt19937 random(1);
+    std::vector<uint8_t> buffer(options.writeSize);
+    uint16_t length = std::min(uint32_t(options.writeSize), size);
+    start(result);
+    for (uint32_t i = 0; i < options.count && result.success; ++i) {
+        uint32_t addr = base + random() % (size - length + 1);
+        result.success = flashRead(addr, buffer.data(), length) && check(addr, buffer.data(), length);
+        result.count++;
+        result.bytes += length;
+        idle();
+    }
+    finish(result);
+    return result;
+}
+
+//
+// bulk
+//
+
+static Result testBulk(const Options& options)
+{
+    Result result("bulk");
+    uint32_t base = m8r::FlashEmulator::config().start;
+    uint32_t size = std::min(options.bytes, m8r::FlashEmulator::config().end - base);
+
+    // One byte past the start of a word
+    std::vector<uint32_t> buffer(SectorSize / sizeof(uint32_t) + 1);
+    uint8_t* data = reinterpret_cast<uint8_t*>(buffer.data()) + 1;
+
+    start(result);
+    result.success = flashErase(base, size);
+    for (uint32_t length = 0; length < size && result.success; length += SectorSize) {
+        uint32_t chunk = std::min(SectorSize, size - length);
+        memcpy(data, _pattern + (base + length) % PatternPeriod, chunk);
+        result.success = flashWrite(base + length, data, chunk);
+        result.count++;
+        result.bytes += chunk;
+        idle();
+    }
+    result.success = sync() && result.success;
+
+    for (uint32_t length = 0; length < size && result.success; length += SectorSize) {
+        uint32_t chunk = std::min(SectorSize, size - length);
+        memset(data, 0, chunk);
+        result.success = flashRead(base + length, data, chunk) && check(base + length, data, chunk);
+        result.count++;
+        result.bytes += chunk;
+        idle();
+    }
+    finish(result);
+    return result;
+}
+
+static void printResult(const Result& r)
+{
+    printf("%-8s %s %8u done in %8.3f s simulated, %10.1f/s, %8.1f KB/s (%.3f s on the host)\n", r.name,
+           r.success ? "    " : "FAIL", r.count, double(r.flash.simulatedUs) / 1000000, r.perSecond(), r.kbPerSecond(),
+           double(r.elapsedUs) / 1000000);
+    printf("         flash: %u reads, %llu bytes, %u program commands, %llu bytes, %u sector and %u block erases, "
+           "%u conflicts, %u failures\n", r.flash.reads, (unsigned long long) r.flash.bytesRead, r.flash.programCommands,
+           (unsigned long long) r.flash.bytesProgrammed, r.flash.erases, r.flash.blockErases, r.flash.conflicts,
+           r.flash.failures);
+    printf("         wear: %u to %u erases per sector, %.3f mean\n", r.wear.min, r.wear.max, r.wear.mean);
+    if (r.cache.hits || r.cache.misses) {
+        printf("         FlashCache: %u hits, %u misses, %u write backs, %u bytes\n",
+               r.cache.hits, r.cache.misses, r.cache.writeBacks, r.cache.bytesProgrammed);
+    }
+}
+
+static bool writeJSON(const char* filename, const Options& options, const std::vector<Result>& results)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Unable to open '%s' for results\n", filename);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"direct\": %s,\n  \"cacheSectors\": %u,\n  \"writeSize\": %u,\n  \"progSize\": %u,\n  \"tests\": [",
+            options.direct ? "true" : "false", FLASH_CACHE_SECTORS, options.writeSize, options.progSize);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"success\": %s, \"count\": %u, \"bytes\": %llu, \"simulatedUs\": %llu, "
+                      "\"perSecond\": %.1f, \"kbPerSecond\": %.1f, \"reads\": %u, \"programCommands\": %u, "
+                      "\"bytesProgrammed\": %llu, \"erases\": %u, \"blockErases\": %u, \"maxWear\": %u, \"meanWear\": %.3f }",
+                i ? "," : "", r.name, r.success ? "true" : "false", r.count, (unsigned long long) r.bytes,
+                (unsigned long long) r.flash.simulatedUs, r.perSecond(), r.kbPerSecond(), r.flash.reads,
+                r.flash.programCommands, (unsigned long long) r.flash.bytesProgrammed, r.flash.erases,
+                r.flash.blockErases, r.wear.max, r.wear.mean);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: m8rlua-flashbench [-n count] [-b bytes] [-w bytes] [-s sectors]\n"
+                    "                         [-prog bytes] [-image file] [-direct] [-json file]\n"
+                    "                         [append] [update] [read] [bulk]\n");
+}
+
+int main(int argc, char * argv[])
+{
+    Options options;
+    const char* imageFile = "flash.img";
+    const char* jsonFile = nullptr;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-'; i += 2) {
+        const char* option = argv[i];
+        if (strcmp(option, "-direct") == 0) {
+            options.direct = true;
+            i--;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        const char* value = argv[i + 1];
+        if (strcmp(option, "-n") == 0) {
+            options.count = std::max(1, atoi(value));
+        } else if (strcmp(option, "-b") == 0) {
+            options.bytes = std::max(1, atoi(value));
+        } else if (strcmp(option, "-w") == 0) {
+            options.writeSize = uint16_t(std::min(std::max(1, atoi(value)), int(SectorSize) / 2));
+        } else if (strcmp(option, "-s") == 0) {
+            options.sectors = std::max(1, atoi(value));
+        } else if (strcmp(option, "-prog") == 0) {
+            int progSize = atoi(value);
+            if (progSize < int(INTERNAL_FLASH_WRITE_UNIT_SIZE) || progSize > int(PageSize) || (progSize & (progSize - 1))) {
+                usage();
+                return 1;
+            }
+            options.progSize = uint16_t(progSize);
+        } else if (strcmp(option, "-image") == 0) {
+            imageFile = value;
+        } else if (strcmp(option, "-json") == 0) {
+            jsonFile = value;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
+    for (uint32_t n = 0; n < sizeof(_pattern); ++n) {
+        _pattern[n] = uint8_t(n % PatternPeriod);
+    }
+    if (!m8r::FlashEmulator::open(imageFile, true)) {
+        return 1;
+    }
+    _direct = options.direct;
+
+    std::vector<const char*> tests;
+    for ( ; i < argc; ++i) {
+        tests.push_back(argv[i]);
+    }
+    if (tests.empty()) {
+        tests = { "append", "update", "read", "bulk" };
+    }
+
+    printf("%s, %u byte writes, %u byte prog size\n", options.direct ? "straight to flash" : "through FlashCache",
+           options.writeSize, options.progSize);
+
+    std::vector<Result> results;
+    for (auto it : tests) {
+        if (strcmp(it, "append") == 0) {
+            results.push_back(testAppend(options));
+        } else if (strcmp(it, "update") == 0) {
+            results.push_back(testUpdate(options));
+        } else if (strcmp(it, "read") == 0) {
+            results.push_back(testRead(options));
+        } else if (strcmp(it, "bulk") == 0) {
+            results.push_back(testBulk(options));
+        } else {
+            usage();
+            return 1;
+        }
+        printResult(results.back());
+    }
+    m8r::FlashEmulator::close();
+
+    bool success = std::all_of(results.begin(), results.end(), [](const Result& r) { return r.success; });
+    if (jsonFile && !writeJSON(jsonFile, options, results)) {
+        success = false;
+    }
+    return success ? 0 : 1;
+}
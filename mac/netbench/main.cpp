@@ -0,0 +1,829 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Load tests the device networking code, EspTCP, EspUDP and MDNSResponder,
+// on the host. lwIP is the in-process loopback in mac/esphost, so it can
+// be made lossy, slow or short of buffers. The tests are:
+//
+//     connect     -n connections that each send a line, get it echoed and
+//                 are hung up on, as many at a time as the server takes
+//     throughput  the server sends -b bytes on each of -c connections, in
+//                 -w byte writes, checking every byte on arrival
+//     udp         -n datagrams of -w bytes from an EspUDP
+//     batch       -n small records and counts through a UDPBatcher
+//     mdns        -n service queries to an MDNSResponder, one at a time,
+//                 with its rate limit and response delay off
+//     mdnsstorm   -n queries 1ms apart, half listing the reply as a known
+//                 answer, to see how much the responder holds back
+//
+//     m8rlua-netbench [-n count] [-c connections] [-b bytes] [-w bytes]
+//                     [-sndbuf bytes] [-wnd bytes] [-loss percent] [-latency us]
+//                     [-pbuf bytes] [-chain segments] [-json file] [test...]
+//
+// The network options set LwipLoopback::Config. -pbuf and -chain hand
+// received data over as chains of small pbufs. Latency is from the send
+// to the receiver having all of it. -json writes the results so they can
+// be compared from commit to commit.
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "EspTCP.h"
+#include "EspUDP.h"
+#include "LwipLoopback.h"
+#include "MDNSResponder.h"
+#include "MacSystemInterface.h"
+#include "SystemInterface.h"
+#include "UDPBatcher.h"
+
+#include <lwip/tcp.h>
+#include <lwip/udp.h>
+
+static constexpr uint16_t TCPPort = 8023;
+static constexpr uint16_t UDPPort = 8024;
+static constexpr uint16_t MDNSPort = 5353;
+
+// A test that hasn't finished in this long has failed
+static constexpr uint64_t TimeoutUs = 60000000;
+
+// Byte n of every stream is n % PatternPeriod, so the receiver can check
+// it wherever a pbuf starts
+static constexpr uint32_t PatternPeriod = 251;
+static char _pattern[PatternPeriod + 0x10000];
+
+struct Options
+{
+    uint32_t count = 1000;
+    uint32_t connections = 1;
+    uint32_t bytes = 4 * 1024 * 1024;
+    uint16_t writeSize = 512;
+};
+
+struct Result
+{
+    Result(const char* n) : name(n) { }
+
+    const char* name;
+    bool success = true;
+
+    // Connections, writes, datagrams or queries finished and failed
+    uint32_t count = 0;
+    uint32_t failed = 0;
+    uint64_t bytes = 0;
+    uint64_t elapsedUs = 0;
+    std::vector<uint64_t> latencies;
+
+    m8r::LwipLoopback::Stats lwip;
+    m8r::EspTCP::SendStats sendStats;
+    uint32_t droppedBytes = 0;
+
+    double perSecond() const { return elapsedUs ? double(count) * 1000000 / elapsedUs : 0; }
+    double mbPerSecond() const { return elapsedUs ? double(bytes) / elapsedUs : 0; }
+
+    uint64_t percentile(uint32_t p) const
+    {
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+    }
+};
+
+static uint64_t now()
+{
+    return m8r::SystemInterface::currentMicroseconds();
+}
+
+static ip_addr_t localhost()
+{
+    ip_addr_t addr;
+    IP4_ADDR(&addr, 127, 0, 0, 1);
+    return addr;
+}
+
+// Turn the network and do what the task manager does at the end of each
+// iteration until done() returns true
+static bool run(const std::function<bool()>& done)
+{
+    uint64_t start = now();
+    while (!done()) {
+        m8r::LwipLoopback::poll();
+        m8r::EspTCP::flushAll();
+        m8r::UDPBatcher::flushDue();
+        if (now() - start > TimeoutUs) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Let closes and resends finish
+static void settle()
+{
+    run([]() { return !m8r::LwipLoopback::poll(); });
+}
+
+static void finish(Result& result, uint64_t start)
+{
+    result.elapsedUs = now() - start;
+    result.lwip = m8r::LwipLoopback::stats();
+    std::sort(result.latencies.begin(), result.latencies.end());
+}
+
+//
+// connect
+//
+
+class EchoServer : public m8r::TCPDelegate
+{
+public:
+    virtual void TCPevent(m8r::TCP* tcp, Event event, int16_t connectionId, const char* data, int16_t length) override
+    {
+        if (event == Event::ReceivedData) {
+            tcp->send(connectionId, data, length);
+            tcp->disconnect(connectionId);
+        }
+    }
+};
+
+struct EchoClient
+{
+    Result* result = nullptr;
+    uint32_t* finished = nullptr;
+    tcp_pcb* pcb = nullptr;
+    uint64_t started = 0;
+    uint32_t received = 0;
+
+    void start()
+    {
+        started = now();
+        pcb = tcp_new();
+        tcp_arg(pcb, this);
+        tcp_recv(pcb, _recv);
+        tcp_err(pcb, _error);
+        ip_addr_t addr = localhost();
+        tcp_connect(pcb, &addr, TCPPort, _connected);
+    }
+
+    void done(bool failed)
+    {
+        if (failed) {
+            result->failed++;
+        } else {
+            result->count++;
+        }
+        (*finished)++;
+    }
+
+    static err_t _connected(void* arg, tcp_pcb* pcb, err_t err)
+    {
+        EchoClient* client = reinterpret_cast<EchoClient*>(arg);
+        client->result->latencies.push_back(now() - client->started);
+        tcp_write(pcb, "hello\n", 6, TCP_WRITE_FLAG_COPY);
+        tcp_output(pcb);
+        return ERR_OK;
+    }
+
+    static err_t _recv(void* arg, tcp_pcb* pcb, pbuf* p, err_t err)
+    {
+        EchoClient* client = reinterpret_cast<EchoClient*>(arg);
+        if (p) {
+            client->received += p->tot_len;
+            tcp_recved(pcb, p->tot_len);
+            pbuf_free(p);
+            return ERR_OK;
+        }
+
+        // Hung up on
+        tcp_arg(pcb, nullptr);
+        tcp_recv(pcb, nullptr);
+        tcp_err(pcb, nullptr);
+        tcp_close(pcb);
+        client->done(client->received != 6);
+        return ERR_OK;
+    }
+
+    static void _error(void* arg, err_t err)
+    {
+        reinterpret_cast<EchoClient*>(arg)->done(true);
+    }
+};
+
+static Result testConnect(const Options& options)
+{
+    Result result("connect");
+    EchoServer delegate;
+    m8r::EspTCP server;
+    server.init(&delegate, TCPPort, m8r::IPAddr());
+
+    std::vector<std::unique_ptr<EchoClient>> clients;
+    uint32_t started = 0;
+    uint32_t finished = 0;
+    uint32_t concurrent = server.maxConnections();
+
+    m8r::LwipLoopback::resetStats();
+    uint64_t start = now();
+    result.success = run([&]() {
+        while (started < options.count && started - finished < concurrent) {
+            clients.emplace_back(new EchoClient());
+            clients.back()->result = &result;
+            clients.back()->finished = &finished;
+            clients.back()->start();
+            started++;
+        }
+        return finished == options.count;
+    });
+    finish(result, start);
+    settle();
+    return result;
+}
+
+//
+// throughput
+//
+
+struct Stream
+{
+    Result* result = nullptr;
+    tcp_pcb* pcb = nullptr;
+    int16_t connectionId = -1;
+    bool connected = false;
+    bool failed = false;
+    uint32_t sent = 0;
+    uint32_t received = 0;
+
+    // End of each write not all received yet, and when it was sent
+    std::deque<std::pair<uint32_t, uint64_t>> writes;
+
+    static err_t _connected(void* arg, tcp_pcb* pcb, err_t err)
+    {
+        reinterpret_cast<Stream*>(arg)->connected = true;
+        return ERR_OK;
+    }
+
+    static err_t _recv(void* arg, tcp_pcb* pcb, pbuf* p, err_t err)
+    {
+        Stream* stream = reinterpret_cast<Stream*>(arg);
+        if (!p) {
+            stream->failed = true;
+            return ERR_OK;
+        }
+
+        uint32_t offset = stream->received;
+        for (pbuf* q = p; q; q = q->next) {
+            if (memcmp(q->payload, _pattern + offset % PatternPeriod, q->len) != 0) {
+                stream->failed = true;
+            }
+            offset += q->len;
+        }
+        stream->received = offset;
+
+        uint64_t t = now();
+        while (!stream->writes.empty() && stream->writes.front().first <= stream->received) {
+            stream->result->latencies.push_back(t - stream->writes.front().second);
+            stream->writes.pop_front();
+        }
+
+        tcp_recved(pcb, p->tot_len);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    static void _error(void* arg, err_t err)
+    {
+        Stream* stream = reinterpret_cast<Stream*>(arg);
+        stream->pcb = nullptr;
+        stream->failed = true;
+    }
+
+    void close()
+    {
+        if (pcb) {
+            tcp_arg(pcb, nullptr);
+            tcp_recv(pcb, nullptr);
+            tcp_err(pcb, nullptr);
+            tcp_close(pcb);
+            pcb = nullptr;
+        }
+    }
+};
+
+class StreamServer : public m8r::TCPDelegate
+{
+public:
+    virtual void TCPevent(m8r::TCP*, Event event, int16_t connectionId, const char*, int16_t) override
+    {
+        if (event == Event::Connected) {
+            lastConnected = connectionId;
+        }
+    }
+
+    int16_t lastConnected = -1;
+};
+
+static Result testThroughput(const Options& options)
+{
+    Result result("throughput");
+    StreamServer delegate;
+    m8r::EspTCP server;
+    server.init(&delegate, TCPPort, m8r::IPAddr());
+    server.setMaxConnections(std::max(uint32_t(server.maxConnections()), options.connections));
+
+    uint16_t writeSize = std::min(options.writeSize, uint16_t(m8r::EspTCP::SendBufferSize));
+
+    // Connect one at a time, so each server connection id is known
+    std::vector<std::unique_ptr<Stream>> streams;
+    for (uint32_t i = 0; i < options.connections && result.success; ++i) {
+        Stream* stream = new Stream();
+        streams.emplace_back(stream);
+        stream->result = &result;
+        stream->pcb = tcp_new();
+        tcp_arg(stream->pcb, stream);
+        tcp_recv(stream->pcb, Stream::_recv);
+        tcp_err(stream->pcb, Stream::_error);
+        ip_addr_t addr = localhost();
+        delegate.lastConnected = -1;
+        tcp_connect(stream->pcb, &addr, TCPPort, Stream::_connected);
+        result.success = run([&]() { return stream->failed || (stream->connected && delegate.lastConnected >= 0); });
+        stream->connectionId = delegate.lastConnected;
+    }
+
+    m8r::LwipLoopback::resetStats();
+    server.resetSendStats();
+    uint64_t start = now();
+    result.success = result.success && run([&]() {
+        bool done = true;
+        for (auto& it : streams) {
+            Stream* stream = it.get();
+            while (stream->sent < options.bytes) {
+                uint16_t length = std::min(uint32_t(writeSize), options.bytes - stream->sent);
+                if (server.sendSpace(stream->connectionId) < length) {
+                    break;
+                }
+                server.send(stream->connectionId, _pattern + stream->sent % PatternPeriod, length);
+                stream->sent += length;
+                stream->writes.emplace_back(stream->sent, now());
+            }
+            if (stream->failed) {
+                return true;
+            }
+            done = done && stream->received == options.bytes;
+        }
+        return done;
+    });
+    finish(result, start);
+
+    for (auto& it : streams) {
+        result.bytes += it->received;
+        if (it->failed || it->received != options.bytes) {
+            result.success = false;
+        }
+        it->close();
+    }
+    result.count = uint32_t(result.latencies.size());
+    result.sendStats = server.sendStats();
+    result.droppedBytes = server.droppedBytes();
+    settle();
+    return result;
+}
+
+//
+// udp
+//
+
+class NullUDPDelegate : public m8r::UDPDelegate
+{
+public:
+    virtual void UDPevent(m8r::UDP*, Event, const char*, uint16_t) override { }
+};
+
+static void datagramReceived(void* arg, udp_pcb* pcb, pbuf* p, ip_addr_t* addr, u16_t port)
+{
+    Result* result = reinterpret_cast<Result*>(arg);
+    uint64_t sent;
+    if (p->tot_len >= sizeof(sent)) {
+        pbuf_copy_partial(p, &sent, sizeof(sent), 0);
+        result->latencies.push_back(now() - sent);
+    }
+    result->count++;
+    result->bytes += p->tot_len;
+    pbuf_free(p);
+}
+
+static Result testUDP(const Options& options)
+{
+    Result result("udp");
+    NullUDPDelegate delegate;
+    m8r::EspUDP sender;
+    sender.init(&delegate);
+
+    udp_pcb* receiver = udp_new();
+    udp_bind(receiver, IP_ADDR_ANY, UDPPort);
+    udp_recv(receiver, datagramReceived, &result);
+
+    uint16_t size = std::max(options.writeSize, uint16_t(sizeof(uint64_t)));
+    std::vector<char> datagram(_pattern, _pattern + size);
+    uint32_t sent = 0;
+
+    m8r::LwipLoopback::resetStats();
+    uint64_t start = now();
+    result.success = run([&]() {
+        // A burst per turn, like a busy sender between task iterations
+        for (uint32_t i = 0; i < 32 && sent < options.count; ++i, ++sent) {
+            uint64_t t = now();
+            memcpy(datagram.data(), &t, sizeof(t));
+            sender.send(m8r::IPAddr(127, 0, 0, 1), UDPPort, datagram.data(), size);
+        }
+        return result.count + m8r::LwipLoopback::stats().datagramsLost == options.count;
+    });
+    finish(result, start);
+    result.failed = result.lwip.datagramsLost;
+
+    udp_remove(receiver);
+    settle();
+    return result;
+}
+
+//
+// batch
+//
+
+struct BatchReceived
+{
+    Result* result;
+    uint32_t datagrams = 0;
+    uint32_t counted = 0;
+};
+
+// Split on '\n', counter records go to counted
+static void batchReceived(void* arg, udp_pcb* pcb, pbuf* p, ip_addr_t* addr, u16_t port)
+{
+    BatchReceived* received = reinterpret_cast<BatchReceived*>(arg);
+    std::vector<char> bytes(p->tot_len + 1);
+    pbuf_copy_partial(p, bytes.data(), p->tot_len, 0);
+    received->datagrams++;
+    received->result->bytes += p->tot_len;
+    pbuf_free(p);
+
+    for (char* record = strtok(bytes.data(), "\n"); record; record = strtok(nullptr, "\n")) {
+        size_t length = strlen(record);
+        const char* value = strchr(record, ':');
+        if (length > 2 && value && strcmp(record + length - 2, "|c") == 0) {
+            received->counted += atoi(value + 1);
+        } else {
+            received->result->count++;
+        }
+    }
+}
+
+static Result testBatch(const Options& options)
+{
+    Result result("batch");
+    BatchReceived received;
+    received.result = &result;
+
+    NullUDPDelegate delegate;
+    m8r::Mad<m8r::EspUDP> udp = m8r::Mad<m8r::EspUDP>::create(m8r::MemoryType::Network);
+    udp->init(&delegate);
+
+    udp_pcb* receiver = udp_new();
+    udp_bind(receiver, IP_ADDR_ANY, UDPPort);
+    udp_recv(receiver, batchReceived, &received);
+
+    uint32_t sent = 0;
+    bool flushed = false;
+
+    m8r::LwipLoopback::resetStats();
+    uint64_t start = now();
+    {
+        m8r::UDPBatcher batcher;
+        batcher.init(udp, m8r::IPAddr(127, 0, 0, 1), UDPPort);
+        result.success = run([&]() {
+            for (uint32_t i = 0; i < 32 && sent < options.count; ++i, ++sent) {
+                char record[32];
+                batcher.send(record, snprintf(record, sizeof(record), "bench.value:%u|g", sent));
+                batcher.count("bench.sent");
+            }
+            if (sent == options.count && !flushed) {
+                batcher.flush();
+                flushed = true;
+            }
+            return flushed && received.datagrams + m8r::LwipLoopback::stats().datagramsLost == batcher.stats().datagrams;
+        });
+        finish(result, start);
+    }
+    result.failed = options.count - result.count;
+    if (!result.lwip.datagramsLost && received.counted != options.count) {
+        printf("batch: counted %u of %u\n", received.counted, options.count);
+        result.success = false;
+    }
+
+    udp_remove(receiver);
+    udp.destroy(m8r::MemoryType::Network);
+    settle();
+    return result;
+}
+
+//
+// mdns
+//
+
+static void mdnsReplyReceived(void* arg, udp_pcb* pcb, pbuf* p, ip_addr_t* addr, u16_t port)
+{
+    *reinterpret_cast<bool*>(arg) = true;
+    pbuf_free(p);
+}
+
+static void writeLabel(std::vector<char>& buffer, const char* label)
+{
+    buffer.push_back(char(strlen(label)));
+    buffer.insert(buffer.end(), label, label + strlen(label));
+}
+
+// PTR question for _http._tcp.local, with the responder's PTR record as a
+// known answer if knownAnswer is set
+static std::vector<char> ptrQuery(bool knownAnswer)
+{
+    std::vector<char> query { 0, 0, 0, 0, 0, 1, 0, char(knownAnswer ? 1 : 0), 0, 0, 0, 0 };
+    writeLabel(query, "_http");
+    writeLabel(query, "_tcp");
+    writeLabel(query, "local");
+    query.insert(query.end(), { 0, 0, 12, 0, 1 });
+    if (knownAnswer) {
+        // Compressed to point at the question's name, TTL 120
+        query.insert(query.end(), { char(0xc0), 12, 0, 12, 0, 1, 0, 0, 0, 120, 0, 11 });
+        writeLabel(query, "m8rbench");
+        query.insert(query.end(), { char(0xc0), 12 });
+    }
+    return query;
+}
+
+static Result testMDNS(const Options& options)
+{
+    Result result("mdns");
+    std::vector<char> query = ptrQuery(false);
+
+    m8r::Mad<m8r::EspUDP> udp = m8r::Mad<m8r::EspUDP>::create(m8r::MemoryType::Network);
+    {
+        m8r::MDNSResponder responder;
+        responder.setMinInterval(0);
+        responder.setResponseDelay(0, 0);
+        udp->init(&responder, MDNSPort);
+        responder.init("m8rbench", 0, 120, udp);
+        responder.addService(80, "m8rbench", "http");
+        settle();
+
+        bool replied = false;
+        udp_pcb* querier = udp_new();
+        udp_bind(querier, IP_ADDR_ANY, MDNSPort);
+        udp_recv(querier, mdnsReplyReceived, &replied);
+        ip_addr_t group;
+        IP4_ADDR(&group, 224, 0, 0, 251);
+
+        // Wait this long for a reply before counting the query as lost
+        uint64_t waitUs = 10000 + 2 * m8r::LwipLoopback::config().latencyUs;
+
+        m8r::LwipLoopback::resetStats();
+        uint64_t start = now();
+        for (uint32_t i = 0; i < options.count && result.success; ++i) {
+            pbuf* p = pbuf_alloc(PBUF_TRANSPORT, uint16_t(query.size()), PBUF_RAM);
+            pbuf_take(p, query.data(), uint16_t(query.size()));
+            replied = false;
+            uint64_t sent = now();
+            udp_sendto(querier, p, &group, MDNSPort);
+            pbuf_free(p);
+
+            result.success = run([&]() { return replied || now() - sent > waitUs; });
+            if (replied) {
+                result.latencies.push_back(now() - sent);
+                result.count++;
+            } else {
+                result.failed++;
+            }
+        }
+        finish(result, start);
+
+        udp_remove(querier);
+        settle();
+    }
+    udp.destroy(m8r::MemoryType::Network);
+    return result;
+}
+
+static void mdnsReplyCounted(void* arg, udp_pcb* pcb, pbuf* p, ip_addr_t* addr, u16_t port)
+{
+    reinterpret_cast<Result*>(arg)->count++;
+    pbuf_free(p);
+}
+
+static Result testMDNSStorm(const Options& options)
+{
+    Result result("mdnsstorm");
+    std::vector<char> queries[2] = { ptrQuery(false), ptrQuery(true) };
+
+    m8r::Mad<m8r::EspUDP> udp = m8r::Mad<m8r::EspUDP>::create(m8r::MemoryType::Network);
+    {
+        m8r::MDNSResponder responder;
+        udp->init(&responder, MDNSPort);
+        responder.init("m8rbench", 0, 120, udp);
+        responder.addService(80, "m8rbench", "http");
+        settle();
+        responder.resetStats();
+
+        udp_pcb* querier = udp_new();
+        udp_bind(querier, IP_ADDR_ANY, MDNSPort);
+        udp_recv(querier, mdnsReplyCounted, &result);
+        ip_addr_t group;
+        IP4_ADDR(&group, 224, 0, 0, 251);
+
+        m8r::LwipLoopback::resetStats();
+        uint64_t start = now();
+        for (uint32_t i = 0; i < options.count && result.success; ++i) {
+            const std::vector<char>& query = queries[i & 1];
+            pbuf* p = pbuf_alloc(PBUF_TRANSPORT, uint16_t(query.size()), PBUF_RAM);
+            pbuf_take(p, query.data(), uint16_t(query.size()));
+            udp_sendto(querier, p, &group, MDNSPort);
+            pbuf_free(p);
+
+            uint64_t sent = now();
+            result.success = run([&]() { return now() - sent >= 1000; });
+        }
+
+        // Let the last delayed reply go
+        uint64_t sent = now();
+        run([&]() { return now() - sent >= 200000; });
+        finish(result, start);
+
+        const m8r::MDNSResponder::Stats& stats = responder.stats();
+        printf("             mDNS: %u queries, %u replies, %u known answers, %u rate limited\n",
+               stats.queries, stats.sent, stats.knownAnswerSuppressed, stats.rateLimited);
+
+        udp_remove(querier);
+        settle();
+    }
+    udp.destroy(m8r::MemoryType::Network);
+    return result;
+}
+
+//
+// Results
+//
+
+static void printResult(const Result& r)
+{
+    printf("%-12s %s %8u done %6u failed in %8.3f s, %10.1f/s", r.name, r.success ? "    " : "FAIL",
+           r.count, r.failed, double(r.elapsedUs) / 1000000, r.perSecond());
+    if (r.bytes) {
+        printf(", %8.2f MB/s", r.mbPerSecond());
+    }
+    printf("\n             latency us p50 %8llu p99 %8llu max %8llu\n",
+           (unsigned long long) r.percentile(50), (unsigned long long) r.percentile(99),
+           r.latencies.empty() ? 0ULL : (unsigned long long) r.latencies.back());
+    printf("             lwip: %u segments, %u lost, %u resent, %u chains, %u datagrams, %u lost\n",
+           r.lwip.segments, r.lwip.lost, r.lwip.retransmits, r.lwip.chains, r.lwip.datagrams, r.lwip.datagramsLost);
+    if (r.sendStats.bytes) {
+        printf("             EspTCP: %u bytes/segment, %u flushes, %u bytes dropped\n",
+               r.sendStats.bytesPerSegment(), r.sendStats.flushes, r.droppedBytes);
+    }
+}
+
+static bool writeJSON(const char* filename, const std::vector<Result>& results)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Unable to open '%s' for results\n", filename);
+        return false;
+    }
+
+    const m8r::LwipLoopback::Config& config = m8r::LwipLoopback::config();
+    fprintf(file, "{\n  \"loss\": %g,\n  \"latencyUs\": %u,\n  \"sendBuffer\": %u,\n  \"receiveWindow\": %u,\n"
+                  "  \"pbufSize\": %u,\n  \"chainSegments\": %u,\n  \"tests\": [",
+            config.loss, config.latencyUs, config.sendBuffer, config.receiveWindow, config.pbufSize, config.chainSegments);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"success\": %s, \"count\": %u, \"failed\": %u, \"elapsedUs\": %llu, "
+                      "\"perSecond\": %.1f, \"mbPerSecond\": %.3f, \"p50Us\": %llu, \"p99Us\": %llu, \"maxUs\": %llu, "
+                      "\"segments\": %u, \"lost\": %u, \"retransmits\": %u, \"chains\": %u, "
+                      "\"bytesPerSegment\": %u, \"flushes\": %u, \"droppedBytes\": %u }",
+                i ? "," : "", r.name, r.success ? "true" : "false", r.count, r.failed, (unsigned long long) r.elapsedUs,
+                r.perSecond(), r.mbPerSecond(), (unsigned long long) r.percentile(50), (unsigned long long) r.percentile(99),
+                r.latencies.empty() ? 0ULL : (unsigned long long) r.latencies.back(),
+                r.lwip.segments, r.lwip.lost + r.lwip.datagramsLost, r.lwip.retransmits, r.lwip.chains,
+                r.sendStats.bytesPerSegment(), r.sendStats.flushes, r.droppedBytes);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: m8rlua-netbench [-n count] [-c connections] [-b bytes] [-w bytes]\n"
+                    "                       [-sndbuf bytes] [-wnd bytes] [-loss percent] [-latency us]\n"
+                    "                       [-pbuf bytes] [-chain segments] [-json file]\n"
+                    "                       [connect] [throughput] [udp] [batch] [mdns] [mdnsstorm]\n");
+}
+
+int main(int argc, char * argv[])
+{
+    Options options;
+    m8r::LwipLoopback::Config config;
+    const char* jsonFile = nullptr;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-'; i += 2) {
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        const char* option = argv[i];
+        const char* value = argv[i + 1];
+        if (strcmp(option, "-n") == 0) {
+            options.count = std::max(1, atoi(value));
+        } else if (strcmp(option, "-c") == 0) {
+            options.connections = std::max(1, atoi(value));
+        } else if (strcmp(option, "-b") == 0) {
+            options.bytes = std::max(1, atoi(value));
+        } else if (strcmp(option, "-w") == 0) {
+            options.writeSize = uint16_t(std::min(std::max(1, atoi(value)), 0xffff));
+        } else if (strcmp(option, "-sndbuf") == 0) {
+            config.sendBuffer = uint16_t(std::min(std::max(1, atoi(value)), 0xffff));
+        } else if (strcmp(option, "-wnd") == 0) {
+            config.receiveWindow = uint16_t(std::min(std::max(1, atoi(value)), 0xffff));
+        } else if (strcmp(option, "-loss") == 0) {
+            config.loss = atof(value) / 100;
+        } else if (strcmp(option, "-latency") == 0) {
+            config.latencyUs = atoi(value);
+        } else if (strcmp(option, "-pbuf") == 0) {
+            config.pbufSize = uint16_t(atoi(value));
+        } else if (strcmp(option, "-chain") == 0) {
+            config.chainSegments = uint16_t(std::max(1, atoi(value)));
+        } else if (strcmp(option, "-json") == 0) {
+            jsonFile = value;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
+    m8r::LwipLoopback::setConfig(config);
+    for (uint32_t n = 0; n < sizeof(_pattern); ++n) {
+        _pattern[n] = char(n % PatternPeriod);
+    }
+
+    std::vector<const char*> tests;
+    for ( ; i < argc; ++i) {
+        tests.push_back(argv[i]);
+    }
+    if (tests.empty()) {
+        tests = { "connect", "throughput", "udp", "batch", "mdns" };
+    }
+
+    printf("loss %.1f%%, latency %u us, send buffer %u, window %u, pbufs of %u, chains of %u\n",
+           config.loss * 100, config.latencyUs, config.sendBuffer, config.receiveWindow, config.pbufSize, config.chainSegments);
+
+    std::vector<Result> results;
+    for (auto it : tests) {
+        if (strcmp(it, "connect") == 0) {
+            results.push_back(testConnect(options));
+        } else if (strcmp(it, "throughput") == 0) {
+            results.push_back(testThroughput(options));
+        } else if (strcmp(it, "udp") == 0) {
+            results.push_back(testUDP(options));
+        } else if (strcmp(it, "batch") == 0) {
+            results.push_back(testBatch(options));
+        } else if (strcmp(it, "mdns") == 0) {
+            results.push_back(testMDNS(options));
+        } else if (strcmp(it, "mdnsstorm") == 0) {
+            results.push_back(testMDNSStorm(options));
+        } else {
+            usage();
+            return 1;
+        }
+        printResult(results.back());
+    }
+
+    // Anything left is a leak in the code under test
+    m8r::LwipLoopback::poll();
+    bool success = std::all_of(results.begin(), results.end(), [](const Result& r) { return r.success; });
+    if (m8r::LwipLoopback::pbufsInUse() || m8r::LwipLoopback::tcpPcbsInUse() || m8r::LwipLoopback::udpPcbsInUse()) {
+        printf("Leaked %u pbufs, %u TCP pcbs, %u UDP pcbs\n", m8r::LwipLoopback::pbufsInUse(),
+               m8r::LwipLoopback::tcpPcbsInUse(), m8r::LwipLoopback::udpPcbsInUse());
+        success = false;
+    }
+
+    if (jsonFile && !writeJSON(jsonFile, results)) {
+        success = false;
+    }
+    return success ? 0 : 1;
+}
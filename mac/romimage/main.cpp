@@ -0,0 +1,143 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Compiles Lua scripts into a ROM image for LuaROMImage. Each chunk is
+// named by its script's file name without the directory. The image is
+// mapped back in and every chunk loaded before it's reported as good.
+//
+//     m8rlua-romimage [-c file.c] image.rom script.lua...
+//
+// -c also writes the image as a C array, m8rLuaROM, placed in irom0 so it
+// stays in flash when linked into the firmware. Attach it with
+//
+//     image.attach(m8rLuaROM, m8rLuaROMSize);
+
+#include <stdio.h>
+#include <string.h>
+
+#include "LuaROMImage.h"
+#include "ReadFile.h"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+static bool writeImage(const char* filename, const m8r::Vector<uint8_t>& image)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    bool success = fwrite(image.data(), 1, image.size(), file) == image.size();
+    return fclose(file) == 0 && success;
+}
+
+static bool writeC(const char* filename, const m8r::Vector<uint8_t>& image)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+
+    // Words, since that is how flash has to be read anyway. The image is
+    // always a whole number of them
+    fprintf(file, "// Generated by m8rlua-romimage\n\n#include <stdint.h>\n\n");
+    fprintf(file, "const uint32_t m8rLuaROM[] __attribute__((section(\".irom.text\"), aligned(4))) = {");
+    for (size_t i = 0; i < image.size(); i += 4) {
+        uint32_t word;
+        memcpy(&word, image.data() + i, 4);
+        fprintf(file, "%s0x%08x,", (i % 32) ? " " : "\n    ", static_cast<unsigned int>(word));
+    }
+    fprintf(file, "\n};\n\nconst uint32_t m8rLuaROMSize = %u;\n", static_cast<unsigned int>(image.size()));
+    return fclose(file) == 0;
+}
+
+static bool check(const char* filename)
+{
+    lua::LuaROMImage image;
+    if (!image.map(filename)) {
+        fprintf(stderr, "'%s' is not a ROM image\n", filename);
+        return false;
+    }
+
+    lua_State* L = luaL_newstate();
+    bool success = L;
+    for (uint32_t i = 0; i < image.count() && success; ++i) {
+        char name[lua::LuaROMImage::MaxNameSize];
+        success = image.name(i, name);
+        if (success && image.load(L, name) != LUA_OK) {
+            fprintf(stderr, "%s\n", lua_tostring(L, -1));
+            success = false;
+        }
+        if (success) {
+            printf("    %s\n", name);
+        }
+        lua_settop(L, 0);
+    }
+    if (L) {
+        lua_close(L);
+    }
+    return success;
+}
+
+int main(int argc, char * argv[])
+{
+    const char* cFile = nullptr;
+
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+        cFile = argv[i + 1];
+        i += 2;
+    }
+
+    if (i + 1 >= argc) {
+        fprintf(stderr, "usage: m8rlua-romimage [-c file.c] image.rom script.lua...\n");
+        return 1;
+    }
+
+    const char* imageFile = argv[i++];
+
+    m8r::Vector<m8r::String> sources;
+    m8r::Vector<lua::LuaROMImage::Script> scripts;
+    for ( ; i < argc; ++i) {
+        sources.push_back(m8r::String());
+        if (!readFile(argv[i], sources.back())) {
+            fprintf(stderr, "Unable to open '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // After all the reads, so the sources don't move
+    for (size_t j = 0; j < sources.size(); ++j) {
+        const char* path = argv[argc - sources.size() + j];
+        const char* name = strrchr(path, '/');
+        scripts.push_back({ name ? name + 1 : path, sources[j].c_str(), sources[j].size() });
+    }
+
+    m8r::Vector<uint8_t> image;
+    m8r::String error;
+    if (!lua::LuaROMImage::build(scripts.data(), scripts.size(), image, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    if (!writeImage(imageFile, image)) {
+        fprintf(stderr, "Unable to write '%s'\n", imageFile);
+        return 1;
+    }
+
+    if (cFile && !writeC(cFile, image)) {
+        fprintf(stderr, "Unable to write '%s'\n", cFile);
+        return 1;
+    }
+
+    printf("%s: %d chunks, %d bytes\n", imageFile, int(scripts.size()), int(image.size()));
+    return check(imageFile) ? 0 : 1;
+}
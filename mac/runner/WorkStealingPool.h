@@ -0,0 +1,174 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lua {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: WorkStealingPool
+//
+//  Fixed set of worker threads, each with its own queue of jobs. A worker
+//  runs its own queue front to back and when it runs dry takes a job from
+//  the back of another worker's queue. A job returns true to be run again,
+//  which puts it at the back of the queue of the worker that ran it, so
+//  engines that yield share their worker round robin.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class WorkStealingPool
+{
+public:
+    using Job = std::function<bool(uint32_t worker)>;
+
+    WorkStealingPool(uint32_t threads)
+    {
+        if (threads == 0) {
+            threads = 1;
+        }
+        for (uint32_t i = 0; i < threads; ++i) {
+            _workers.emplace_back(new Worker());
+        }
+        for (uint32_t i = 0; i < threads; ++i) {
+            _workers[i]->thread = std::thread([this, i]() { run(i); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (auto& it : _workers) {
+            it->thread.join();
+        }
+    }
+
+    // Jobs from outside the pool are dealt out to the workers round robin
+    void submit(Job job)
+    {
+        _pending++;
+        push(_nextWorker++ % _workers.size(), std::move(job));
+    }
+
+    // Block until every submitted job has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [this]() { return _pending == 0; });
+    }
+
+    uint32_t threads() const { return uint32_t(_workers.size()); }
+    uint64_t executed(uint32_t worker) const { return _workers[worker]->executed; }
+    uint64_t steals(uint32_t worker) const { return _workers[worker]->steals; }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+        std::thread thread;
+        std::atomic<uint64_t> executed { 0 };
+        std::atomic<uint64_t> steals { 0 };
+    };
+
+    void push(uint32_t worker, Job job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_workers[worker]->mutex);
+            _workers[worker]->jobs.push_back(std::move(job));
+        }
+
+        // Count it under the pool lock so a worker can't check for work
+        // and go to sleep between the push and the notify
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queued++;
+        }
+        _wake.notify_one();
+    }
+
+    bool take(uint32_t worker, Job& job)
+    {
+        {
+            Worker* self = _workers[worker].get();
+            std::lock_guard<std::mutex> lock(self->mutex);
+            if (!self->jobs.empty()) {
+                job = std::move(self->jobs.front());
+                self->jobs.pop_front();
+                _queued--;
+                return true;
+            }
+        }
+
+        // Steal, starting with the next worker so thieves spread out
+        for (uint32_t i = 1; i < _workers.size(); ++i) {
+            Worker* victim = _workers[(worker + i) % _workers.size()].get();
+            std::lock_guard<std::mutex> lock(victim->mutex);
+            if (!victim->jobs.empty()) {
+                job = std::move(victim->jobs.back());
+                victim->jobs.pop_back();
+                _queued--;
+                _workers[worker]->steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(uint32_t worker)
+    {
+        while (true) {
+            Job job;
+            if (take(worker, job)) {
+                _workers[worker]->executed++;
+                if (job(worker)) {
+                    push(worker, std::move(job));
+                } else if (--_pending == 0) {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _idle.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this]() { return _stop || _queued > 0; });
+            if (_stop) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    bool _stop = false;
+
+    // Jobs sitting in a queue and jobs that haven't finished
+    std::atomic<int64_t> _queued { 0 };
+    std::atomic<int64_t> _pending { 0 };
+    std::atomic<uint32_t> _nextWorker { 0 };
+};
+
+}
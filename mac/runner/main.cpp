@@ -0,0 +1,227 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Runs many independent Lua scripts at once, each in its own LuaEngine
+// and lua_State, on a work-stealing pool of threads. Engines are run a
+// time slice at a time, so long scripts don't hold a thread while short
+// ones wait. Reports aggregate scripts per second and the latency of
+// each engine, from submission to finish.
+//
+//     m8rlua-runner [-j threads] [-n copies] [-s slice us] script.lua...
+//
+// Every script is run copies times. Needs LUA_ALLOCATOR_THREADSAFE.
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "LuaAllocator.h"
+#include "LuaEngine.h"
+#include "MacSystemInterface.h"
+#include "ReadFile.h"
+#include "SystemInterface.h"
+#include "WorkStealingPool.h"
+
+#if !LUA_ALLOCATOR_THREADSAFE
+#error m8rlua-runner runs engines on several threads and needs LUA_ALLOCATOR_THREADSAFE=1
+#endif
+
+struct Script
+{
+    const char* filename;
+    m8r::String source;
+};
+
+// One engine and its timings. Only touched by the worker running it,
+// until the pool is done
+struct ScriptTask
+{
+    const Script* script = nullptr;
+    lua::LuaEngine engine;
+    bool loaded = false;
+    bool failed = false;
+    uint32_t slices = 0;
+    uint64_t queued = 0;
+    uint64_t finished = 0;
+    uint64_t runUs = 0;
+    size_t heapPeak = 0;
+
+    uint64_t latency() const { return finished - queued; }
+};
+
+// Run one slice. Returns true if the engine needs to run again
+static bool runSlice(ScriptTask& task)
+{
+    uint64_t start = m8r::SystemInterface::currentMicroseconds();
+    bool again = false;
+
+    if (!task.loaded) {
+        task.loaded = true;
+        if (!task.engine.load(task.script->source.c_str(), task.script->source.size())) {
+            task.failed = true;
+        }
+    }
+
+    if (!task.failed) {
+        m8r::CallReturnValue result = task.engine.execute();
+        if (result.isYield()) {
+            again = true;
+        } else if (!result.isFinished()) {
+            task.failed = true;
+        }
+    }
+
+    uint64_t now = m8r::SystemInterface::currentMicroseconds();
+    task.runUs += now - start;
+    task.slices++;
+    if (!again) {
+        task.finished = now;
+        task.heapPeak = task.engine.heapPeak();
+    }
+    return again;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, uint32_t p)
+{
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, sorted.size() * p / 100)];
+}
+
+static void printLatencies(const char* name, const std::vector<const ScriptTask*>& tasks)
+{
+    std::vector<uint64_t> latencies;
+    uint64_t runUs = 0;
+    uint32_t slices = 0;
+    uint32_t failures = 0;
+    size_t heapPeak = 0;
+    for (auto it : tasks) {
+        latencies.push_back(it->latency());
+        runUs += it->runUs;
+        slices += it->slices;
+        failures += it->failed ? 1 : 0;
+        heapPeak = std::max(heapPeak, it->heapPeak);
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    size_t count = tasks.size();
+    printf("    %-32s %5d runs, latency us p50 %8llu p95 %8llu p99 %8llu max %8llu, run %8.0f us, %5.1f slices, heap peak %6d\n",
+           name, int(count),
+           (unsigned long long) percentile(latencies, 50), (unsigned long long) percentile(latencies, 95),
+           (unsigned long long) percentile(latencies, 99), latencies.empty() ? 0ULL : (unsigned long long) latencies.back(),
+           count ? double(runUs) / count : 0.0, count ? double(slices) / count : 0.0, int(heapPeak));
+    if (failures) {
+        printf("        %d of %d runs failed\n", failures, int(count));
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: m8rlua-runner [-j threads] [-n copies] [-s slice us] script.lua...\n");
+}
+
+int main(int argc, char * argv[])
+{
+    uint32_t threads = std::thread::hardware_concurrency();
+    uint32_t copies = 100;
+    uint32_t sliceUs = LUAENGINE_SLICE_US;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-'; ++i) {
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        if (strcmp(argv[i], "-j") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            copies = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            sliceUs = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (i >= argc) {
+        usage();
+        return 1;
+    }
+
+    m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
+
+    std::vector<std::unique_ptr<Script>> scripts;
+    for ( ; i < argc; ++i) {
+        std::unique_ptr<Script> script(new Script());
+        script->filename = argv[i];
+        if (!readFile(argv[i], script->source)) {
+            fprintf(stderr, "Unable to open '%s', skipping\n", argv[i]);
+            continue;
+        }
+        scripts.push_back(std::move(script));
+    }
+    if (scripts.empty()) {
+        return 1;
+    }
+
+    // Interleave the scripts so every worker gets the same mix
+    std::vector<std::unique_ptr<ScriptTask>> tasks;
+    for (uint32_t copy = 0; copy < copies; ++copy) {
+        for (auto& script : scripts) {
+            std::unique_ptr<ScriptTask> task(new ScriptTask());
+            task->script = script.get();
+            task->engine.setTimeSlice(sliceUs ? LUAENGINE_SLICE_INSTRUCTIONS : 0, sliceUs);
+            tasks.push_back(std::move(task));
+        }
+    }
+
+    printf("Running %d scripts x %d copies on %d threads, %d us slices\n",
+           int(scripts.size()), copies, threads ? threads : 1, sliceUs);
+
+    uint64_t elapsed;
+    {
+        lua::WorkStealingPool pool(threads);
+        uint64_t start = m8r::SystemInterface::currentMicroseconds();
+        for (auto& it : tasks) {
+            ScriptTask* task = it.get();
+            task->queued = m8r::SystemInterface::currentMicroseconds();
+            pool.submit([task](uint32_t) { return runSlice(*task); });
+        }
+        pool.wait();
+        elapsed = m8r::SystemInterface::currentMicroseconds() - start;
+
+        for (uint32_t w = 0; w < pool.threads(); ++w) {
+            printf("    worker %2d: %8llu slices, %6llu stolen\n", w,
+                   (unsigned long long) pool.executed(w), (unsigned long long) pool.steals(w));
+        }
+    }
+
+    printf("%d scripts in %.3f s, %.1f scripts/sec\n", int(tasks.size()), double(elapsed) / 1000000,
+           elapsed ? double(tasks.size()) * 1000000 / elapsed : 0.0);
+
+    std::vector<const ScriptTask*> all;
+    for (auto& script : scripts) {
+        std::vector<const ScriptTask*> forScript;
+        for (auto& it : tasks) {
+            if (it->script == script.get()) {
+                forScript.push_back(it.get());
+            }
+        }
+        printLatencies(script->filename, forScript);
+        all.insert(all.end(), forScript.begin(), forScript.end());
+    }
+    if (scripts.size() > 1) {
+        printLatencies("all", all);
+    }
+
+    bool failed = std::any_of(tasks.begin(), tasks.end(), [](const std::unique_ptr<ScriptTask>& task) { return task->failed; });
+    return failed ? 1 : 0;
+}
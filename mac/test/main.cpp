@@ -11,11 +11,17 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "Application.h"
 #include "MacSystemInterface.h"
 #include "LuaEngine.h"
+#include "LuaSlabAllocator.h"
+#include "LuaStream.h"
 #include "MFS.h"
+#include "MStream.h"
+#include "ReadFile.h"
+#include "SystemInterface.h"
 
 lua::LuaScriptingLanguage luaScriptingLanguage;
 
@@ -23,8 +29,121 @@ const char* fileList[] = {
     "scripts/timing/timing.lua",
 };
 
+// Stream over a string already in memory, so the load benchmark
+// measures the reader path and not the filesystem
+class MemoryStream : public m8r::Stream
+{
+public:
+    MemoryStream(const m8r::String& s) : _string(s) { }
+    
+    virtual int read() const override { return (_index < _string.size()) ? uint8_t(_string[_index++]) : -1; }
+    
+private:
+    const m8r::String& _string;
+    mutable size_t _index = 0;
+};
+
+// Compare lua_load through the Stream reader one byte at a time, in
+// chunks and with the zero-copy buffer path, all on the same source
+static int benchmarkLoad(const char* filename, uint32_t iterations)
+{
+    m8r::String source;
+    if (!readFile(filename, source)) {
+        fprintf(stderr, "Unable to open '%s' for load benchmark\n", filename);
+        return 1;
+    }
+    
+    auto run = [&](const char* name, size_t chunkSize, bool zeroCopy) {
+        uint64_t start = m8r::SystemInterface::currentMicroseconds();
+        for (uint32_t i = 0; i < iterations; ++i) {
+            lua::LuaEngine engine;
+            if (zeroCopy) {
+                lua::LuaMemoryStream stream(source.c_str(), source.size());
+                engine.load(stream);
+            } else {
+                MemoryStream stream(source);
+                engine.setReadChunkSize(chunkSize);
+                engine.load(stream);
+            }
+        }
+        uint64_t elapsed = m8r::SystemInterface::currentMicroseconds() - start;
+        printf("    %-20s %8.2f us/load\n", name, double(elapsed) / iterations);
+    };
+    
+    printf("Load benchmark: '%s', %d bytes, %d iterations\n", filename, int(source.size()), iterations);
+    run("byte at a time", 1, false);
+    run("chunked", lua::LuaEngine::MaxReadChunkSize, false);
+    run("zero copy", 0, true);
+    return 0;
+}
+
+// Replay the same random mix of small allocations and frees through the
+// slab allocator and straight through Mallocator
+static int benchmarkAlloc(uint32_t operations)
+{
+    static constexpr uint32_t MaxLive = 20000;
+    
+    struct Block { void* p; size_t size; };
+    m8r::Vector<Block> live;
+    
+    auto run = [&](const char* name, lua::LuaSlabAllocator* slabs) {
+        uint32_t seed = 1;
+        auto random = [&seed]() { seed = seed * 1103515245 + 12345; return (seed >> 16) & 0x7fff; };
+        auto freeBlock = [&](const Block& block) {
+            if (slabs) {
+                slabs->deallocate(block.p);
+            } else {
+                m8r::Mallocator::shared()->deallocate<char>(m8r::MemoryType::Native, m8r::Mad<char>(reinterpret_cast<char*>(block.p)), block.size);
+            }
+        };
+        
+        live.clear();
+        uint64_t start = m8r::SystemInterface::currentMicroseconds();
+        for (uint32_t i = 0; i < operations; ++i) {
+            if (live.empty() || (live.size() < MaxLive && random() % 3 != 0)) {
+                size_t size = 1 + random() % lua::LuaSlabAllocator::MaxSize;
+                void* p = slabs ? slabs->allocate(size) : m8r::Mallocator::shared()->allocate<char>(m8r::MemoryType::Native, size).get();
+                live.push_back({ p, size });
+            } else {
+                size_t index = random() % live.size();
+                freeBlock(live[index]);
+                live[index] = live[live.size() - 1];
+                live.pop_back();
+            }
+        }
+        uint64_t elapsed = m8r::SystemInterface::currentMicroseconds() - start;
+        
+        printf("    %-12s %10.0f ops/sec", name, elapsed ? double(operations) * 1000000 / elapsed : 0.0);
+        if (slabs) {
+            printf(", %d live bytes in %d slab bytes (%.1f%% used)", int(slabs->usedBytes()), int(slabs->slabBytes()),
+                   slabs->slabBytes() ? 100.0 * slabs->usedBytes() / slabs->slabBytes() : 0.0);
+        }
+        printf("\n");
+
+        for (auto& it : live) {
+            freeBlock(it);
+        }
+    };
+    
+    printf("Allocation benchmark: %d operations, up to %d live blocks of 1-%d bytes\n",
+           operations, MaxLive, int(lua::LuaSlabAllocator::MaxSize));
+    lua::LuaSlabAllocator slabs(m8r::MemoryType::Native);
+    run("slab", &slabs);
+    run("Mallocator", nullptr);
+    return 0;
+}
+
 int main(int argc, char * argv[])
 {
+    if (argc > 2 && strcmp(argv[1], "-bench-load") == 0) {
+        m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
+        return benchmarkLoad(argv[2], (argc > 3) ? atoi(argv[3]) : 1000);
+    }
+    if (argc > 1 && strcmp(argv[1], "-bench-alloc") == 0) {
+        m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
+        return benchmarkAlloc((argc > 2) ? atoi(argv[2]) : 10000000);
+    }
+    
     m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
     m8r::Application application;
     
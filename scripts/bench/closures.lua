@@ -0,0 +1,27 @@
+--
+-- Closure benchmark: creating closures and reading and writing upvalues
+--
+
+local n = 100000
+
+local function counter()
+    local count = 0
+    return function()
+        count = count + 1
+        return count
+    end
+end
+
+local total = 0
+for i = 1, n do
+    local c = counter()
+    c()
+    total = total + c()
+end
+
+local shared = counter()
+for i = 1, n do
+    shared()
+end
+
+assert(total == 2 * n and shared() == n + 1)
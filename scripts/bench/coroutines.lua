@@ -0,0 +1,33 @@
+--
+-- Coroutine benchmark: create, resume and yield
+--
+
+local n = 20000
+
+local function generator(count)
+    return coroutine.wrap(function()
+        for i = 1, count do
+            coroutine.yield(i)
+        end
+    end)
+end
+
+local sum = 0
+for i = 1, n // 10 do
+    for value in generator(10) do
+        sum = sum + value
+    end
+end
+
+local co = coroutine.create(function(a)
+    while true do
+        a = coroutine.yield(a + 1)
+    end
+end)
+local value = 0
+for i = 1, n do
+    local _
+    _, value = coroutine.resume(co, value)
+end
+
+assert(sum == (n // 10) * 55 and value == n)
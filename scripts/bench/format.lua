@@ -0,0 +1,13 @@
+--
+-- string.format benchmark with integer, float, string and padded fields
+--
+
+local n = 20000
+
+local length = 0
+for i = 1, n do
+    local s = string.format("%d: %5.2f %s [%-8s] %x", i, i / 7, "value", "pad", i)
+    length = length + #s
+end
+
+assert(length > 0)
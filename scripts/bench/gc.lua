@@ -0,0 +1,20 @@
+--
+-- GC benchmark: lots of short lived tables and strings, with a
+-- window of survivors so the collector has live data to trace
+--
+
+local n = 100000
+local window = 1000
+
+local live = { }
+for i = 1, n do
+    local t = { i, tostring(i), { x = i } }
+    live[i % window + 1] = t
+end
+
+local count = 0
+for _, t in pairs(live) do
+    count = count + 1
+end
+
+assert(count == window)
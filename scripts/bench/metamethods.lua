@@ -0,0 +1,39 @@
+--
+-- Metamethod benchmark: __index, __newindex, __add and __call dispatch
+--
+
+local n = 50000
+
+local Vector = { }
+Vector.__index = Vector
+
+function Vector.new(x, y)
+    return setmetatable({ x = x, y = y }, Vector)
+end
+
+function Vector.__add(a, b)
+    return Vector.new(a.x + b.x, a.y + b.y)
+end
+
+function Vector:length2()
+    return self.x * self.x + self.y * self.y
+end
+
+local v = Vector.new(0, 0)
+local one = Vector.new(1, 1)
+for i = 1, n do
+    v = v + one
+end
+
+local defaults = setmetatable({ }, { __index = function(t, k) return 0 end })
+local writes = 0
+local proxy = setmetatable({ }, { __newindex = function(t, k, value) writes = writes + 1 end })
+local callable = setmetatable({ }, { __call = function(self, a) return a + 1 end })
+
+local sum = 0
+for i = 1, n do
+    sum = sum + defaults[i] + callable(i)
+    proxy[i] = i
+end
+
+assert(v:length2() == 2 * n * n and writes == n)
@@ -0,0 +1,27 @@
+--
+-- String benchmark: concatenation, table.concat and interning of
+-- short strings that are made over and over
+--
+
+local n = 20000
+
+local s = ""
+for i = 1, 2000 do
+    s = s .. i
+end
+
+local parts = { }
+for i = 1, n do
+    parts[#parts + 1] = tostring(i)
+end
+local joined = table.concat(parts, ",")
+
+local count = 0
+for i = 1, n do
+    local key = "name" .. (i % 100)
+    if key == "name0" then
+        count = count + 1
+    end
+end
+
+assert(#s > 0 and #joined > n and count == n // 100)
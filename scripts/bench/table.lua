@@ -0,0 +1,26 @@
+--
+-- Table benchmark: array and hash insert, then lookup
+--
+
+local n = 100000
+
+local array = { }
+for i = 1, n do
+    array[i] = i
+end
+
+local hash = { }
+for i = 1, n do
+    hash["key" .. i] = i
+end
+
+local sum = 0
+for i = 1, n do
+    sum = sum + array[i] + hash["key" .. i]
+end
+
+for i = 1, n, 2 do
+    hash["key" .. i] = nil
+end
+
+assert(sum == n * (n + 1))
@@ -0,0 +1,177 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "LuaAllocator.h"
+
+#include <cstring>
+
+extern "C" {
+    #include "lua.h"
+}
+
+using namespace lua;
+
+#if LUA_ALLOCATOR_THREADSAFE
+std::mutex lua::mallocatorMutex;
+#endif
+
+static inline void* mallocatorAllocate(size_t size)
+{
+    LUA_LOCK_MALLOCATOR;
+    return m8r::Mallocator::shared()->allocate<char>(LuaAllocator::Type, size).get();
+}
+
+static inline void mallocatorDeallocate(void* ptr, size_t size)
+{
+    LUA_LOCK_MALLOCATOR;
+    m8r::Mallocator::shared()->deallocate<char>(LuaAllocator::Type, m8r::Mad<char>(reinterpret_cast<char*>(ptr)), size);
+}
+
+lua_State* LuaAllocator::newState(size_t limit)
+{
+    LuaAllocator* allocator = new LuaAllocator();
+    allocator->setLimit(limit);
+    lua_State* L = lua_newstate(alloc, allocator);
+    if (!L) {
+        delete allocator;
+    }
+    return L;
+}
+
+void LuaAllocator::close(lua_State* L)
+{
+    LuaAllocator* allocator = get(L);
+    lua_close(L);
+    delete allocator;
+}
+
+LuaAllocator* LuaAllocator::get(lua_State* L)
+{
+    void* ud = nullptr;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    return (f == alloc) ? reinterpret_cast<LuaAllocator*>(ud) : nullptr;
+}
+
+void* LuaAllocator::allocate(size_t size)
+{
+#if LUA_USE_SLAB_ALLOCATOR
+    void* p = LuaSlabAllocator::handles(size) ? _slabs.allocate(size) : mallocatorAllocate(size);
+#else
+    void* p = mallocatorAllocate(size);
+#endif
+    if (!p) {
+        return nullptr;
+    }
+
+    _bytes += size;
+    if (_bytes > _peak) {
+        _peak = _bytes;
+    }
+    _allocations++;
+    return p;
+}
+
+void LuaAllocator::deallocate(void* ptr, size_t size)
+{
+#if LUA_USE_SLAB_ALLOCATOR
+    // A failed shrink can leave a small size on a system block, so ask
+    // the slabs rather than going by size alone
+    if (!LuaSlabAllocator::handles(size) || !_slabs.deallocate(ptr)) {
+        mallocatorDeallocate(ptr, size);
+    }
+#else
+    mallocatorDeallocate(ptr, size);
+#endif
+    _bytes -= size;
+    _frees++;
+}
+
+size_t LuaAllocator::takeRealSize(void* ptr, size_t size)
+{
+    for (uint32_t i = 0; i < _oversizedCount; ++i) {
+        if (_oversized[i].ptr == ptr) {
+            size = _oversized[i].size;
+            _oversized[i] = _oversized[--_oversizedCount];
+            break;
+        }
+    }
+    return size;
+}
+
+void* LuaAllocator::alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    LuaAllocator* allocator = reinterpret_cast<LuaAllocator*>(ud);
+
+    // When ptr is null, osize is the type of the object being created, not a size
+    if (!ptr) {
+        osize = 0;
+    } else if (allocator->_oversizedCount) {
+        osize = allocator->takeRealSize(ptr, osize);
+    }
+
+    if (nsize == 0) {
+        if (ptr) {
+            allocator->deallocate(ptr, osize);
+        }
+        return nullptr;
+    }
+
+    if (nsize == osize) {
+        return ptr;
+    }
+
+#if LUA_USE_SLAB_ALLOCATOR
+    // Resizing within one size class doesn't need to move
+    if (ptr && LuaSlabAllocator::handles(osize) && LuaSlabAllocator::handles(nsize) &&
+            LuaSlabAllocator::sizeClass(osize) == LuaSlabAllocator::sizeClass(nsize)) {
+        if (allocator->_limit && nsize > osize && allocator->_bytes - osize + nsize > allocator->_limit) {
+            allocator->_failures++;
+            return nullptr;
+        }
+        allocator->_bytes = allocator->_bytes - osize + nsize;
+        if (allocator->_bytes > allocator->_peak) {
+            allocator->_peak = allocator->_bytes;
+        }
+        return ptr;
+    }
+#endif
+
+    // The old block is given back below, so only the growth counts
+    // against the limit. A shrink is never refused for the limit
+    bool shrinking = ptr && nsize < osize;
+    if (!shrinking && allocator->_limit && allocator->_bytes - osize + nsize > allocator->_limit) {
+        allocator->_failures++;
+        return nullptr;
+    }
+
+    // Mallocator has no realloc, so move the block
+    void* p = allocator->allocate(nsize);
+    if (!p) {
+        if (shrinking && allocator->_oversizedCount < MaxOversized) {
+            // Keep the bigger block. It stays counted at its real size,
+            // which is what it's given back with
+            allocator->_oversized[allocator->_oversizedCount++] = { ptr, osize };
+            return ptr;
+        }
+        
+        // With nowhere to record its real size, a block kept big would
+        // later be freed at the wrong size. Lua 5.4 takes a failed shrink
+        // like any other failure: it runs an emergency collection, retries
+        // and, if that fails too, either keeps the old block or raises a
+        // memory error
+        allocator->_failures++;
+        return nullptr;
+    }
+
+    if (ptr) {
+        memcpy(p, ptr, (osize < nsize) ? osize : nsize);
+        allocator->deallocate(ptr, osize);
+    }
+    return p;
+}
@@ -0,0 +1,133 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "LuaSlabAllocator.h"
+#include "Mallocator.h"
+#include <cstddef>
+#include <cstdint>
+
+struct lua_State;
+
+// Mallocator category Lua memory is charged to. libm8r doesn't have a
+// Lua specific MemoryType yet, so this defaults to Native
+#ifndef LUA_MEMORY_TYPE
+#define LUA_MEMORY_TYPE m8r::MemoryType::Native
+#endif
+
+// Serve small blocks from a LuaSlabAllocator
+#ifndef LUA_USE_SLAB_ALLOCATOR
+#define LUA_USE_SLAB_ALLOCATOR 1
+#endif
+
+// Serialize the calls into Mallocator, for hosts that run engines on more
+// than one thread. A state is still only ever used by one thread at a time
+#ifndef LUA_ALLOCATOR_THREADSAFE
+#define LUA_ALLOCATOR_THREADSAFE 0
+#endif
+
+#if LUA_ALLOCATOR_THREADSAFE
+#include <mutex>
+#endif
+
+namespace lua {
+
+// Held around each call into Mallocator, here and in LuaSlabAllocator.
+// Slab hits never take it
+#if LUA_ALLOCATOR_THREADSAFE
+extern std::mutex mallocatorMutex;
+#define LUA_LOCK_MALLOCATOR std::lock_guard<std::mutex> mallocatorLock(lua::mallocatorMutex)
+#else
+#define LUA_LOCK_MALLOCATOR
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LuaAllocator
+//
+//  lua_Alloc that gets its memory from m8r::Mallocator. There is one per
+//  lua_State, for the life of the state, so it can report how much that
+//  state is using and fail allocations past an optional limit.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LuaAllocator
+{
+public:
+    static constexpr m8r::MemoryType Type = LUA_MEMORY_TYPE;
+
+    // Create a state that allocates through a new LuaAllocator. Returns
+    // nullptr on failure. States made this way must be closed with close()
+    static lua_State* newState(size_t limit = 0);
+    static void close(lua_State*);
+
+    // Returns the allocator of a state made with newState()
+    static LuaAllocator* get(lua_State*);
+
+    // 0 means no limit. When a request would go past the limit Lua runs an
+    // emergency collection and retries before raising a memory error
+    void setLimit(size_t limit) { _limit = limit; }
+    size_t limit() const { return _limit; }
+
+    size_t bytes() const { return _bytes; }
+    size_t peak() const { return _peak; }
+    uint32_t allocations() const { return _allocations; }
+    uint32_t frees() const { return _frees; }
+    uint32_t failures() const { return _failures; }
+
+#if LUA_USE_SLAB_ALLOCATOR
+    const LuaSlabAllocator& slabs() const { return _slabs; }
+#endif
+
+    // Start peak and counts over from the current usage
+    void resetStats()
+    {
+        _peak = _bytes;
+        _allocations = 0;
+        _frees = 0;
+        _failures = 0;
+    }
+
+private:
+    static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+    void* allocate(size_t size);
+    void deallocate(void* ptr, size_t size);
+    
+    // The real size of ptr, which Lua knows as size. Forgets it if ptr was
+    // kept big by a failed shrink
+    size_t takeRealSize(void* ptr, size_t size);
+
+    size_t _limit = 0;
+    size_t _bytes = 0;
+    size_t _peak = 0;
+    uint32_t _allocations = 0;
+    uint32_t _frees = 0;
+    uint32_t _failures = 0;
+    
+    // Blocks a shrink couldn't replace, still at their old size. There is
+    // no memory to grow a list when that happens, so it's fixed. If it's
+    // full the shrink fails and Lua collects and retries
+    struct Oversized
+    {
+        void* ptr;
+        size_t size;
+    };
+    
+    static constexpr uint32_t MaxOversized = 8;
+    Oversized _oversized[MaxOversized];
+    uint32_t _oversizedCount = 0;
+
+#if LUA_USE_SLAB_ALLOCATOR
+    LuaSlabAllocator _slabs { Type };
+#endif
+};
+
+}
@@ -0,0 +1,159 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "LuaBytecodeCache.h"
+
+#include "MFS.h"
+#include "SystemInterface.h"
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+    #include "lua.h"
+}
+
+using namespace lua;
+
+static constexpr char CacheMagic[4] = { 'm', '8', 'r', 'c' };
+static constexpr size_t CacheReadChunkSize = 256;
+
+struct CacheReader
+{
+    m8r::File* file;
+    char buf[CacheReadChunkSize];
+};
+
+static const char* readCache(lua_State* L, void* data, size_t* size)
+{
+    CacheReader* reader = reinterpret_cast<CacheReader*>(data);
+    int32_t count = reader->file->read(reader->buf, CacheReadChunkSize);
+    *size = (count > 0) ? count : 0;
+    return *size ? reader->buf : nullptr;
+}
+
+static int writeCache(lua_State* L, const void* p, size_t size, void* data)
+{
+    m8r::File* file = reinterpret_cast<m8r::File*>(data);
+    return (file->write(reinterpret_cast<const char*>(p), size) == int32_t(size)) ? 0 : 1;
+}
+
+uint32_t LuaBytecodeCache::hash(const char* data, size_t size, uint32_t h)
+{
+    // 32 bit FNV-1a
+    for (size_t i = 0; i < size; ++i) {
+        h ^= uint8_t(data[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void LuaBytecodeCache::filename(uint32_t key, char* buf) const
+{
+    // Keys that share a file evict each other. The header tells them apart
+    snprintf(buf, MaxPathSize, "%s/%04x.luac", _directory, static_cast<unsigned int>(key % _maxEntries));
+}
+
+bool LuaBytecodeCache::load(lua_State* L, uint32_t key, uint32_t hash, uint32_t size)
+{
+    m8r::FS* fs = m8r::system()->fileSystem();
+    if (!_enabled || !fs) {
+        return false;
+    }
+
+    char path[MaxPathSize];
+    filename(key, path);
+
+    m8r::Mad<m8r::File> file = fs->open(path, m8r::FS::FileOpenMode::Read);
+    if (!file.valid() || !file->valid()) {
+        if (file.valid()) {
+            file.destroy(m8r::MemoryType::Native);
+        }
+        _misses++;
+        return false;
+    }
+
+    Header header;
+    bool valid = file->read(reinterpret_cast<char*>(&header), sizeof(header)) == sizeof(header) &&
+                 memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) == 0 &&
+                 header.luaVersion == LUA_VERSION_NUM &&
+                 header.sourceHash == hash &&
+                 header.sourceSize == size;
+
+    if (valid) {
+        // lundump does its own format and version checks, a failure here
+        // is treated like any other stale entry
+        CacheReader reader;
+        reader.file = file.get();
+        if (lua_load(L, readCache, &reader, "", "b") != LUA_OK) {
+            lua_pop(L, 1);
+            valid = false;
+        }
+    }
+
+    file->close();
+    file.destroy(m8r::MemoryType::Native);
+
+    if (!valid) {
+        fs->remove(path);
+        _misses++;
+        return false;
+    }
+
+    _hits++;
+    return true;
+}
+
+bool LuaBytecodeCache::store(lua_State* L, uint32_t key, uint32_t hash, uint32_t size)
+{
+    m8r::FS* fs = m8r::system()->fileSystem();
+    if (!_enabled || !fs) {
+        return false;
+    }
+
+    fs->makeDirectory(_directory);
+
+    char path[MaxPathSize];
+    filename(key, path);
+
+    m8r::Mad<m8r::File> file = fs->open(path, m8r::FS::FileOpenMode::Write);
+    if (!file.valid()) {
+        return false;
+    }
+
+    Header header;
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.luaVersion = LUA_VERSION_NUM;
+    header.sourceHash = hash;
+    header.sourceSize = size;
+
+    bool success = file->valid() &&
+                   file->write(reinterpret_cast<const char*>(&header), sizeof(header)) == sizeof(header) &&
+                   lua_dump(L, writeCache, file.get(), 0) == 0;
+
+    file->close();
+    file.destroy(m8r::MemoryType::Native);
+
+    if (!success) {
+        // Don't leave a partial file behind
+        fs->remove(path);
+    }
+    return success;
+}
+
+void LuaBytecodeCache::invalidate(uint32_t key)
+{
+    m8r::FS* fs = m8r::system()->fileSystem();
+    if (!fs) {
+        return;
+    }
+
+    char path[MaxPathSize];
+    filename(key, path);
+    fs->remove(path);
+}
@@ -0,0 +1,86 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct lua_State;
+
+// Most files kept in the cache directory
+#ifndef LUABYTECODECACHE_MAX_ENTRIES
+#define LUABYTECODECACHE_MAX_ENTRIES 32
+#endif
+
+namespace lua {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LuaBytecodeCache
+//
+//  Keeps precompiled chunks in the filesystem. Each is stored under a key,
+//  the hash of the source's name when it has one, otherwise the hash of
+//  its text, in one of a fixed number of files picked by the key. So an
+//  edited script overwrites its own entry and the cache never grows past
+//  maxEntries files. A file is only used if its header matches the Lua
+//  version and the size and hash of the source, otherwise it is removed
+//  and the source is parsed again.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LuaBytecodeCache
+{
+public:
+    LuaBytecodeCache(const char* directory = "/sys/cache", uint32_t maxEntries = LUABYTECODECACHE_MAX_ENTRIES)
+        : _directory(directory)
+        , _maxEntries(maxEntries ? maxEntries : 1)
+    { }
+
+    // Pass the hash of what came before to hash a source in pieces
+    static constexpr uint32_t HashStart = 2166136261u;
+    static uint32_t hash(const char* data, size_t size, uint32_t h = HashStart);
+
+    // On a hit, push the cached function onto the stack and return true
+    bool load(lua_State*, uint32_t key, uint32_t hash, uint32_t size);
+
+    // Write the function on top of the stack to the cache, replacing
+    // whatever was stored for key
+    bool store(lua_State*, uint32_t key, uint32_t hash, uint32_t size);
+
+    void invalidate(uint32_t key);
+
+    void setEnabled(bool enabled) { _enabled = enabled; }
+    bool enabled() const { return _enabled; }
+
+    uint32_t hits() const { return _hits; }
+    uint32_t misses() const { return _misses; }
+    void resetCounters() { _hits = 0; _misses = 0; }
+
+private:
+    struct Header
+    {
+        char magic[4];
+        uint32_t luaVersion;
+        uint32_t sourceHash;
+        uint32_t sourceSize;
+    };
+
+    static constexpr size_t MaxPathSize = 64;
+
+    void filename(uint32_t key, char* buf) const;
+
+    const char* _directory;
+    uint32_t _maxEntries;
+    bool _enabled = true;
+    uint32_t _hits = 0;
+    uint32_t _misses = 0;
+};
+
+}
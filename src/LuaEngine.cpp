@@ -9,8 +9,14 @@
 
 #include "LuaEngine.h"
 
+#include "LuaAllocator.h"
+#include "LuaROMImage.h"
+#include "LuaStream.h"
+
+#include "MFS.h"
 #include "MStream.h"
 #include "SystemInterface.h"
+#include <cstring>
 
 extern "C" {
     #include "lua.h"
@@ -20,86 +26,620 @@ extern "C" {
 
 using namespace lua;
 
+//#define LUAENGINE_DEBUG
+
+// Registry keys for the engine using a state and for the flag that says
+// the state already has a collection sentinel
+static const char* EngineKey = "m8r.engine";
+static const char* SentinelKey = "m8r.gcsentinel";
+
+// Lua's own collector settings, from lgc.h. lua_gc takes 0 as "leave it
+// as it is", which on a pooled state is whatever the last engine set, so
+// these stand in for 0
+static constexpr int DefaultGCPause = 200; // LUAI_GCPAUSE
+static constexpr int DefaultGCStepMul = 100; // LUAI_GCMUL
+static constexpr int DefaultGCStepSize = 13; // LUAI_GCSTEPSIZE, log2 of 8KB
+static constexpr int DefaultGCMinorMul = 20; // LUAI_GENMINORMUL
+static constexpr int DefaultGCMajorMul = 100; // LUAI_GENMAJORMUL
+
+static inline int gcParam(int value, int defaultValue)
+{
+    return value ? value : defaultValue;
+}
+
+static inline void debugHeap(const char* where)
+{
+#ifdef LUAENGINE_DEBUG
+    m8r::system()->printf("%s: Free heap: %d\n\n", where, m8r::system()->heapFreeSize());
+#endif
+}
+
+size_t LuaEngine::heapBytes() const
+{
+    return _allocator ? _allocator->bytes() : 0;
+}
+
+size_t LuaEngine::heapPeak() const
+{
+    return _allocator ? _allocator->peak() : _heapPeak;
+}
+
+uint32_t LuaEngine::allocationCount() const
+{
+    return _allocator ? _allocator->allocations() : _allocationCount;
+}
+
 m8r::SharedPtr<m8r::Executable> LuaScriptingLanguage::create() const
 {
-    return m8r::SharedPtr<m8r::Executable>(new LuaEngine());
+    return m8r::SharedPtr<m8r::Executable>(new LuaEngine(this));
 }
 
-const char* LuaEngine::readStream(lua_State* L, void* data, size_t* size)
+void LuaScriptingLanguage::addEngine(LuaEngine* engine) const
+{
+    engine->_prevEngine = nullptr;
+    engine->_nextEngine = _engines;
+    if (_engines) {
+        _engines->_prevEngine = engine;
+    }
+    _engines = engine;
+}
+
+void LuaScriptingLanguage::removeEngine(LuaEngine* engine) const
+{
+    if (_nextToCollect == engine) {
+        _nextToCollect = engine->_nextEngine;
+    }
+    if (engine->_prevEngine) {
+        engine->_prevEngine->_nextEngine = engine->_nextEngine;
+    } else {
+        _engines = engine->_nextEngine;
+    }
+    if (engine->_nextEngine) {
+        engine->_nextEngine->_prevEngine = engine->_prevEngine;
+    }
+    engine->_nextEngine = nullptr;
+    engine->_prevEngine = nullptr;
+}
+
+uint32_t LuaScriptingLanguage::collectGarbage(uint32_t budgetUs) const
 {
-    LuaEngine* engine = reinterpret_cast<LuaEngine*>(data);
-    int c = engine->_stream->read();
-    if (c < 0) {
-        size = 0;
+    uint64_t start = m8r::SystemInterface::currentMicroseconds();
+    uint64_t elapsed = 0;
+    
+    // Stop early once every engine has finished a cycle in this call. A
+    // small engine can finish more than one, so each is only counted once
+    if (++_collectPass == 0) {
+        ++_collectPass;
+    }
+    uint32_t remaining = 0;
+    for (LuaEngine* engine = _engines; engine; engine = engine->_nextEngine) {
+        remaining++;
+    }
+    
+    while (remaining && elapsed < budgetUs) {
+        if (!_nextToCollect) {
+            _nextToCollect = _engines;
+        }
+        LuaEngine* engine = _nextToCollect;
+        _nextToCollect = engine->_nextEngine;
+        
+        uint64_t before = engine->_gcStats.totalUs;
+        if (engine->stepGC()) {
+            if (engine->_collectedPass != _collectPass) {
+                engine->_collectedPass = _collectPass;
+                remaining--;
+            }
+            _gcStats.cycles++;
+        }
+        uint32_t us = engine->_gcStats.totalUs - before;
+        _gcStats.steps++;
+        _gcStats.totalUs += us;
+        if (us > _gcStats.maxUs) {
+            _gcStats.maxUs = us;
+        }
+        elapsed = m8r::SystemInterface::currentMicroseconds() - start;
+    }
+    return uint32_t(elapsed);
+}
+
+struct StreamReader
+{
+    const m8r::Stream* stream;
+    char* buf;
+    size_t size;
+};
+
+struct LuaStreamReader
+{
+    const LuaStream* stream;
+    char* buf;
+    size_t size;
+};
+
+struct BufferReader
+{
+    const char* buf;
+    size_t size;
+};
+
+// Source read from a stream that can't be read again, kept until its hash
+// is known. It's held in fixed blocks so nothing is copied as it grows,
+// and lua_load reads it a block at a time
+static constexpr size_t SourceBlockSize = 1024;
+
+struct SourceBlocks
+{
+    ~SourceBlocks()
+    {
+        for (auto it : blocks) {
+            m8r::Mallocator::shared()->deallocate<char>(m8r::MemoryType::Character, m8r::Mad<char>(it), SourceBlockSize);
+        }
+    }
+    
+    bool append(const char* data, size_t size)
+    {
+        while (size) {
+            size_t offset = total % SourceBlockSize;
+            if (offset == 0) {
+                char* block = m8r::Mallocator::shared()->allocate<char>(m8r::MemoryType::Character, SourceBlockSize).get();
+                if (!block) {
+                    return false;
+                }
+                blocks.push_back(block);
+            }
+            size_t count = SourceBlockSize - offset;
+            if (count > size) {
+                count = size;
+            }
+            memcpy(blocks.back() + offset, data, count);
+            data += count;
+            size -= count;
+            total += count;
+        }
+        return true;
+    }
+    
+    m8r::Vector<char*> blocks;
+    size_t total = 0;
+};
+
+struct BlocksReader
+{
+    const SourceBlocks* source;
+    size_t index;
+};
+
+static const char* readBlocks(lua_State* L, void* data, size_t* size)
+{
+    BlocksReader* reader = reinterpret_cast<BlocksReader*>(data);
+    size_t offset = reader->index * SourceBlockSize;
+    if (offset >= reader->source->total) {
+        *size = 0;
         return nullptr;
     }
+    size_t remaining = reader->source->total - offset;
+    *size = (remaining < SourceBlockSize) ? remaining : SourceBlockSize;
+    return reader->source->blocks[reader->index++];
+}
+
+const char* LuaEngine::readStream(lua_State* L, void* data, size_t* size)
+{
+    StreamReader* reader = reinterpret_cast<StreamReader*>(data);
+    size_t count = 0;
+    while (count < reader->size) {
+        int c = reader->stream->read();
+        if (c < 0) {
+            break;
+        }
+        reader->buf[count++] = char(c);
+    }
     
-    engine->_buf = char(c);
-    *size = 1;
-    return &(engine->_buf);
+    *size = count;
+    return count ? reader->buf : nullptr;
+}
+
+const char* LuaEngine::readLuaStream(lua_State* L, void* data, size_t* size)
+{
+    LuaStreamReader* reader = reinterpret_cast<LuaStreamReader*>(data);
+    *size = reader->stream->read(reader->buf, reader->size);
+    return *size ? reader->buf : nullptr;
+}
+
+const char* LuaEngine::readBuffer(lua_State* L, void* data, size_t* size)
+{
+    // Hand over the whole buffer on the first call, then signal the end
+    BufferReader* reader = reinterpret_cast<BufferReader*>(data);
+    *size = reader->size;
+    reader->size = 0;
+    return *size ? reader->buf : nullptr;
 }
 
 bool LuaEngine::load(const m8r::Stream& stream)
 {
-    m8r::system()->printf("LuaEngine ctos enter: Free heap: %d\n\n", m8r::system()->heapFreeSize());
-    _stream = &stream;
-    _state = luaL_newstate();
-    m8r::system()->printf("LuaEngine after luaL_newstate: Free heap: %d\n\n", m8r::system()->heapFreeSize());
+    char buf[MaxReadChunkSize];
+
+    if (_cache && _cache->enabled()) {
+        StreamReader reader { &stream, buf, MaxReadChunkSize };
+        return loadKeepingSource(readStream, &reader);
+    }
+    
+    StreamReader reader { &stream, buf, _readChunkSize };
+    return loadChunk(readStream, &reader);
+}
+
+bool LuaEngine::load(const LuaStream& stream)
+{
+    size_t size;
+    if (const char* buffer = stream.buffer(size)) {
+        return load(buffer, size);
+    }
+    
+    char buf[MaxReadChunkSize];
+    
+    if (_cache && _cache->enabled()) {
+        if (!stream.mark()) {
+            LuaStreamReader reader { &stream, buf, MaxReadChunkSize };
+            return loadKeepingSource(readLuaStream, &reader);
+        }
+        
+        // Hash it on one pass and only read it again to parse it on a miss.
+        // Both start where the caller left the stream
+        uint32_t hash = LuaBytecodeCache::HashStart;
+        size_t total = 0;
+        while ((size = stream.read(buf, MaxReadChunkSize))) {
+            hash = LuaBytecodeCache::hash(buf, size, hash);
+            total += size;
+        }
+        if (!stream.rewind()) {
+            _error = m8r::Error::Code::InternalError;
+            _nerrors = 1;
+            return false;
+        }
+        LuaStreamReader reader { &stream, buf, _readChunkSize };
+        return loadCached(hash, total, readLuaStream, &reader);
+    }
+    
+    LuaStreamReader reader { &stream, buf, _readChunkSize };
+    return loadChunk(readLuaStream, &reader);
+}
+
+bool LuaEngine::loadFile(const char* path)
+{
+    m8r::FS* fs = m8r::system()->fileSystem();
+    if (!fs) {
+        _error = m8r::Error::Code::InternalError;
+        _nerrors = 1;
+        return false;
+    }
+    
+    m8r::Mad<m8r::File> file = fs->open(path, m8r::FS::FileOpenMode::Read);
+    if (!file.valid() || !file->valid()) {
+        _error = file.valid() ? file->error() : m8r::Error(m8r::Error::Code::InternalError);
+        _nerrors = 1;
+        if (file.valid()) {
+            file.destroy(m8r::MemoryType::Native);
+        }
+        return false;
+    }
+    
+    setSourceName(path);
+    bool success = load(LuaFileStream(file.get()));
+    
+    file->close();
+    file.destroy(m8r::MemoryType::Native);
+    return success;
+}
+
+bool LuaEngine::loadKeepingSource(Reader reader, void* data)
+{
+    SourceBlocks source;
+    uint32_t hash = LuaBytecodeCache::HashStart;
+    const char* chunk;
+    size_t size;
+    while ((chunk = reader(nullptr, data, &size))) {
+        hash = LuaBytecodeCache::hash(chunk, size, hash);
+        if (!source.append(chunk, size)) {
+            _error = m8r::Error::Code::OutOfMemory;
+            _nerrors = 1;
+            return false;
+        }
+    }
+    
+    BlocksReader blocksReader { &source, 0 };
+    return loadCached(hash, source.total, readBlocks, &blocksReader);
+}
+
+bool LuaEngine::load(const char* buffer, size_t size)
+{
+    BufferReader reader { buffer, size };
+    if (!_cache || !_cache->enabled()) {
+        return loadChunk(readBuffer, &reader);
+    }
+    
+    return loadCached(LuaBytecodeCache::hash(buffer, size), size, readBuffer, &reader);
+}
+
+bool LuaEngine::loadCached(uint32_t hash, size_t size, Reader reader, void* data)
+{
+    if (!openState()) {
+        return false;
+    }
+    
+    uint32_t key = _sourceName.empty() ? hash : LuaBytecodeCache::hash(_sourceName.c_str(), _sourceName.size());
+    if (_cache->load(_state, key, hash, size)) {
+        debugHeap("LuaEngine after cache load");
+        return finishLoad(LUA_OK);
+    }
+    
+    int result = lua_load(_state, reader, data, "", nullptr);
+    debugHeap("LuaEngine after lua_load");
+    if (result == LUA_OK) {
+        _cache->store(_state, key, hash, size);
+    }
+    return finishLoad(result);
+}
+
+bool LuaEngine::load(const LuaROMImage& image, const char* name)
+{
+    if (!openState()) {
+        return false;
+    }
+    
+    int result = image.load(_state, name);
+    debugHeap("LuaEngine after ROM load");
+    return finishLoad(result);
+}
+
+bool LuaEngine::loadChunk(Reader reader, void* data)
+{
+    if (!openState()) {
+        return false;
+    }
+    
+    int result = lua_load(_state, reader, data, "", nullptr);
+    debugHeap("LuaEngine after lua_load");
+    return finishLoad(result);
+}
+
+bool LuaEngine::openState()
+{
+    debugHeap("LuaEngine ctos enter");
+    if (_pool) {
+        _state = _pool->acquire();
+        debugHeap("LuaEngine after pool acquire");
+    } else {
+        _state = LuaAllocator::newState();
+        debugHeap("LuaEngine after lua_newstate");
+        if (_state) {
+            luaL_openlibs(_state);
+            debugHeap("LuaEngine after luaL_openlibs");
+        }
+    }
+    
     if (!_state) {
         _error = m8r::Error::Code::OutOfMemory;
         _nerrors = 1;
+        return false;
+    }
+    
+    // Done before the limit is set, so the allocations can't fail.
+    // A pooled state keeps its sentinel from the last engine
+    _gcCollections = 0;
+    lua_pushlightuserdata(_state, this);
+    lua_setfield(_state, LUA_REGISTRYINDEX, EngineKey);
+    if (lua_getfield(_state, LUA_REGISTRYINDEX, SentinelKey) == LUA_TNIL) {
+        newGCSentinel(_state);
+        lua_pushboolean(_state, 1);
+        lua_setfield(_state, LUA_REGISTRYINDEX, SentinelKey);
+    }
+    lua_pop(_state, 1);
+    
+    // The limit is set after the libraries are opened, so it only has to
+    // cover what the script itself uses on top of them
+    _allocator = LuaAllocator::get(_state);
+    if (_allocator) {
+        _allocator->setLimit(_heapLimit ? _allocator->bytes() + _heapLimit : 0);
+        _allocator->resetStats();
+    }
+    
+    applyGCConfig();
+    if (_language) {
+        _language->addEngine(this);
+    }
+    return true;
+}
+
+void LuaEngine::closeState()
+{
+    if (!_state) {
+        return;
     }
     
-    luaL_openlibs(_state);
-    m8r::system()->printf("LuaEngine after luaL_openlibs: Free heap: %d\n\n", m8r::system()->heapFreeSize());
+    if (_language) {
+        _language->removeEngine(this);
+    }
     
-    int result = lua_load(_state, readStream, this, "", nullptr);
-    m8r::system()->printf("LuaEngine after lua_load: Free heap: %d\n\n", m8r::system()->heapFreeSize());
+    if (_allocator) {
+        _heapPeak = _allocator->peak();
+        _allocationCount = _allocator->allocations();
+        _allocator = nullptr;
+    }
+    
+    // Collections from here on, in the pool's reset or in lua_close,
+    // don't belong to this engine
+    lua_pushnil(_state);
+    lua_setfield(_state, LUA_REGISTRYINDEX, EngineKey);
+    
+    if (_pool) {
+        if (_threadIndex >= 0) {
+            luaL_unref(_state, LUA_REGISTRYINDEX, _threadIndex);
+        }
+        if (_functionIndex >= 0) {
+            luaL_unref(_state, LUA_REGISTRYINDEX, _functionIndex);
+        }
+        _pool->release(_state);
+    } else {
+        LuaAllocator::close(_state);
+    }
+    _state = nullptr;
+    _functionIndex = -1;
+    _thread = nullptr;
+    _threadIndex = -1;
+}
+
+bool LuaEngine::finishLoad(int result)
+{
     if (result == LUA_OK) {
         _error = m8r::Error::Code::OK;
         _nerrors = 0;
         _functionIndex = luaL_ref(_state, LUA_REGISTRYINDEX);
+        return true;
+    }
+
+    // On error TOS will have an error string
+    _errorString = lua_tostring(_state, -1);
+    
+    if (result == LUA_ERRSYNTAX) {
+        _error = m8r::Error::Code::ParseError;
+        _nerrors = 1;
     } else {
-        // On error TOS will have an error string
-        _errorString = lua_tostring(_state, -1);
-        
-        if (result == LUA_ERRSYNTAX) {
-            _error = m8r::Error::Code::ParseError;
-            _nerrors = 1;
-        } else {
-            _error = m8r::Error::Code::InternalError;
-            _nerrors = 1;
-        }
-        lua_close(_state);
-        _state = nullptr;
+        _error = m8r::Error::Code::InternalError;
+        _nerrors = 1;
     }
+    closeState();
+    return false;
 }
 
-LuaEngine::~LuaEngine()
+void LuaEngine::setGCConfig(const LuaGCConfig& config)
 {
+    _gcConfig = config;
     if (_state) {
-        lua_close(_state);
-        _state = nullptr;
+        applyGCConfig();
     }
 }
 
+void LuaEngine::applyGCConfig()
+{
+    // Pooled states keep the mode of their last engine, so always set it
+    if (_gcConfig.mode == LuaGCConfig::Mode::Generational) {
+        lua_gc(_state, LUA_GCGEN, gcParam(_gcConfig.minorMul, DefaultGCMinorMul),
+               gcParam(_gcConfig.majorMul, DefaultGCMajorMul));
+    } else {
+        lua_gc(_state, LUA_GCINC, gcParam(_gcConfig.pause, DefaultGCPause),
+               gcParam(_gcConfig.stepMul, DefaultGCStepMul), gcParam(_gcConfig.stepSize, DefaultGCStepSize));
+    }
+}
+
+bool LuaEngine::stepGC(int stepKB)
+{
+    if (!_state) {
+        return false;
+    }
+    
+    uint64_t start = m8r::SystemInterface::currentMicroseconds();
+    bool finishedCycle = lua_gc(_state, LUA_GCSTEP, stepKB) != 0;
+    uint32_t us = uint32_t(m8r::SystemInterface::currentMicroseconds() - start);
+    
+    _gcStats.steps++;
+    _gcStats.totalUs += us;
+    if (us > _gcStats.maxUs) {
+        _gcStats.maxUs = us;
+    }
+    if (finishedCycle) {
+        _gcStats.cycles++;
+    }
+    return finishedCycle;
+}
+
+LuaEngine::~LuaEngine()
+{
+    closeState();
+}
+
+void LuaEngine::sliceHook(lua_State* L, lua_Debug*)
+{
+    // Coroutines the script creates inherit the hook. Yielding one of those
+    // would return to the script's resume, not to execute()
+    LuaEngine* engine = *reinterpret_cast<LuaEngine**>(lua_getextraspace(L));
+    if (L != engine->_thread) {
+        return;
+    }
+    
+    if (engine->_sliceUs && m8r::SystemInterface::currentMicroseconds() - engine->_sliceStart < engine->_sliceUs) {
+        return;
+    }
+    
+    // Can't yield from inside a C function (a table.sort comparator or a
+    // gsub callback). Let it run and try again at the next count
+    if (lua_isyieldable(L)) {
+        lua_yield(L, 0);
+    }
+}
+
+// An unreachable table with a __gc metamethod gets finalized at the end
+// of the collection that frees it. Making a new one from the finalizer
+// every time gives one call per incremental cycle. In generational mode
+// the new one is young, so minor collections call it too
+void LuaEngine::newGCSentinel(lua_State* L)
+{
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushcfunction(L, gcSentinel);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+}
+
+int LuaEngine::gcSentinel(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, EngineKey);
+    LuaEngine* engine = reinterpret_cast<LuaEngine*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if (engine) {
+        engine->_gcCollections++;
+    }
+    
+    // Objects made while the state is closing aren't finalized, so this
+    // stops on its own in lua_close
+    newGCSentinel(L);
+    return 0;
+}
+
 m8r::CallReturnValue LuaEngine::execute()
 {
-    m8r::system()->printf("LuaEngine::execute enter: Free heap: %d\n\n", m8r::system()->heapFreeSize());
+    debugHeap("LuaEngine::execute enter");
     if (!_state) {
         return m8r::CallReturnValue(m8r::Error::Code::InternalError);
     }
 
-    lua_rawgeti(_state, LUA_REGISTRYINDEX, _functionIndex);
-    m8r::system()->printf("LuaEngine::execute before pcall: Free heap: %d\n\n", m8r::system()->heapFreeSize());
-    int status = lua_pcall(_state, 0, 0, 0);
-    if (status != 0) {
-        printf("***** Lua error on exit: returned status %d\n", status);
+    if (!_thread) {
+        // Threads copy the extra space of the main state when they are
+        // created, which is how the hook finds the engine
+        *reinterpret_cast<LuaEngine**>(lua_getextraspace(_state)) = this;
+        _thread = lua_newthread(_state);
+        _threadIndex = luaL_ref(_state, LUA_REGISTRYINDEX);
+        lua_rawgeti(_thread, LUA_REGISTRYINDEX, _functionIndex);
     }
-    lua_close(_state);
-    _state = nullptr;
-    m8r::system()->printf("LuaEngine::execute exit: Free heap: %d\n\n", m8r::system()->heapFreeSize());
-    return status == 0 ?
+    
+    lua_sethook(_thread, _sliceInstructions ? sliceHook : nullptr, _sliceInstructions ? LUA_MASKCOUNT : 0, _sliceInstructions);
+    
+    debugHeap("LuaEngine::execute before resume");
+    _sliceStart = m8r::SystemInterface::currentMicroseconds();
+    int nresults = 0;
+    int status = lua_resume(_thread, _state, 0, &nresults);
+    
+    if (status == LUA_YIELD) {
+        lua_pop(_thread, nresults);
+        return m8r::CallReturnValue(m8r::CallReturnValue::Type::Yield);
+    }
+    
+    if (status != LUA_OK) {
+        const char* error = lua_tostring(_thread, -1);
+        m8r::system()->printf("***** Lua error on exit: returned status %d: %s\n", status, error ? error : "");
+    }
+    closeState();
+    debugHeap("LuaEngine::execute exit");
+    return status == LUA_OK ?
         m8r::CallReturnValue(m8r::CallReturnValue::Type::Finished) :
         m8r::CallReturnValue(m8r::Error::Code::InternalError);
 }
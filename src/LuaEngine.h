@@ -11,21 +11,110 @@
 
 #include "Error.h"
 #include "Executable.h"
+#include "LuaBytecodeCache.h"
+#include "LuaStatePool.h"
 #include "ScriptingLanguage.h"
 
 struct lua_State;
+struct lua_Debug;
 
 namespace m8r {
     class Stream;
 }
 
+// Largest chunk handed to lua_load when reading from a Stream. The buffer
+// lives on the stack for the duration of load()
+#ifndef LUAENGINE_READ_CHUNK_SIZE
+#define LUAENGINE_READ_CHUNK_SIZE 256
+#endif
+
+// Default time slice for execute(). The count hook runs every
+// LUAENGINE_SLICE_INSTRUCTIONS VM instructions and yields once the slice
+// has run for LUAENGINE_SLICE_US (or right away if that is 0)
+#ifndef LUAENGINE_SLICE_INSTRUCTIONS
+#define LUAENGINE_SLICE_INSTRUCTIONS 1000
+#endif
+
+#ifndef LUAENGINE_SLICE_US
+#define LUAENGINE_SLICE_US 10000
+#endif
+
 namespace lua {
 
+class LuaAllocator;
+class LuaEngine;
+class LuaROMImage;
+class LuaStream;
+
+// Collector settings applied to each state when an engine loads. A value
+// of 0 leaves the Lua default in place
+struct LuaGCConfig
+{
+    enum class Mode { Incremental, Generational };
+    
+    Mode mode = Mode::Incremental;
+    
+    // Incremental
+    int pause = 0;
+    int stepMul = 0;
+    int stepSize = 0;
+    
+    // Generational
+    int minorMul = 0;
+    int majorMul = 0;
+};
+
+// Counters for the collection steps run by LuaEngine::stepGC
+struct LuaGCStats
+{
+    uint32_t steps = 0;
+    uint32_t cycles = 0;
+    uint64_t totalUs = 0;
+    uint32_t maxUs = 0;
+};
+
 class LuaScriptingLanguage : public m8r::ScriptingLanguage
 {
 public:
     virtual const char* suffix() const override { return "lua"; }
     virtual m8r::SharedPtr<m8r::Executable> create() const override;
+    
+    LuaBytecodeCache& bytecodeCache() const { return _bytecodeCache; }
+    LuaStatePool& statePool() const { return _statePool; }
+    
+    // Heap limit given to each engine created, 0 for none
+    void setHeapLimit(size_t limit) { _heapLimit = limit; }
+    size_t heapLimit() const { return _heapLimit; }
+    
+    // Collector settings given to each engine created
+    void setGCConfig(const LuaGCConfig& config) { _gcConfig = config; }
+    const LuaGCConfig& gcConfig() const { return _gcConfig; }
+    
+    // Run collection steps on the loaded engines, round robin, for up to
+    // budgetUs. Meant to be called when the task manager is idle so
+    // collection happens between tasks instead of in the middle of them.
+    // Returns the time used.
+    uint32_t collectGarbage(uint32_t budgetUs) const;
+    
+    // Totals for the steps run by collectGarbage
+    const LuaGCStats& gcStats() const { return _gcStats; }
+
+private:
+    friend class LuaEngine;
+    
+    void addEngine(LuaEngine*) const;
+    void removeEngine(LuaEngine*) const;
+
+    mutable LuaBytecodeCache _bytecodeCache;
+    mutable LuaStatePool _statePool;
+    size_t _heapLimit = 0;
+    LuaGCConfig _gcConfig;
+    
+    // Engines with a loaded state
+    mutable LuaEngine* _engines = nullptr;
+    mutable LuaEngine* _nextToCollect = nullptr;
+    mutable uint32_t _collectPass = 0;
+    mutable LuaGCStats _gcStats;
 };
 
 
@@ -40,25 +129,154 @@ public:
 class LuaEngine : public m8r::Executable
 {
 public:
-    LuaEngine() { }
+    static constexpr size_t MaxReadChunkSize = LUAENGINE_READ_CHUNK_SIZE;
+
+    // Without a language there is no bytecode cache or state pool and the
+    // engine isn't visited by collectGarbage
+    LuaEngine(const LuaScriptingLanguage* language = nullptr)
+        : _language(language)
+        , _cache(language ? &language->bytecodeCache() : nullptr)
+        , _pool(language ? &language->statePool() : nullptr)
+    {
+        if (language) {
+            _heapLimit = language->heapLimit();
+            _gcConfig = language->gcConfig();
+        }
+    }
     
     ~LuaEngine();
     
     uint32_t nerrors() const { return _nerrors; }
 
+    // A plain Stream can only be read a byte at a time. Lua source in
+    // memory or in a file loads faster through a LuaStream or loadFile()
     virtual bool load(const m8r::Stream&) override;
+    
+    // Read in blocks, or straight from memory when the stream has the
+    // whole source there. Reading starts where the stream is positioned
+    bool load(const LuaStream&);
+    
+    // Open the file and load it through a LuaFileStream, a block at a
+    // time. The path becomes the source name
+    bool loadFile(const char* path);
+    
+    // Runs the chunk in a coroutine for one time slice. Returns Yield if
+    // the slice ran out (or the script yielded at top level) and the
+    // chunk hasn't finished, in which case call again to continue
     virtual m8r::CallReturnValue execute() override;
 
+    // Load from a buffer already in memory (a string or a mapped file). The
+    // buffer is handed to the lexer as a single chunk without copying and only
+    // needs to stay valid until load returns. When there is a bytecode cache
+    // the source is only parsed on a cache miss.
+    bool load(const char* buffer, size_t size);
+
+    // Load the named chunk from a ROM image. It is already compiled, so
+    // the source and the bytecode cache aren't involved
+    bool load(const LuaROMImage&, const char* name);
+
+    // Where the source of the following loads comes from, usually its
+    // path. Its bytecode cache entry is kept under this name, so a changed
+    // script replaces its old entry. Without one the entry is kept under
+    // the hash of the source
+    void setSourceName(const char* name) { _sourceName = name ? name : ""; }
+
+    // Number of bytes pulled from a Stream per lua_load callback. Clamped
+    // to [1, MaxReadChunkSize]. 1 is the old byte-at-a-time behavior.
+    void setReadChunkSize(size_t size)
+    {
+        _readChunkSize = (size == 0) ? 1 : ((size > MaxReadChunkSize) ? MaxReadChunkSize : size);
+    }
+
+    // Bytes the script may allocate beyond the standard libraries, 0 for
+    // no limit. Takes effect on the next load
+    void setHeapLimit(size_t limit) { _heapLimit = limit; }
+    
+    // Length of each execute() slice. With instructions 0 the chunk runs to
+    // completion in one call. Takes effect on the next execute()
+    void setTimeSlice(uint32_t instructions, uint32_t us)
+    {
+        _sliceInstructions = instructions;
+        _sliceUs = us;
+    }
+    
+    // Lua heap use of this engine. heapBytes() is only meaningful while the
+    // state is alive, heapPeak() and allocationCount() are kept after
+    // execute() finishes
+    size_t heapBytes() const;
+    size_t heapPeak() const;
+    uint32_t allocationCount() const;
+    
+    // Takes effect immediately if the state is loaded, otherwise on load
+    void setGCConfig(const LuaGCConfig&);
+    
+    // Do one bounded collection step of about stepKB kilobytes of work
+    // (0 for a basic step). Returns true if it finished a cycle.
+    bool stepGC(int stepKB = 0);
+    
+    const LuaGCStats& gcStats() const { return _gcStats; }
+    
+    // Collections finished since the last load, whether by stepGC or by
+    // the collector on its own. In incremental mode that is each cycle. In
+    // generational mode the sentinel is always young, so every minor
+    // collection counts as well as every major one. Kept after execute()
+    // finishes
+    uint32_t gcCollections() const { return _gcCollections; }
+
 private:
+    friend class LuaScriptingLanguage;
+    
+    void applyGCConfig();
+    
+    static void sliceHook(lua_State*, lua_Debug*);
+    
+    static void newGCSentinel(lua_State*);
+    static int gcSentinel(lua_State*);
+
     static const char* readStream(lua_State*, void* data, size_t* size);
+    static const char* readLuaStream(lua_State*, void* data, size_t* size);
+    static const char* readBuffer(lua_State*, void* data, size_t* size);
+
+    using Reader = const char* (*)(lua_State*, void*, size_t*);
+    
+    bool loadChunk(Reader, void* data);
+    
+    // Load from the bytecode cache, or from reader on a miss and store it
+    bool loadCached(uint32_t hash, size_t size, Reader, void* data);
+    
+    // Hash the source from reader, keeping it for a load on a miss
+    bool loadKeepingSource(Reader, void* data);
+    bool openState();
+    void closeState();
+    bool finishLoad(int result);
 
     lua_State * _state = nullptr;
+    const LuaScriptingLanguage* _language = nullptr;
+    LuaBytecodeCache* _cache = nullptr;
+    LuaStatePool* _pool = nullptr;
+    LuaAllocator* _allocator = nullptr;
     uint32_t _nerrors = 0;
     m8r::Error _error = m8r::Error::Code::OK;
-    const m8r::Stream* _stream;
     m8r::String _errorString;
+    m8r::String _sourceName;
     int _functionIndex = -1;
-    char _buf;
+    lua_State* _thread = nullptr;
+    int _threadIndex = -1;
+    uint32_t _sliceInstructions = LUAENGINE_SLICE_INSTRUCTIONS;
+    uint32_t _sliceUs = LUAENGINE_SLICE_US;
+    uint64_t _sliceStart = 0;
+    size_t _readChunkSize = MaxReadChunkSize;
+    size_t _heapLimit = 0;
+    size_t _heapPeak = 0;
+    uint32_t _allocationCount = 0;
+    uint32_t _gcCollections = 0;
+    LuaGCConfig _gcConfig;
+    LuaGCStats _gcStats;
+    LuaEngine* _nextEngine = nullptr;
+    LuaEngine* _prevEngine = nullptr;
+    
+    // The last collectGarbage call this engine finished a cycle in
+    uint32_t _collectedPass = 0;
 };
 
 }
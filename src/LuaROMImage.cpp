@@ -0,0 +1,260 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "LuaROMImage.h"
+
+#include <cstring>
+
+#if LUA_ROM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+using namespace lua;
+
+static constexpr char ROMMagic[4] = { 'm', '8', 'r', 'r' };
+static constexpr size_t ROMReadChunkSize = 256;
+
+static_assert(ROMReadChunkSize % 4 == 0, "ROM reads must stay word aligned");
+
+struct ROMReader
+{
+    const uint8_t* src;
+    size_t remaining;
+    uint32_t buf[ROMReadChunkSize / 4];
+};
+
+static inline size_t align4(size_t size)
+{
+    return (size + 3) & ~size_t(3);
+}
+
+void LuaROMImage::readWords(void* dst, const void* src, size_t size)
+{
+    // Through volatile so the compiler can't turn this into a memcpy,
+    // which may do byte loads that flash can't take
+    const volatile uint32_t* s = reinterpret_cast<const volatile uint32_t*>(src);
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    for ( ; size >= 4; size -= 4, d += 4) {
+        uint32_t word = *s++;
+        memcpy(d, &word, 4);
+    }
+    if (size) {
+        // The image is padded to a word, so the last load is in bounds
+        uint32_t word = *s;
+        memcpy(d, &word, size);
+    }
+}
+
+const char* LuaROMImage::readROM(lua_State* L, void* data, size_t* size)
+{
+    ROMReader* reader = reinterpret_cast<ROMReader*>(data);
+    size_t count = (reader->remaining < ROMReadChunkSize) ? reader->remaining : ROMReadChunkSize;
+    if (count) {
+        readWords(reader->buf, reader->src, count);
+        reader->src += count;
+        reader->remaining -= count;
+    }
+    *size = count;
+    return count ? reinterpret_cast<const char*>(reader->buf) : nullptr;
+}
+
+static int writeImage(lua_State* L, const void* p, size_t size, void* data)
+{
+    m8r::Vector<uint8_t>* image = reinterpret_cast<m8r::Vector<uint8_t>*>(data);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(p);
+    image->insert(image->end(), bytes, bytes + size);
+    return 0;
+}
+
+LuaROMImage::~LuaROMImage()
+{
+    detach();
+}
+
+bool LuaROMImage::attach(const void* base, size_t size)
+{
+    detach();
+
+    if (!base || (reinterpret_cast<uintptr_t>(base) & 3) || size < sizeof(Header)) {
+        return false;
+    }
+
+    Header header;
+    readWords(&header, base, sizeof(header));
+    if (memcmp(header.magic, ROMMagic, sizeof(ROMMagic)) != 0 ||
+            header.luaVersion != LUA_VERSION_NUM ||
+            header.size > size || header.size < sizeof(Header) ||
+            header.count > (header.size - sizeof(Header)) / sizeof(Entry)) {
+        return false;
+    }
+
+    _base = reinterpret_cast<const uint32_t*>(base);
+    _size = header.size;
+    _count = header.count;
+    return true;
+}
+
+#if LUA_ROM_MMAP
+bool LuaROMImage::map(const char* filename)
+{
+    detach();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    if (!attach(mapped, st.st_size)) {
+        munmap(mapped, st.st_size);
+        return false;
+    }
+
+    _mapped = mapped;
+    _mappedSize = st.st_size;
+    return true;
+}
+#endif
+
+void LuaROMImage::detach()
+{
+#if LUA_ROM_MMAP
+    if (_mapped) {
+        munmap(_mapped, _mappedSize);
+        _mapped = nullptr;
+        _mappedSize = 0;
+    }
+#endif
+    _base = nullptr;
+    _size = 0;
+    _count = 0;
+}
+
+bool LuaROMImage::entry(uint32_t index, Entry& e) const
+{
+    if (!_base || index >= _count) {
+        return false;
+    }
+
+    readWords(&e, reinterpret_cast<const uint8_t*>(_base) + sizeof(Header) + index * sizeof(Entry), sizeof(Entry));
+    e.name[MaxNameSize - 1] = '\0';
+    return e.offset >= sizeof(Header) + _count * sizeof(Entry) && (e.offset & 3) == 0 &&
+           e.size <= _size && e.offset <= _size - e.size;
+}
+
+bool LuaROMImage::name(uint32_t index, char* buf) const
+{
+    Entry e;
+    if (!entry(index, e)) {
+        return false;
+    }
+    memcpy(buf, e.name, MaxNameSize);
+    return true;
+}
+
+int LuaROMImage::load(lua_State* L, const char* name) const
+{
+    Entry e;
+    for (uint32_t i = 0; i < _count; ++i) {
+        if (!entry(i, e) || strcmp(e.name, name) != 0) {
+            continue;
+        }
+
+        // lundump does its own format and version checks
+        ROMReader reader;
+        reader.src = reinterpret_cast<const uint8_t*>(_base) + e.offset;
+        reader.remaining = e.size;
+        return lua_load(L, readROM, &reader, name, "b");
+    }
+
+    lua_pushfstring(L, "'%s' not in ROM image", name);
+    return LUA_ERRFILE;
+}
+
+bool LuaROMImage::build(const Script* scripts, size_t count, m8r::Vector<uint8_t>& image, m8r::String& error)
+{
+    image.clear();
+
+    size_t tableSize = sizeof(Header) + count * sizeof(Entry);
+    image.resize(tableSize);
+
+    lua_State* L = luaL_newstate();
+    if (!L) {
+        error = "out of memory";
+        return false;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < count && success; ++i) {
+        const Script& script = scripts[i];
+        if (strlen(script.name) >= MaxNameSize) {
+            error = script.name;
+            error += ": name too long";
+            success = false;
+            break;
+        }
+
+        // Text only, so a precompiled chunk can't slip into the image unchecked
+        m8r::String chunkname = "@";
+        chunkname += script.name;
+        if (luaL_loadbufferx(L, script.source, script.size, chunkname.c_str(), "t") != LUA_OK) {
+            error = lua_tostring(L, -1);
+            success = false;
+            break;
+        }
+
+        Entry e;
+        memset(&e, 0, sizeof(e));
+        strncpy(e.name, script.name, MaxNameSize - 1);
+        e.offset = uint32_t(image.size());
+        success = lua_dump(L, writeImage, &image, 1) == 0;
+        lua_pop(L, 1);
+        if (!success) {
+            error = script.name;
+            error += ": dump failed";
+            break;
+        }
+
+        e.size = uint32_t(image.size() - e.offset);
+        image.resize(align4(image.size()));
+        memcpy(image.data() + sizeof(Header) + i * sizeof(Entry), &e, sizeof(e));
+    }
+    lua_close(L);
+
+    if (!success) {
+        image.clear();
+        return false;
+    }
+
+    Header header;
+    memcpy(header.magic, ROMMagic, sizeof(ROMMagic));
+    header.luaVersion = LUA_VERSION_NUM;
+    header.count = uint32_t(count);
+    header.size = uint32_t(image.size());
+    memcpy(image.data(), &header, sizeof(header));
+    return true;
+}
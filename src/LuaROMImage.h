@@ -0,0 +1,115 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "MString.h"
+#include <cstddef>
+#include <cstdint>
+
+struct lua_State;
+
+// Host builds can map an image file with map()
+#ifndef LUA_ROM_MMAP
+#if defined(__APPLE__) || defined(__linux__)
+#define LUA_ROM_MMAP 1
+#else
+#define LUA_ROM_MMAP 0
+#endif
+#endif
+
+namespace lua {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LuaROMImage
+//
+//  Precompiled, stripped Lua chunks in read-only memory, found by name.
+//  On the ESP the image is a const array in irom0, built into the
+//  firmware by m8rlua-romimage -c and read through the flash cache. On
+//  the host it is a file mapped with map(). Loading a chunk needs no
+//  file system, no source text and no parser, and the stripped chunk
+//  has no line info or local names to allocate.
+//
+//  Mapped flash can only be read a word at a time, so everything is read
+//  with aligned 32 bit loads, on the host too, and the bytecode reaches
+//  lua_load through a buffer on the stack.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LuaROMImage
+{
+public:
+    struct Script
+    {
+        const char* name;
+        const char* source;
+        size_t size;
+    };
+
+    static constexpr size_t MaxNameSize = 48;
+
+    LuaROMImage() { }
+    ~LuaROMImage();
+
+    // Use the image at base, which must be word aligned. Returns false if
+    // it isn't an image for this version of Lua
+    bool attach(const void* base, size_t size);
+
+#if LUA_ROM_MMAP
+    bool map(const char* filename);
+#endif
+
+    void detach();
+
+    bool valid() const { return _base; }
+    uint32_t count() const { return _count; }
+
+    // Name of the chunk at index, into buf of MaxNameSize
+    bool name(uint32_t index, char* buf) const;
+
+    // Push the named chunk's function onto the stack. Returns a lua_load
+    // status, with the error message on the stack on failure
+    int load(lua_State*, const char* name) const;
+
+    // Compile the scripts into image, stripped of debug info. On failure
+    // error says which one
+    static bool build(const Script* scripts, size_t count, m8r::Vector<uint8_t>& image, m8r::String& error);
+
+private:
+    struct Header
+    {
+        char magic[4];
+        uint32_t luaVersion;
+        uint32_t count;
+        uint32_t size;
+    };
+
+    struct Entry
+    {
+        char name[MaxNameSize];
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    static void readWords(void* dst, const void* src, size_t size);
+    static const char* readROM(lua_State*, void* data, size_t* size);
+    bool entry(uint32_t index, Entry&) const;
+
+    const uint32_t* _base = nullptr;
+    size_t _size = 0;
+    uint32_t _count = 0;
+
+    // Set when map() made the mapping
+    void* _mapped = nullptr;
+    size_t _mappedSize = 0;
+};
+
+}
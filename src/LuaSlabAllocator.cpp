@@ -0,0 +1,188 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "LuaSlabAllocator.h"
+
+#include "LuaAllocator.h"
+
+using namespace lua;
+
+void* LuaSlabAllocator::allocate(size_t size)
+{
+    uint32_t sc = sizeClass(size);
+    Slab* slab = _partial[sc];
+    if (!slab) {
+        slab = newSlab(sc);
+        if (!slab) {
+            return nullptr;
+        }
+    }
+
+    Block* block = slab->free;
+    slab->free = block->next;
+    slab->used++;
+    if (!slab->free) {
+        // Full, take it off the partial list
+        unlink(slab);
+    }
+
+    _stats[sc].blocksInUse++;
+    _stats[sc].allocations++;
+    return block;
+}
+
+bool LuaSlabAllocator::deallocate(void* ptr)
+{
+    Slab* slab = findSlab(ptr);
+    if (!slab) {
+        return false;
+    }
+
+    bool wasFull = !slab->free;
+    Block* block = reinterpret_cast<Block*>(ptr);
+    block->next = slab->free;
+    slab->free = block;
+    slab->used--;
+    _stats[slab->sizeClass].blocksInUse--;
+
+    if (wasFull) {
+        link(slab);
+    }
+
+    // Keep one empty slab per class so an allocation right after a free
+    // doesn't go back to the system
+    if (slab->used == 0 && (slab->next || slab->prev)) {
+        unlink(slab);
+        freeSlab(slab);
+    }
+    return true;
+}
+
+void LuaSlabAllocator::clear()
+{
+    // _slabs lives in Mallocator memory too, so give it back here
+    LUA_LOCK_MALLOCATOR;
+    for (auto it : _slabs) {
+        m8r::Mallocator::shared()->deallocate<char>(_type, m8r::Mad<char>(reinterpret_cast<char*>(it)), SlabSize);
+    }
+    _slabs = m8r::Vector<Slab*>();
+    for (uint32_t i = 0; i < NumClasses; ++i) {
+        _partial[i] = nullptr;
+        _stats[i] = ClassStats();
+    }
+}
+
+size_t LuaSlabAllocator::usedBytes() const
+{
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < NumClasses; ++i) {
+        bytes += _stats[i].blocksInUse * (i + 1) * Granularity;
+    }
+    return bytes;
+}
+
+LuaSlabAllocator::Slab* LuaSlabAllocator::newSlab(uint32_t sizeClass)
+{
+    LUA_LOCK_MALLOCATOR;
+    Slab* slab = reinterpret_cast<Slab*>(m8r::Mallocator::shared()->allocate<char>(_type, SlabSize).get());
+    if (!slab) {
+        return nullptr;
+    }
+
+    size_t blockSize = (sizeClass + 1) * Granularity;
+    slab->sizeClass = sizeClass;
+    slab->used = 0;
+    slab->capacity = (SlabSize - HeaderSize) / blockSize;
+    slab->next = nullptr;
+    slab->prev = nullptr;
+
+    // Thread the free list through the blocks, lowest address first
+    slab->free = nullptr;
+    char* base = blocks(slab);
+    for (int32_t i = slab->capacity - 1; i >= 0; --i) {
+        Block* block = reinterpret_cast<Block*>(base + i * blockSize);
+        block->next = slab->free;
+        slab->free = block;
+    }
+
+    // Insert in address order
+    size_t lo = 0;
+    size_t hi = _slabs.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (_slabs[mid] < slab) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    _slabs.insert(_slabs.begin() + lo, slab);
+
+    link(slab);
+    _stats[sizeClass].slabs++;
+    return slab;
+}
+
+void LuaSlabAllocator::freeSlab(Slab* slab)
+{
+    LUA_LOCK_MALLOCATOR;
+    for (auto it = _slabs.begin(); it != _slabs.end(); ++it) {
+        if (*it == slab) {
+            _slabs.erase(it);
+            break;
+        }
+    }
+    _stats[slab->sizeClass].slabs--;
+    m8r::Mallocator::shared()->deallocate<char>(_type, m8r::Mad<char>(reinterpret_cast<char*>(slab)), SlabSize);
+}
+
+LuaSlabAllocator::Slab* LuaSlabAllocator::findSlab(void* ptr) const
+{
+    // Find the last slab that starts at or below ptr
+    size_t lo = 0;
+    size_t hi = _slabs.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (reinterpret_cast<char*>(_slabs[mid]) <= reinterpret_cast<char*>(ptr)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return nullptr;
+    }
+
+    Slab* slab = _slabs[lo - 1];
+    return (reinterpret_cast<char*>(ptr) < reinterpret_cast<char*>(slab) + SlabSize) ? slab : nullptr;
+}
+
+void LuaSlabAllocator::link(Slab* slab)
+{
+    slab->prev = nullptr;
+    slab->next = _partial[slab->sizeClass];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    _partial[slab->sizeClass] = slab;
+}
+
+void LuaSlabAllocator::unlink(Slab* slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        _partial[slab->sizeClass] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = nullptr;
+    slab->prev = nullptr;
+}
@@ -0,0 +1,111 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "Mallocator.h"
+#include <cstddef>
+#include <cstdint>
+
+// Size of each slab taken from the system. Must be a multiple of 8
+#ifndef LUA_SLAB_SIZE
+#define LUA_SLAB_SIZE 1024
+#endif
+
+namespace lua {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LuaSlabAllocator
+//
+//  Serves allocations of MaxSize bytes or less from slabs of equal sized
+//  blocks, one free list per 8 byte size class. Strings, tables, closures,
+//  upvalues and CallInfos all fall in here, so they stop fragmenting the
+//  system heap. A slab goes back to the system as soon as it is empty,
+//  unless it is the only one its class has left.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LuaSlabAllocator
+{
+public:
+    static constexpr size_t Granularity = 8;
+    static constexpr size_t MaxSize = 64;
+    static constexpr size_t NumClasses = MaxSize / Granularity;
+    static constexpr size_t SlabSize = LUA_SLAB_SIZE;
+
+    struct ClassStats
+    {
+        uint32_t slabs = 0;
+        uint32_t blocksInUse = 0;
+        uint32_t allocations = 0;
+    };
+
+    LuaSlabAllocator(m8r::MemoryType type) : _type(type) { }
+    ~LuaSlabAllocator() { clear(); }
+
+    static bool handles(size_t size) { return size && size <= MaxSize; }
+    static uint32_t sizeClass(size_t size) { return uint32_t((size - 1) / Granularity); }
+
+    // Returns nullptr if no slab could be allocated
+    void* allocate(size_t size);
+    
+    // Returns false if ptr is not in one of the slabs
+    bool deallocate(void* ptr);
+
+    // Give every slab back, whether it is in use or not
+    void clear();
+
+    const ClassStats& stats(uint32_t sizeClass) const { return _stats[sizeClass]; }
+
+    // Bytes held in slabs and bytes of those handed out. The difference
+    // is what the slabs cost over a perfect fit
+    size_t slabBytes() const { return _slabs.size() * SlabSize; }
+    size_t usedBytes() const;
+
+private:
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct Slab
+    {
+        Slab* next;
+        Slab* prev;
+        Block* free;
+        uint16_t used;
+        uint16_t capacity;
+        uint8_t sizeClass;
+    };
+
+    static constexpr size_t HeaderSize = (sizeof(Slab) + Granularity - 1) & ~(Granularity - 1);
+
+    static char* blocks(Slab* slab) { return reinterpret_cast<char*>(slab) + HeaderSize; }
+
+    Slab* newSlab(uint32_t sizeClass);
+    void freeSlab(Slab*);
+    Slab* findSlab(void* ptr) const;
+
+    void link(Slab*);
+    void unlink(Slab*);
+
+    m8r::MemoryType _type;
+
+    // Slabs with at least one free block, per class
+    Slab* _partial[NumClasses] = { };
+
+    // Every slab, sorted by address, to find the one a pointer is in
+    m8r::Vector<Slab*> _slabs;
+
+    ClassStats _stats[NumClasses];
+};
+
+}
@@ -0,0 +1,346 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "LuaStatePool.h"
+
+#include "LuaAllocator.h"
+#include <cstring>
+
+extern "C" {
+    #include "lua.h"
+    #include "lualib.h"
+    #include "lauxlib.h"
+}
+
+using namespace lua;
+
+// Registry keys for the contents of the globals and library tables
+// right after luaL_openlibs
+static const char* GlobalsSnapshotKey = "m8r.globals";
+static const char* TablesSnapshotKey = "m8r.tables";
+
+// Registry keys for each of those tables' metatable, false for none, and
+// for the string metatable
+static const char* MetatablesSnapshotKey = "m8r.metatables";
+static const char* StringMetatableKey = "m8r.stringmetatable";
+
+// Registry key for the registry's named entries, like the io library's
+// default files. Keys starting with this prefix belong to the pool and
+// the engine and are left alone, as are integer keys, which are refs
+static const char* RegistrySnapshotKey = "m8r.registry";
+static const char* OwnKeyPrefix = "m8r.";
+
+// Push a shallow copy of the table at index
+static void copyTable(lua_State* L, int index)
+{
+    index = (index < 0) ? lua_gettop(L) + index + 1 : index;
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+}
+
+// Make the table at index match the copy at copyIndex
+static void restoreTable(lua_State* L, int index, int copyIndex)
+{
+    index = (index < 0) ? lua_gettop(L) + index + 1 : index;
+    copyIndex = (copyIndex < 0) ? lua_gettop(L) + copyIndex + 1 : copyIndex;
+
+    // Overwrite or remove existing keys. Only existing fields are
+    // assigned, which lua_next allows during a traversal
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, copyIndex);
+        lua_rawset(L, index);
+    }
+
+    // Put back anything that was removed
+    lua_pushnil(L);
+    while (lua_next(L, copyIndex)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, index);
+    }
+}
+
+// True if the key at index is a registry entry the reset puts back
+static bool isRegistryEntry(lua_State* L, int index)
+{
+    if (lua_type(L, index) == LUA_TNUMBER) {
+        return false;
+    }
+    if (lua_type(L, index) == LUA_TSTRING) {
+        return strncmp(lua_tostring(L, index), OwnKeyPrefix, strlen(OwnKeyPrefix)) != 0;
+    }
+    return true;
+}
+
+static void snapshotRegistry(lua_State* L)
+{
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+        if (isRegistryEntry(L, -2)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, RegistrySnapshotKey);
+}
+
+// Like restoreTable, for the entries of the registry
+static void restoreRegistry(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, RegistrySnapshotKey);
+    int copyIndex = lua_gettop(L);
+    
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+        lua_pop(L, 1);
+        if (isRegistryEntry(L, -1)) {
+            lua_pushvalue(L, -1);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, copyIndex);
+            lua_rawset(L, LUA_REGISTRYINDEX);
+        }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, copyIndex)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
+}
+
+static int snapshot(lua_State* L)
+{
+    snapshotRegistry(L);
+    
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    copyTable(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, GlobalsSnapshotKey);
+
+    // Map each library table (and package.loaded) to a copy of its contents
+    lua_newtable(L);
+    int tables = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {
+        if (lua_type(L, -1) == LUA_TTABLE && !lua_rawequal(L, -1, tables - 1)) {
+            copyTable(L, -1);
+            lua_rawset(L, tables);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    copyTable(L, -1);
+    lua_rawset(L, tables);
+
+    // The string metatable's contents are put back like a library's
+    lua_pushliteral(L, "");
+    if (lua_getmetatable(L, -1)) {
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, StringMetatableKey);
+        copyTable(L, -1);
+        lua_rawset(L, tables);
+    }
+    lua_pop(L, 1);
+
+    // And every one of those tables gets its metatable back
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, tables)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        if (!lua_getmetatable(L, -1)) {
+            lua_pushboolean(L, 0);
+        }
+        lua_rawset(L, -4);
+    }
+    lua_pushvalue(L, tables - 1);
+    if (!lua_getmetatable(L, -1)) {
+        lua_pushboolean(L, 0);
+    }
+    lua_rawset(L, -3);
+    lua_setfield(L, LUA_REGISTRYINDEX, MetatablesSnapshotKey);
+
+    lua_setfield(L, LUA_REGISTRYINDEX, TablesSnapshotKey);
+    return 0;
+}
+
+// Give the value on top of the stack's type the metatable on the registry
+// at key, or none if key is null, and pop the value
+static void restoreTypeMetatable(lua_State* L, const char* key)
+{
+    if (key) {
+        lua_getfield(L, LUA_REGISTRYINDEX, key);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+}
+
+static int restore(lua_State* L)
+{
+    // The io library's default input and output, anything put there
+    // through debug.getregistry() and package.loaded itself
+    restoreRegistry(L);
+    
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    lua_getfield(L, LUA_REGISTRYINDEX, GlobalsSnapshotKey);
+    restoreTable(L, -2, -1);
+    lua_pop(L, 2);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, TablesSnapshotKey);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        restoreTable(L, -2, -1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, MetatablesSnapshotKey);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+        lua_setmetatable(L, -2);
+    }
+    lua_pop(L, 1);
+
+    // Only strings have a type metatable after luaL_openlibs, but the
+    // debug library can give one to any type
+    lua_pushliteral(L, "");
+    restoreTypeMetatable(L, StringMetatableKey);
+    lua_pushnil(L);
+    restoreTypeMetatable(L, nullptr);
+    lua_pushboolean(L, 0);
+    restoreTypeMetatable(L, nullptr);
+    lua_pushinteger(L, 0);
+    restoreTypeMetatable(L, nullptr);
+    lua_pushcfunction(L, restore);
+    restoreTypeMetatable(L, nullptr);
+    lua_pushlightuserdata(L, nullptr);
+    restoreTypeMetatable(L, nullptr);
+    lua_pushthread(L);
+    restoreTypeMetatable(L, nullptr);
+    
+    // math.random's state is an upvalue, not in a table. Give it a fresh
+    // seed like a new state gets
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    if (lua_getfield(L, -1, LUA_MATHLIBNAME) == LUA_TTABLE &&
+            lua_getfield(L, -1, "randomseed") == LUA_TFUNCTION) {
+        lua_call(L, 0, 0);
+    } else {
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return 0;
+}
+
+LuaStatePool::~LuaStatePool()
+{
+    clear();
+}
+
+lua_State* LuaStatePool::newState()
+{
+    lua_State* L = LuaAllocator::newState();
+    if (!L) {
+        return nullptr;
+    }
+
+    luaL_openlibs(L);
+    lua_pushcfunction(L, snapshot);
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+        LuaAllocator::close(L);
+        return nullptr;
+    }
+    return L;
+}
+
+bool LuaStatePool::reset(lua_State* L)
+{
+    if (lua_status(L) != LUA_OK) {
+        return false;
+    }
+
+    lua_settop(L, 0);
+    lua_pushcfunction(L, restore);
+    
+    // What the last script left behind is garbage now. It's collected
+    // in bounded steps by the next engine and at idle time, never all at
+    // once here
+    return lua_pcall(L, 0, 0, 0) == LUA_OK;
+}
+
+lua_State* LuaStatePool::acquire()
+{
+    if (!_states.empty()) {
+        lua_State* L = _states.back();
+        _states.pop_back();
+        _reused++;
+        return L;
+    }
+
+    lua_State* L = newState();
+    if (L) {
+        _created++;
+    }
+    return L;
+}
+
+void LuaStatePool::release(lua_State* L)
+{
+    if (!L) {
+        return;
+    }
+
+    // Whatever limit the last engine set doesn't apply to the reset
+    if (LuaAllocator* allocator = LuaAllocator::get(L)) {
+        allocator->setLimit(0);
+    }
+    
+    if (_states.size() >= _maxIdle || !reset(L)) {
+        LuaAllocator::close(L);
+        return;
+    }
+    _states.push_back(L);
+}
+
+void LuaStatePool::clear()
+{
+    for (auto it : _states) {
+        LuaAllocator::close(it);
+    }
+    _states.clear();
+}
+
+void LuaStatePool::setMaxIdle(uint32_t maxIdle)
+{
+    _maxIdle = maxIdle;
+    while (_states.size() > _maxIdle) {
+        LuaAllocator::close(_states.back());
+        _states.pop_back();
+    }
+}
@@ -0,0 +1,67 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include <cstdint>
+
+struct lua_State;
+
+namespace lua {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LuaStatePool
+//
+//  Keeps lua_States with the standard libraries already opened. When a
+//  state is released its registry entries, globals, the library tables,
+//  package.loaded, the metatables of all of those and the type
+//  metatables are put back the way they were after luaL_openlibs, and
+//  math.random is reseeded, so the next script starts from a clean state.
+//  Its garbage is left to the collector's bounded steps.
+//
+//  Every idle state holds its heap, so keep maxIdle small on the ESP.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LuaStatePool
+{
+public:
+    LuaStatePool(uint32_t maxIdle = 1) : _maxIdle(maxIdle) { }
+    ~LuaStatePool();
+
+    // Returns nullptr if a new state can't be created
+    lua_State* acquire();
+
+    // Reset the state and keep it for reuse. It's closed instead if the
+    // pool is full or the reset fails
+    void release(lua_State*);
+
+    // Close all idle states
+    void clear();
+
+    void setMaxIdle(uint32_t maxIdle);
+    uint32_t maxIdle() const { return _maxIdle; }
+    uint32_t idle() const { return uint32_t(_states.size()); }
+
+    uint32_t created() const { return _created; }
+    uint32_t reused() const { return _reused; }
+
+private:
+    static lua_State* newState();
+    static bool reset(lua_State*);
+
+    m8r::Vector<lua_State*> _states;
+    uint32_t _maxIdle;
+    uint32_t _created = 0;
+    uint32_t _reused = 0;
+};
+
+}
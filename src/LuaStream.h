@@ -0,0 +1,130 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "MFS.h"
+#include "MStream.h"
+#include <cstddef>
+#include <cstring>
+
+namespace lua {
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Class: LuaStream
+//
+//  A Stream that Lua source can be read from a block at a time instead of
+//  with a virtual read() per byte. When the source is already in memory
+//  it's handed to lua_load whole, without a copy. The ESP build has no
+//  RTTI to find one of these behind an m8r::Stream, so they go to their
+//  own LuaEngine::load overload.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LuaStream : public m8r::Stream
+{
+public:
+    // Read up to size bytes into buf. Returns the number read, 0 at the end
+    virtual size_t read(char* buf, size_t size) const = 0;
+
+    // The rest of the source, if it's all in memory
+    virtual const char* buffer(size_t& size) const { return nullptr; }
+
+    // Remember where the stream is now, for a second pass from there.
+    // Returns false if it can't go back
+    virtual bool mark() const { return false; }
+    
+    // Go back to where mark() was called
+    virtual bool rewind() const { return false; }
+
+    virtual int read() const override
+    {
+        char c;
+        return read(&c, 1) ? uint8_t(c) : -1;
+    }
+
+    virtual int write(uint8_t) override { return -1; }
+};
+
+// Source in memory that outlives the stream
+class LuaMemoryStream : public LuaStream
+{
+public:
+    LuaMemoryStream(const char* data, size_t size) : _data(data), _size(size) { }
+
+    using LuaStream::read;
+
+    virtual bool eof() const override { return _index >= _size; }
+
+    virtual size_t read(char* buf, size_t size) const override
+    {
+        if (size > _size - _index) {
+            size = _size - _index;
+        }
+        memcpy(buf, _data + _index, size);
+        _index += size;
+        return size;
+    }
+
+    virtual const char* buffer(size_t& size) const override
+    {
+        size = _size - _index;
+        return _data + _index;
+    }
+
+    virtual bool mark() const override
+    {
+        _mark = _index;
+        return true;
+    }
+    
+    virtual bool rewind() const override
+    {
+        _index = _mark;
+        return true;
+    }
+
+private:
+    const char* _data;
+    size_t _size;
+    mutable size_t _index = 0;
+    mutable size_t _mark = 0;
+};
+
+// Source in a file opened for reading, from where it's positioned now
+class LuaFileStream : public LuaStream
+{
+public:
+    LuaFileStream(m8r::File* file) : _file(file) { }
+
+    using LuaStream::read;
+
+    virtual bool eof() const override { return !_file || _file->eof(); }
+
+    virtual size_t read(char* buf, size_t size) const override
+    {
+        int32_t count = _file ? _file->read(buf, uint32_t(size)) : 0;
+        return (count > 0) ? size_t(count) : 0;
+    }
+
+    virtual bool mark() const override
+    {
+        _mark = _file ? _file->tell() : -1;
+        return _mark >= 0;
+    }
+    
+    virtual bool rewind() const override { return _file && _mark >= 0 && _file->seek(_mark); }
+
+private:
+    m8r::File* _file;
+    mutable int32_t _mark = -1;
+};
+
+}